@@ -0,0 +1,92 @@
+#ifndef CSC_H
+#define CSC_H
+
+#include <stdint.h>
+
+/*
+ * Software RGB to YCbCr converter, used when the IFTU can't be.
+ *
+ * It implements the IFTU color transform matrix: 3x3 signed coefficients
+ * with 9 fractional bits, rows Y, Cb, Cr and columns R, G, B, followed by
+ * an offset per row. Chroma is computed from the average of the RGB values
+ * it covers. Scaling is nearest neighbour.
+ */
+
+#define CSC_COEF_BITS		9
+
+enum csc_src_format {
+	CSC_SRC_RGBA8888,	/* R, G, B, A bytes */
+	CSC_SRC_RGBA5551,	/* R in the low bits */
+};
+
+struct csc_matrix {
+	int32_t coef[3][3];
+	int32_t offset[3];
+};
+
+/* Full range matrices have Y in [0, 255], limited range ones in [16, 235] */
+extern const struct csc_matrix csc_matrix_bt601_full;	/* JFIF */
+extern const struct csc_matrix csc_matrix_bt601_limited;
+extern const struct csc_matrix csc_matrix_bt709_full;
+extern const struct csc_matrix csc_matrix_bt709_limited;
+
+/*
+ * Picture adjustments applied in YCbCr space: contrast scales Y around the
+ * black level (the Y offset), saturation scales Cb and Cr, hue rotates them.
+ * Brightness is added to the Y offset, which saturates to [0, 255].
+ */
+struct csc_adjust {
+	int brightness;			/* Added to Y */
+	unsigned int contrast;		/* Percent */
+	unsigned int saturation;	/* Percent */
+	int hue;			/* Degrees */
+};
+
+/*
+ * Folds adjust into base. dst may be base.
+ */
+void csc_matrix_adjust(struct csc_matrix *dst, const struct csc_matrix *base,
+		       const struct csc_adjust *adjust);
+
+/*
+ * read_row returns a pointer to source row y. It may copy the row to buf,
+ * which holds at least width pixels.
+ */
+struct csc_src {
+	enum csc_src_format format;
+	unsigned int width;
+	unsigned int height;
+	const void *(*read_row)(const struct csc_src *src, unsigned int y, void *buf);
+	void *user;
+};
+
+/*
+ * Converts destination rows [band_y, band_y + band_height) of a dst_width x
+ * dst_height image. dst_y and dst_uv point to the first row of the band in
+ * each plane. band_y, band_height and dst_width must be even. row_buf holds
+ * two source rows.
+ */
+int csc_to_nv12(const struct csc_matrix *matrix, const struct csc_src *src,
+		uint8_t *dst_y, uint8_t *dst_uv,
+		unsigned int dst_width, unsigned int dst_height,
+		unsigned int band_y, unsigned int band_height,
+		void *row_buf);
+
+/*
+ * Same for packed YUY2. dst points to the first row of the band.
+ */
+int csc_to_yuy2(const struct csc_matrix *matrix, const struct csc_src *src,
+		uint8_t *dst, unsigned int dst_width, unsigned int dst_height,
+		unsigned int band_y, unsigned int band_height,
+		void *row_buf);
+
+/*
+ * Only scales and swaps R and B, to B, G, R, X bytes. dst points to the
+ * first row of the band and must be 4 byte aligned.
+ */
+int csc_to_bgrx(const struct csc_src *src,
+		uint8_t *dst, unsigned int dst_width, unsigned int dst_height,
+		unsigned int band_y, unsigned int band_height,
+		void *row_buf);
+
+#endif
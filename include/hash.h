@@ -0,0 +1,20 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+/*
+ * 4-lane FNV-style hash, used to tell whether a framebuffer changed. The
+ * lanes start at FRAME_HASH_INIT and are folded together by the caller.
+ */
+
+#define FRAME_HASH_INIT		0x811C9DC5
+#define FRAME_HASH_PRIME	0x01000193
+
+/*
+ * Hashes count 32-bit words (count is a multiple of 4) into lanes. The NEON
+ * and the scalar versions produce the same result.
+ */
+void frame_hash_block(uint32_t lanes[4], const uint32_t *data, unsigned int count);
+
+#endif
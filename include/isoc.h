@@ -0,0 +1,58 @@
+#ifndef ISOC_H
+#define ISOC_H
+
+#include "negotiate.h"
+
+/*
+ * Isochronous streaming: every (micro)frame carries a payload of its own of
+ * at most packet_size bytes, header included, packet_size being set by the
+ * alternate setting (bandwidth tier) the host selected. The controller
+ * splits a request into packet_size transactions, one per (micro)frame, so
+ * each request is packed as full packets and a partial one last at most.
+ * A request carries UVC_ISOC_CHUNK_PACKETS packets at most.
+ */
+#define UVC_ISOC_MAX_TIERS		4
+#define UVC_ISOC_CHUNK_PACKETS		32
+#define UVC_ISOC_MAX_PACKET_SIZE	(3 * 1024)
+#define UVC_ISOC_CHUNK_SIZE		(UVC_ISOC_CHUNK_PACKETS * UVC_ISOC_MAX_PACKET_SIZE)
+
+/*
+ * Bandwidth tiers of the current speed, smallest first.
+ */
+struct uvc_isoc_tiers {
+	unsigned int num_tiers;
+	unsigned int packet_size[UVC_ISOC_MAX_TIERS];
+	unsigned int packets_per_second;	/* 8000 at high speed, 1000 at full speed */
+};
+
+/*
+ * Packets a frame of this layout takes: each payload ends with a partial
+ * packet.
+ */
+unsigned int uvc_isoc_frame_packets(const struct uvc_frame_layout *layout,
+				    unsigned int packet_size);
+
+/*
+ * Sets dwMaxPayloadTransferSize of a negotiated setting to the packet size
+ * of the smallest tier that carries it. When none does, the setting is
+ * moved to the closest one that fits: the fastest slower interval of the
+ * frame, else the largest frame of the format that fits, else the same in
+ * the format of def. Returns 0 if the setting fits as is, 1 if it was
+ * moved and -1 if nothing fits (it's left with the largest tier).
+ */
+int uvc_isoc_negotiate(struct uvc_streaming_control *ctrl,
+		       const struct uvc_streaming_control *def,
+		       const struct uvc_negotiate_ops *ops,
+		       const struct uvc_isoc_tiers *tiers);
+
+/*
+ * Packs size bytes of payload data into dst, as packets of at most
+ * packet_size bytes each starting with a copy of header. The EOF bit of
+ * header is only kept on the last packet, if eof. Returns the length of the
+ * packed data.
+ */
+unsigned int uvc_isoc_pack(unsigned char *dst, const unsigned char *data,
+			   unsigned int size, const unsigned char *header,
+			   int eof, unsigned int packet_size);
+
+#endif
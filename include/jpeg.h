@@ -0,0 +1,69 @@
+#ifndef JPEG_H
+#define JPEG_H
+
+#include <stdint.h>
+
+/*
+ * Baseline JPEG encoder for NV12 (4:2:0) input.
+ *
+ * The image is encoded in rows of 16x16 MCUs. Each call to
+ * jpeg_encode_mcu_rows() produces an independent entropy-coded segment
+ * (DC predictors reset, output flushed to a byte boundary), so segments can
+ * be encoded in parallel and joined with RSTn markers, provided a restart
+ * interval of (num_rows * mcu_cols) was written in the headers.
+ */
+
+#define JPEG_MCU_SIZE		16
+
+#define JPEG_MARKER_RST0	0xD0
+#define JPEG_MARKER_EOI		0xD9
+
+struct jpeg_encoder {
+	unsigned int width;
+	unsigned int height;
+	unsigned int mcu_cols;
+	unsigned int mcu_rows;
+	unsigned int quality;
+	uint8_t qt[2][64];		/* Luma/chroma quantization tables, zigzag order */
+	uint32_t qt_recip[2][64];	/* 2^18 / (8 * qt), natural order */
+};
+
+/*
+ * Steers the quality so that frames fit in a byte budget.
+ */
+struct jpeg_rate_control {
+	unsigned int budget;
+	unsigned int quality_min;
+	unsigned int quality_max;
+};
+
+void jpeg_encoder_init(struct jpeg_encoder *enc, unsigned int width,
+		       unsigned int height, unsigned int quality);
+void jpeg_encoder_set_quality(struct jpeg_encoder *enc, unsigned int quality);
+
+/*
+ * Writes SOI, DQT, SOF0, DHT, DRI (if restart_interval != 0) and SOS.
+ * Returns the number of bytes written or < 0 if out_size is too small.
+ */
+int jpeg_write_headers(const struct jpeg_encoder *enc, uint8_t *out,
+		       unsigned int out_size, unsigned int restart_interval);
+
+/*
+ * Encodes MCU rows [first_row, first_row + num_rows). y and uv point to the
+ * start of the NV12 planes, both with a stride of enc->width bytes.
+ * Returns the number of bytes written or < 0 if out_size is too small.
+ */
+int jpeg_encode_mcu_rows(const struct jpeg_encoder *enc, const uint8_t *y,
+			 const uint8_t *uv, unsigned int first_row,
+			 unsigned int num_rows, uint8_t *out,
+			 unsigned int out_size);
+
+/*
+ * Returns the quality to use for the next frame given the size of the
+ * last one, encoded at the current quality.
+ */
+unsigned int jpeg_rate_control_update(const struct jpeg_rate_control *rc,
+				      unsigned int quality,
+				      unsigned int frame_size);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef MJPEG_H
+#define MJPEG_H
+
+#include <psp2kern/types.h>
+
+/*
+ * MJPEG frames are produced in two steps: the source framebuffer is
+ * converted into an NV12 scratch buffer, then each worker of the pool
+ * encodes a band of MCU rows of it into a restart interval, which are
+ * joined with RSTn markers into the destination.
+ */
+
+int mjpeg_init(unsigned int width, unsigned int height);
+void mjpeg_term(void);
+
+/*
+ * NV12 scratch buffer the frame has to be converted into. It's cached
+ * memory: CPU writes have to be cleaned before calling mjpeg_encode().
+ */
+void mjpeg_get_nv12(unsigned char **y, unsigned char **uv);
+
+/*
+ * Encodes the NV12 scratch buffer into dst. The rate control targets
+ * MJPEG_BYTE_RATE at the given frame interval (in 100ns units).
+ * Returns the size of the JPEG or < 0 on error.
+ */
+int mjpeg_encode(unsigned char *dst, unsigned int dst_size,
+		 unsigned int frame_interval);
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef NEGOTIATE_H
+#define NEGOTIATE_H
+
+#include "uvc.h"
+
+/*
+ * Probe/commit negotiation and the frame layouts it reports the sizes of.
+ * The formats and frames come from the device through uvc_negotiate_ops,
+ * so this doesn't depend on the descriptors and also builds on the host.
+ */
+#define UVC_PAYLOAD_HEADER_SIZE		12
+#define UVC_PAYLOAD_SIZE(frame_size)	(UVC_PAYLOAD_HEADER_SIZE + (frame_size))
+
+#define UVC_MAX_FRAME_SLICES		8
+
+/*
+ * Every payload is sent from the frame buffer in a single request, its
+ * header written at the end of a slot right in front of its data. The
+ * data is aligned to the slot size: the IFTU needs 16 bytes, and with a
+ * cache line of its own the header can be written and cleaned without
+ * touching the data.
+ */
+#define UVC_PAYLOAD_HEADER_SLOT		64
+
+/*
+ * Frame buffer layout for a given mode. For NV12 the whole UV plane is
+ * appended to the last payload:
+ *
+ *   [hdr][Y band 0][hdr][Y band 1] ... [hdr][Y band n-1][UV plane]
+ *
+ * Packed formats (YUY2 and RGB32) just have one band per payload.
+ *
+ * Compressed formats use a single payload whose size is only known once
+ * the frame has been encoded.
+ */
+struct uvc_frame_layout {
+	unsigned int width;
+	unsigned int height;
+	int compressed;
+	unsigned int num_slices;
+	unsigned int slice_height;
+	unsigned int uv_offset;				/* UV plane offset from the buffer start */
+	unsigned int offset[UVC_MAX_FRAME_SLICES];	/* Data offset of each payload, after its header slot */
+	unsigned int payload_size[UVC_MAX_FRAME_SLICES];	/* Including the header */
+	unsigned int size;
+};
+
+void uvc_frame_layout_nv12(struct uvc_frame_layout *layout,
+			   unsigned int width, unsigned int height,
+			   unsigned int num_slices);
+void uvc_frame_layout_mjpeg(struct uvc_frame_layout *layout,
+			    unsigned int width, unsigned int height);
+void uvc_frame_layout_packed(struct uvc_frame_layout *layout,
+			     unsigned int width, unsigned int height,
+			     unsigned int bpp, unsigned int num_slices);
+
+/*
+ * A frame descriptor: its size and frame intervals (100ns units).
+ */
+struct uvc_mode {
+	unsigned int width;
+	unsigned int height;
+	unsigned int default_interval;
+	unsigned int num_intervals;
+	unsigned int interval[2];
+};
+
+struct uvc_negotiate_ops {
+	/* Default frame index of a format, 0 if the format doesn't exist */
+	unsigned int (*default_frame)(unsigned int format_index);
+	/* Returns -1 if the frame doesn't exist */
+	int (*mode_get)(unsigned int format_index, unsigned int frame_index,
+			struct uvc_mode *mode);
+	void (*mode_layout)(unsigned int format_index, const struct uvc_mode *mode,
+			    struct uvc_frame_layout *layout);
+};
+
+/*
+ * Turns a probe or commit request into a setting the device supports:
+ * unknown formats and frames fall back to the defaults of def, the
+ * interval is rounded to the nearest one of the frame (0 picks the default
+ * one) and the sizes are the exact ones of the resulting layout, for bulk
+ * streaming.
+ */
+void uvc_negotiate(struct uvc_streaming_control *ctrl,
+		   const struct uvc_streaming_control *req,
+		   const struct uvc_streaming_control *def,
+		   const struct uvc_negotiate_ops *ops);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+
+/*
+ * Frame pacer: decides on which vblanks a frame is captured so that the
+ * long-run rate matches dwFrameInterval exactly. The ideal capture time
+ * advances by exactly one interval per frame (error diffusion), and a frame
+ * is captured on the vblank closest to it. All times are in 100ns units.
+ */
+#define PACER_VBLANK_INTERVAL		166667	/* 60 Hz */
+
+struct uvc_pacer {
+	int running;
+	unsigned int interval;
+	uint64_t deadline;		/* Ideal time of the next frame */
+	uint64_t last_frame;
+	unsigned int frames;
+	unsigned int jitter_min;	/* |actual - ideal frame period| */
+	unsigned int jitter_max;
+	uint64_t jitter_total;
+};
+
+void uvc_pacer_reset(struct uvc_pacer *pacer, unsigned int interval);
+
+/*
+ * Returns 1 if a frame has to be captured at time now. The first call only
+ * starts the pacer: the commit already triggers the first frame. Only the
+ * time matters, so late or coalesced vblank callbacks need no special case.
+ */
+int uvc_pacer_tick(struct uvc_pacer *pacer, uint64_t now);
+
+#endif
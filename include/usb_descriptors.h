@@ -20,14 +20,105 @@
 #define INTERFACE_CTRL_ID		0
 #define INPUT_TERMINAL_ID		1
 #define OUTPUT_TERMINAL_ID		2
+#define EXTENSION_UNIT_ID		3
+#define PROCESSING_UNIT_ID		4
+
+/* Extension Unit control selectors */
+#define UVC_XU_STATS_CONTROL		0x01
+#define UVC_XU_COLORIMETRY_CONTROL	0x02
+#define UVC_XU_PLACEMENT_CONTROL	0x03
+
+/*
+ * UVC_XU_COLORIMETRY_CONTROL values: YCbCr matrix and range of the
+ * uncompressed formats. MJPEG is always full range BT.601 (JFIF).
+ * The color matching descriptors are fixed at enumeration, so the
+ * colorimetry is the build one: the control only reports it.
+ */
+#define COLORIMETRY_BT601_FULL		0
+#define COLORIMETRY_BT601_LIMITED	1
+#define COLORIMETRY_BT709_FULL		2
+#define COLORIMETRY_BT709_LIMITED	3
+
+#define COLORIMETRY_IS_BT709(c)		((c) & 2)
+
+/*
+ * Colorimetry of the uncompressed formats. The color matching descriptors
+ * can't tell the range: hosts assume limited range for uncompressed YCbCr.
+ */
+#ifndef UVC_COLORIMETRY
+#define UVC_COLORIMETRY			COLORIMETRY_BT709_LIMITED
+#endif
+
+/*
+ * UVC_XU_PLACEMENT_CONTROL values: memory the converted frames are
+ * written to. FRAME_PLACEMENT_AUTO picks CDRAM if it has room to spare.
+ */
+#define FRAME_PLACEMENT_PHYCONT		0
+#define FRAME_PLACEMENT_CDRAM		1
+#define FRAME_PLACEMENT_AUTO		2
+
+#ifndef UVC_FRAME_PLACEMENT
+#define UVC_FRAME_PLACEMENT		FRAME_PLACEMENT_PHYCONT
+#endif
+
+/*
+ * Color matching descriptor values of a colorimetry. 1 is BT.709 and 4 is
+ * SMPTE 170M (BT.601) for bColorPrimaries, bTransferCharacteristics and
+ * bMatrixCoefficients alike.
+ */
+#define COLORIMETRY_COLOR_PRIMARIES(c)		(COLORIMETRY_IS_BT709(c) ? 1 : 4)
+#define COLORIMETRY_TRANSFER_CHARACTERISTICS(c)	(COLORIMETRY_IS_BT709(c) ? 1 : 4)
+#define COLORIMETRY_MATRIX_COEFFICIENTS(c)	(COLORIMETRY_IS_BT709(c) ? 1 : 4)
+
+/* {5e8a3d1c-7b2f-4c69-9a0d-3f51c6e2b847} */
+#define UVC_GUID_VITA_STATS \
+	{0x1c, 0x3d, 0x8a, 0x5e, 0x2f, 0x7b, 0x69, 0x4c, \
+	 0x9a, 0x0d, 0x3f, 0x51, 0xc6, 0xe2, 0xb8, 0x47}
 
 #define FORMAT_INDEX_UNCOMPRESSED_NV12	1
+#define FORMAT_INDEX_MJPEG		2
+#define FORMAT_INDEX_UNCOMPRESSED_YUY2	3
+#define FORMAT_INDEX_UNCOMPRESSED_RGB32	4
+
+/*
+ * MEDIASUBTYPE_RGB32: B, G, R, X bytes. Mapped by uvcvideo (V4L2 XBGR32,
+ * BGR4 on older kernels) and by Windows, unlike the R, G, B, X byte order
+ * of the PSVita framebuffer, which no format GUID of these drivers has.
+ * That's why the framebuffer can't be sent as is: RGB32 frames take one
+ * IFTU pass that swaps R and B.
+ */
+#define UVC_GUID_FORMAT_RGB32 \
+	{0x7e, 0xeb, 0x36, 0xe4, 0x4f, 0x52, 0xce, 0x11, \
+	 0x9f, 0x53, 0x00, 0x20, 0xaf, 0x0b, 0xa7, 0x70}
+
+/*
+ * Stream over isochronous endpoints instead of bulk. Alternate setting 0 of
+ * the streaming interface has no endpoint, and each of the next ones is a
+ * bandwidth tier. The host picks the smallest tier that fits the
+ * dwMaxPayloadTransferSize of the commit.
+ */
+#ifndef UVC_ISOC
+#define UVC_ISOC			0
+#endif
+
+#define USB_ENDPOINT_SYNC_ASYNC		(1 << 2)
+
+/* wMaxPacketSize of high speed, high bandwidth endpoints */
+#define USB_ISOC_MAX_PACKET_SIZE(size, mult)	((((mult) - 1) << 11) | (size))
+
+#define UVC_ISOC_NUM_TIERS_HI		4
+#define UVC_ISOC_NUM_TIERS_FULL		1
+
+/* Device clock used for the payload header PTS and SCR fields */
+#define UVC_CLOCK_FREQUENCY		48000000
 
 /*
  * Helper macros
  */
 
 #define VIDEO_FRAME_SIZE_NV12(w, h)		(((w) * (h) * 3) / 2)
+#define VIDEO_FRAME_SIZE_YUY2(w, h)		((w) * (h) * 2)
+#define VIDEO_FRAME_SIZE_RGB32(w, h)		((w) * (h) * 4)
 
 #define FRAME_BITRATE(w, h, bpp, interval)	(((w) * (h) * (bpp)) / ((interval) * 100 * 1E-9))
 #define FPS_TO_INTERVAL(fps)			((1E9 / 100) / (fps))
@@ -46,10 +137,13 @@ unsigned char interface_association_descriptor[] = {
 };
 
 DECLARE_UVC_HEADER_DESCRIPTOR(1);
+DECLARE_UVC_EXTENSION_UNIT_DESCRIPTOR(1, 1);
 
 static struct __attribute__((packed)) {
 	struct UVC_HEADER_DESCRIPTOR(1) header_descriptor;
 	struct uvc_input_terminal_descriptor input_terminal_descriptor;
+	struct uvc_processing_unit_descriptor_uvc_1_1 processing_unit_descriptor;
+	struct UVC_EXTENSION_UNIT_DESCRIPTOR(1, 1) extension_unit_descriptor;
 	struct uvc_output_terminal_descriptor output_terminal_descriptor;
 } video_control_descriptors = {
 	.header_descriptor = {
@@ -58,7 +152,7 @@ static struct __attribute__((packed)) {
 		.bDescriptorSubType		= UVC_VC_HEADER,
 		.bcdUVC				= 0x0110,
 		.wTotalLength			= sizeof(video_control_descriptors),
-		.dwClockFrequency		= 48000000,
+		.dwClockFrequency		= UVC_CLOCK_FREQUENCY,
 		.bInCollection			= 1,
 		.baInterfaceNr			= {STREAM_INTERFACE},
 	},
@@ -71,6 +165,33 @@ static struct __attribute__((packed)) {
 		.bAssocTerminal			= 0,
 		.iTerminal			= 0,
 	},
+	.processing_unit_descriptor = {
+		.bLength			= sizeof(video_control_descriptors.processing_unit_descriptor),
+		.bDescriptorType		= USB_DT_CS_INTERFACE,
+		.bDescriptorSubType		= UVC_VC_PROCESSING_UNIT,
+		.bUnitID			= PROCESSING_UNIT_ID,
+		.bSourceID			= INPUT_TERMINAL_ID,
+		.wMaxMultiplier			= 0,
+		.bControlSize			= 2,
+		.bmControls			= {0x0F, 0x00},	/* Brightness, contrast, hue, saturation */
+		.iProcessing			= 0,
+		.bmVideoStandards		= 0,
+	},
+	.extension_unit_descriptor = {
+		.bLength			= sizeof(video_control_descriptors.extension_unit_descriptor),
+		.bDescriptorType		= USB_DT_CS_INTERFACE,
+		.bDescriptorSubType		= UVC_VC_EXTENSION_UNIT,
+		.bUnitID			= EXTENSION_UNIT_ID,
+		.guidExtensionCode		= UVC_GUID_VITA_STATS,
+		.bNumControls			= 3,
+		.bNrInPins			= 1,
+		.baSourceID			= {PROCESSING_UNIT_ID},
+		.bControlSize			= 1,
+		.bmControls			= {(1 << (UVC_XU_STATS_CONTROL - 1)) |
+						   (1 << (UVC_XU_COLORIMETRY_CONTROL - 1)) |
+						   (1 << (UVC_XU_PLACEMENT_CONTROL - 1))},
+		.iExtension			= 0,
+	},
 	.output_terminal_descriptor = {
 		.bLength			= sizeof(video_control_descriptors.output_terminal_descriptor),
 		.bDescriptorType		= USB_DT_CS_INTERFACE,
@@ -78,25 +199,34 @@ static struct __attribute__((packed)) {
 		.bTerminalID			= OUTPUT_TERMINAL_ID,
 		.wTerminalType			= UVC_TT_STREAMING,
 		.bAssocTerminal			= 0,
-		.bSourceID			= INPUT_TERMINAL_ID,
+		.bSourceID			= EXTENSION_UNIT_ID,
 		.iTerminal			= 0,
 	},
 };
 
-DECLARE_UVC_INPUT_HEADER_DESCRIPTOR(1, 1);
+DECLARE_UVC_INPUT_HEADER_DESCRIPTOR(1, 4);
 DECLARE_UVC_FRAME_UNCOMPRESSED(2);
+DECLARE_UVC_FRAME_MJPEG(2);
 
 static struct __attribute__((packed)) {
-	struct UVC_INPUT_HEADER_DESCRIPTOR(1, 1) input_header_descriptor;
+	struct UVC_INPUT_HEADER_DESCRIPTOR(1, 4) input_header_descriptor;
 	struct uvc_format_uncompressed format_uncompressed_nv12;
 	struct UVC_FRAME_UNCOMPRESSED(2) frames_uncompressed_nv12[5];
 	struct uvc_color_matching_descriptor format_uncompressed_nv12_color_matching;
+	struct uvc_format_mjpeg format_mjpeg;
+	struct UVC_FRAME_MJPEG(2) frames_mjpeg[5];
+	struct uvc_color_matching_descriptor format_mjpeg_color_matching;
+	struct uvc_format_uncompressed format_uncompressed_yuy2;
+	struct UVC_FRAME_UNCOMPRESSED(2) frames_uncompressed_yuy2[5];
+	struct uvc_color_matching_descriptor format_uncompressed_yuy2_color_matching;
+	struct uvc_format_uncompressed format_uncompressed_rgb32;
+	struct UVC_FRAME_UNCOMPRESSED(2) frames_uncompressed_rgb32[1];
 } video_streaming_descriptors = {
 	.input_header_descriptor = {
 		.bLength			= sizeof(video_streaming_descriptors.input_header_descriptor),
 		.bDescriptorType		= USB_DT_CS_INTERFACE,
 		.bDescriptorSubType		= UVC_VS_INPUT_HEADER,
-		.bNumFormats			= 1,
+		.bNumFormats			= 4,
 		.wTotalLength			= sizeof(video_streaming_descriptors),
 		.bEndpointAddress		= USB_ENDPOINT_IN | 0x01,
 		.bmInfo				= 0,
@@ -105,7 +235,7 @@ static struct __attribute__((packed)) {
 		.bTriggerSupport		= 0,
 		.bTriggerUsage			= 0,
 		.bControlSize			= 1,
-		.bmaControls			= {{0}, },
+		.bmaControls			= {{0}, {0}, {0}, {0}},
 	},
 	.format_uncompressed_nv12 = {
 		.bLength			= sizeof(video_streaming_descriptors.format_uncompressed_nv12),
@@ -202,9 +332,247 @@ static struct __attribute__((packed)) {
 		.bLength			= sizeof(video_streaming_descriptors.format_uncompressed_nv12_color_matching),
 		.bDescriptorType		= USB_DT_CS_INTERFACE,
 		.bDescriptorSubType		= UVC_VS_COLORFORMAT,
-		.bColorPrimaries		= 0,
-		.bTransferCharacteristics	= 0,
-		.bMatrixCoefficients		= 0,
+		.bColorPrimaries		= COLORIMETRY_COLOR_PRIMARIES(UVC_COLORIMETRY),
+		.bTransferCharacteristics	= COLORIMETRY_TRANSFER_CHARACTERISTICS(UVC_COLORIMETRY),
+		.bMatrixCoefficients		= COLORIMETRY_MATRIX_COEFFICIENTS(UVC_COLORIMETRY),
+	},
+	.format_mjpeg = {
+		.bLength			= sizeof(video_streaming_descriptors.format_mjpeg),
+		.bDescriptorType		= USB_DT_CS_INTERFACE,
+		.bDescriptorSubType		= UVC_VS_FORMAT_MJPEG,
+		.bFormatIndex			= FORMAT_INDEX_MJPEG,
+		.bNumFrameDescriptors		= 5,
+		.bmFlags			= 0,
+		.bDefaultFrameIndex		= 1,
+		.bAspectRatioX			= 0,
+		.bAspectRatioY			= 0,
+		.bmInterfaceFlags		= 0,
+		.bCopyProtect			= 0,
+	},
+	.frames_mjpeg = {
+		(struct UVC_FRAME_MJPEG(2)){
+			.bLength			= UVC_DT_FRAME_MJPEG_SIZE(2),
+			.bDescriptorType		= USB_DT_CS_INTERFACE,
+			.bDescriptorSubType		= UVC_VS_FRAME_MJPEG,
+			.bFrameIndex			= 1,
+			.bmCapabilities			= 0,
+			.wWidth				= 960,
+			.wHeight			= 544,
+			.dwMinBitRate			= FRAME_BITRATE(960, 544, 1, FPS_TO_INTERVAL(30)),
+			.dwMaxBitRate			= FRAME_BITRATE(960, 544, 12, FPS_TO_INTERVAL(60)),
+			.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_NV12(960, 544),
+			.dwDefaultFrameInterval		= FPS_TO_INTERVAL(60),
+			.bFrameIntervalType		= 2,
+			.dwFrameInterval		= {FPS_TO_INTERVAL(60), FPS_TO_INTERVAL(30)},
+		},
+		(struct UVC_FRAME_MJPEG(2)){
+			.bLength			= UVC_DT_FRAME_MJPEG_SIZE(2),
+			.bDescriptorType		= USB_DT_CS_INTERFACE,
+			.bDescriptorSubType		= UVC_VS_FRAME_MJPEG,
+			.bFrameIndex			= 2,
+			.bmCapabilities			= 0,
+			.wWidth				= 896,
+			.wHeight			= 504,
+			.dwMinBitRate			= FRAME_BITRATE(896, 504, 1, FPS_TO_INTERVAL(30)),
+			.dwMaxBitRate			= FRAME_BITRATE(896, 504, 12, FPS_TO_INTERVAL(60)),
+			.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_NV12(896, 504),
+			.dwDefaultFrameInterval		= FPS_TO_INTERVAL(60),
+			.bFrameIntervalType		= 2,
+			.dwFrameInterval		= {FPS_TO_INTERVAL(60), FPS_TO_INTERVAL(30)},
+		},
+		(struct UVC_FRAME_MJPEG(2)){
+			.bLength			= UVC_DT_FRAME_MJPEG_SIZE(2),
+			.bDescriptorType		= USB_DT_CS_INTERFACE,
+			.bDescriptorSubType		= UVC_VS_FRAME_MJPEG,
+			.bFrameIndex			= 3,
+			.bmCapabilities			= 0,
+			.wWidth				= 864,
+			.wHeight			= 488,
+			.dwMinBitRate			= FRAME_BITRATE(864, 488, 1, FPS_TO_INTERVAL(30)),
+			.dwMaxBitRate			= FRAME_BITRATE(864, 488, 12, FPS_TO_INTERVAL(60)),
+			.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_NV12(864, 488),
+			.dwDefaultFrameInterval		= FPS_TO_INTERVAL(60),
+			.bFrameIntervalType		= 2,
+			.dwFrameInterval		= {FPS_TO_INTERVAL(60), FPS_TO_INTERVAL(30)},
+		},
+		(struct UVC_FRAME_MJPEG(2)){
+			.bLength			= UVC_DT_FRAME_MJPEG_SIZE(2),
+			.bDescriptorType		= USB_DT_CS_INTERFACE,
+			.bDescriptorSubType		= UVC_VS_FRAME_MJPEG,
+			.bFrameIndex			= 4,
+			.bmCapabilities			= 0,
+			.wWidth				= 480,
+			.wHeight			= 272,
+			.dwMinBitRate			= FRAME_BITRATE(480, 272, 1, FPS_TO_INTERVAL(30)),
+			.dwMaxBitRate			= FRAME_BITRATE(480, 272, 12, FPS_TO_INTERVAL(60)),
+			.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_NV12(480, 272),
+			.dwDefaultFrameInterval		= FPS_TO_INTERVAL(60),
+			.bFrameIntervalType		= 2,
+			.dwFrameInterval		= {FPS_TO_INTERVAL(60), FPS_TO_INTERVAL(30)},
+		},
+		(struct UVC_FRAME_MJPEG(2)){
+			.bLength			= UVC_DT_FRAME_MJPEG_SIZE(2),
+			.bDescriptorType		= USB_DT_CS_INTERFACE,
+			.bDescriptorSubType		= UVC_VS_FRAME_MJPEG,
+			.bFrameIndex			= 5,
+			.bmCapabilities			= 0,
+			.wWidth				= 1280,
+			.wHeight			= 720,
+			.dwMinBitRate			= FRAME_BITRATE(1280, 720, 1, FPS_TO_INTERVAL(20)),
+			.dwMaxBitRate			= FRAME_BITRATE(1280, 720, 12, FPS_TO_INTERVAL(30)),
+			.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_NV12(1280, 720),
+			.dwDefaultFrameInterval		= FPS_TO_INTERVAL(30),
+			.bFrameIntervalType		= 2,
+			.dwFrameInterval		= {FPS_TO_INTERVAL(30), FPS_TO_INTERVAL(20)},
+		},
+	},
+	/* JFIF: BT.601 full range YCbCr */
+	.format_mjpeg_color_matching = {
+		.bLength			= sizeof(video_streaming_descriptors.format_mjpeg_color_matching),
+		.bDescriptorType		= USB_DT_CS_INTERFACE,
+		.bDescriptorSubType		= UVC_VS_COLORFORMAT,
+		.bColorPrimaries		= 1,
+		.bTransferCharacteristics	= 1,
+		.bMatrixCoefficients		= 4,
+	},
+	.format_uncompressed_yuy2 = {
+		.bLength			= sizeof(video_streaming_descriptors.format_uncompressed_yuy2),
+		.bDescriptorType		= USB_DT_CS_INTERFACE,
+		.bDescriptorSubType		= UVC_VS_FORMAT_UNCOMPRESSED,
+		.bFormatIndex			= FORMAT_INDEX_UNCOMPRESSED_YUY2,
+		.bNumFrameDescriptors		= 5,
+		.guidFormat			= UVC_GUID_FORMAT_YUY2,
+		.bBitsPerPixel			= 16,
+		.bDefaultFrameIndex		= 1,
+		.bAspectRatioX			= 0,
+		.bAspectRatioY			= 0,
+		.bmInterfaceFlags		= 0,
+		.bCopyProtect			= 0,
+	},
+	/*
+	 * At 16 bpp the frame rates are capped to what the bulk endpoint
+	 * sustains in practice (~40 MB/s).
+	 */
+	.frames_uncompressed_yuy2 = {
+		(struct UVC_FRAME_UNCOMPRESSED(2)){
+			.bLength			= UVC_DT_FRAME_UNCOMPRESSED_SIZE(2),
+			.bDescriptorType		= USB_DT_CS_INTERFACE,
+			.bDescriptorSubType		= UVC_VS_FRAME_UNCOMPRESSED,
+			.bFrameIndex			= 1,
+			.bmCapabilities			= 0,
+			.wWidth				= 960,
+			.wHeight			= 544,
+			.dwMinBitRate			= FRAME_BITRATE(960, 544, 16, FPS_TO_INTERVAL(20)),
+			.dwMaxBitRate			= FRAME_BITRATE(960, 544, 16, FPS_TO_INTERVAL(30)),
+			.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_YUY2(960, 544),
+			.dwDefaultFrameInterval		= FPS_TO_INTERVAL(30),
+			.bFrameIntervalType		= 2,
+			.dwFrameInterval		= {FPS_TO_INTERVAL(30), FPS_TO_INTERVAL(20)},
+		},
+		(struct UVC_FRAME_UNCOMPRESSED(2)){
+			.bLength			= UVC_DT_FRAME_UNCOMPRESSED_SIZE(2),
+			.bDescriptorType		= USB_DT_CS_INTERFACE,
+			.bDescriptorSubType		= UVC_VS_FRAME_UNCOMPRESSED,
+			.bFrameIndex			= 2,
+			.bmCapabilities			= 0,
+			.wWidth				= 896,
+			.wHeight			= 504,
+			.dwMinBitRate			= FRAME_BITRATE(896, 504, 16, FPS_TO_INTERVAL(20)),
+			.dwMaxBitRate			= FRAME_BITRATE(896, 504, 16, FPS_TO_INTERVAL(30)),
+			.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_YUY2(896, 504),
+			.dwDefaultFrameInterval		= FPS_TO_INTERVAL(30),
+			.bFrameIntervalType		= 2,
+			.dwFrameInterval		= {FPS_TO_INTERVAL(30), FPS_TO_INTERVAL(20)},
+		},
+		(struct UVC_FRAME_UNCOMPRESSED(2)){
+			.bLength			= UVC_DT_FRAME_UNCOMPRESSED_SIZE(2),
+			.bDescriptorType		= USB_DT_CS_INTERFACE,
+			.bDescriptorSubType		= UVC_VS_FRAME_UNCOMPRESSED,
+			.bFrameIndex			= 3,
+			.bmCapabilities			= 0,
+			.wWidth				= 864,
+			.wHeight			= 488,
+			.dwMinBitRate			= FRAME_BITRATE(864, 488, 16, FPS_TO_INTERVAL(20)),
+			.dwMaxBitRate			= FRAME_BITRATE(864, 488, 16, FPS_TO_INTERVAL(30)),
+			.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_YUY2(864, 488),
+			.dwDefaultFrameInterval		= FPS_TO_INTERVAL(30),
+			.bFrameIntervalType		= 2,
+			.dwFrameInterval		= {FPS_TO_INTERVAL(30), FPS_TO_INTERVAL(20)},
+		},
+		(struct UVC_FRAME_UNCOMPRESSED(2)){
+			.bLength			= UVC_DT_FRAME_UNCOMPRESSED_SIZE(2),
+			.bDescriptorType		= USB_DT_CS_INTERFACE,
+			.bDescriptorSubType		= UVC_VS_FRAME_UNCOMPRESSED,
+			.bFrameIndex			= 4,
+			.bmCapabilities			= 0,
+			.wWidth				= 480,
+			.wHeight			= 272,
+			.dwMinBitRate			= FRAME_BITRATE(480, 272, 16, FPS_TO_INTERVAL(30)),
+			.dwMaxBitRate			= FRAME_BITRATE(480, 272, 16, FPS_TO_INTERVAL(60)),
+			.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_YUY2(480, 272),
+			.dwDefaultFrameInterval		= FPS_TO_INTERVAL(60),
+			.bFrameIntervalType		= 2,
+			.dwFrameInterval		= {FPS_TO_INTERVAL(60), FPS_TO_INTERVAL(30)},
+		},
+		(struct UVC_FRAME_UNCOMPRESSED(2)){
+			.bLength			= UVC_DT_FRAME_UNCOMPRESSED_SIZE(2),
+			.bDescriptorType		= USB_DT_CS_INTERFACE,
+			.bDescriptorSubType		= UVC_VS_FRAME_UNCOMPRESSED,
+			.bFrameIndex			= 5,
+			.bmCapabilities			= 0,
+			.wWidth				= 1280,
+			.wHeight			= 720,
+			.dwMinBitRate			= FRAME_BITRATE(1280, 720, 16, FPS_TO_INTERVAL(15)),
+			.dwMaxBitRate			= FRAME_BITRATE(1280, 720, 16, FPS_TO_INTERVAL(20)),
+			.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_YUY2(1280, 720),
+			.dwDefaultFrameInterval		= FPS_TO_INTERVAL(20),
+			.bFrameIntervalType		= 2,
+			.dwFrameInterval		= {FPS_TO_INTERVAL(20), FPS_TO_INTERVAL(15)},
+		},
+	},
+	.format_uncompressed_yuy2_color_matching = {
+		.bLength			= sizeof(video_streaming_descriptors.format_uncompressed_yuy2_color_matching),
+		.bDescriptorType		= USB_DT_CS_INTERFACE,
+		.bDescriptorSubType		= UVC_VS_COLORFORMAT,
+		.bColorPrimaries		= COLORIMETRY_COLOR_PRIMARIES(UVC_COLORIMETRY),
+		.bTransferCharacteristics	= COLORIMETRY_TRANSFER_CHARACTERISTICS(UVC_COLORIMETRY),
+		.bMatrixCoefficients		= COLORIMETRY_MATRIX_COEFFICIENTS(UVC_COLORIMETRY),
+	},
+	.format_uncompressed_rgb32 = {
+		.bLength			= sizeof(video_streaming_descriptors.format_uncompressed_rgb32),
+		.bDescriptorType		= USB_DT_CS_INTERFACE,
+		.bDescriptorSubType		= UVC_VS_FORMAT_UNCOMPRESSED,
+		.bFormatIndex			= FORMAT_INDEX_UNCOMPRESSED_RGB32,
+		.bNumFrameDescriptors		= 1,
+		.guidFormat			= UVC_GUID_FORMAT_RGB32,
+		.bBitsPerPixel			= 32,
+		.bDefaultFrameIndex		= 1,
+		.bAspectRatioX			= 0,
+		.bAspectRatioY			= 0,
+		.bmInterfaceFlags		= 0,
+		.bCopyProtect			= 0,
+	},
+	/*
+	 * Native resolution only, so that the pixels are the framebuffer's
+	 * with R and B swapped, unscaled unless cropped. Same bandwidth cap
+	 * as YUY2.
+	 */
+	.frames_uncompressed_rgb32 = {
+		(struct UVC_FRAME_UNCOMPRESSED(2)){
+			.bLength			= UVC_DT_FRAME_UNCOMPRESSED_SIZE(2),
+			.bDescriptorType		= USB_DT_CS_INTERFACE,
+			.bDescriptorSubType		= UVC_VS_FRAME_UNCOMPRESSED,
+			.bFrameIndex			= 1,
+			.bmCapabilities			= 0,
+			.wWidth				= 960,
+			.wHeight			= 544,
+			.dwMinBitRate			= FRAME_BITRATE(960, 544, 32, FPS_TO_INTERVAL(15)),
+			.dwMaxBitRate			= FRAME_BITRATE(960, 544, 32, FPS_TO_INTERVAL(20)),
+			.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_RGB32(960, 544),
+			.dwDefaultFrameInterval		= FPS_TO_INTERVAL(20),
+			.bFrameIntervalType		= 2,
+			.dwFrameInterval		= {FPS_TO_INTERVAL(20), FPS_TO_INTERVAL(15)},
+		},
 	},
 };
 
@@ -258,6 +626,29 @@ struct SceUdcdDeviceDescriptor devdesc_hi = {
 };
 
 /* Hi-Speed endpoint descriptors */
+#if UVC_ISOC
+#define ENDPDESC_ISOC(max_packet_size, interval) \
+	{ \
+		USB_DT_ENDPOINT_SIZE, \
+		USB_DT_ENDPOINT, \
+		USB_ENDPOINT_IN | 0x01,		/* bEndpointAddress */ \
+		USB_ENDPOINT_TYPE_ISOCHRONOUS | USB_ENDPOINT_SYNC_ASYNC, \
+		(max_packet_size),		/* wMaxPacketSize */ \
+		(interval)			/* bInterval */ \
+	}
+
+static
+struct SceUdcdEndpointDescriptor endpdesc_hi[UVC_ISOC_NUM_TIERS_HI + 1] = {
+	/* Video Streaming endpoints, one per alternate setting: 4 to 24 MB/s */
+	ENDPDESC_ISOC(USB_ISOC_MAX_PACKET_SIZE(512, 1), 1),
+	ENDPDESC_ISOC(USB_ISOC_MAX_PACKET_SIZE(1024, 1), 1),
+	ENDPDESC_ISOC(USB_ISOC_MAX_PACKET_SIZE(1024, 2), 1),
+	ENDPDESC_ISOC(USB_ISOC_MAX_PACKET_SIZE(1024, 3), 1),
+	{
+		0,
+	}
+};
+#else
 static
 struct SceUdcdEndpointDescriptor endpdesc_hi[2] = {
 	/* Video Streaming endpoints */
@@ -273,10 +664,34 @@ struct SceUdcdEndpointDescriptor endpdesc_hi[2] = {
 		0,
 	}
 };
+#endif
 
 /* Hi-Speed interface descriptor */
+#if UVC_ISOC
+#define INTERDESC_STREAM_ISOC(alternate_setting, endpoint) \
+	{ \
+		USB_DT_INTERFACE_SIZE, \
+		USB_DT_INTERFACE, \
+		STREAM_INTERFACE,		/* bInterfaceNumber */ \
+		(alternate_setting),		/* bAlternateSetting */ \
+		1,				/* bNumEndpoints */ \
+		USB_CLASS_VIDEO,		/* bInterfaceClass */ \
+		UVC_SC_VIDEOSTREAMING,		/* bInterfaceSubClass */ \
+		UVC_PC_PROTOCOL_UNDEFINED,	/* bInterfaceProtocol */ \
+		0,				/* iInterface */ \
+		(endpoint),			/* endpoints */ \
+		NULL, \
+		0 \
+	}
+#define NUM_STREAM_ENDPOINTS_HI		UVC_ISOC_NUM_TIERS_HI
+#define NUM_STREAM_ENDPOINTS_FULL	UVC_ISOC_NUM_TIERS_FULL
+#else
+#define NUM_STREAM_ENDPOINTS_HI		1
+#define NUM_STREAM_ENDPOINTS_FULL	1
+#endif
+
 static
-struct SceUdcdInterfaceDescriptor interdesc_hi[3] = {
+struct SceUdcdInterfaceDescriptor interdesc_hi[3 + UVC_ISOC * UVC_ISOC_NUM_TIERS_HI] = {
 	{	/* Standard Video Control Interface Descriptor */
 		USB_DT_INTERFACE_SIZE,
 		USB_DT_INTERFACE,
@@ -291,6 +706,28 @@ struct SceUdcdInterfaceDescriptor interdesc_hi[3] = {
 		(void *)&video_control_descriptors,
 		sizeof(video_control_descriptors)
 	},
+#if UVC_ISOC
+	{	/* Standard Video Streaming Interface Descriptor */
+		/* Alternate setting 0 = Zero bandwidth */
+		USB_DT_INTERFACE_SIZE,
+		USB_DT_INTERFACE,
+		STREAM_INTERFACE,		/* bInterfaceNumber */
+		0,				/* bAlternateSetting */
+		0,				/* bNumEndpoints */
+		USB_CLASS_VIDEO,		/* bInterfaceClass */
+		UVC_SC_VIDEOSTREAMING,		/* bInterfaceSubClass */
+		UVC_PC_PROTOCOL_UNDEFINED,	/* bInterfaceProtocol */
+		0,				/* iInterface */
+		NULL,				/* endpoints */
+		(void *)&video_streaming_descriptors,
+		sizeof(video_streaming_descriptors)
+	},
+	/* Alternate settings 1 to n = Operational Settings */
+	INTERDESC_STREAM_ISOC(1, &endpdesc_hi[0]),
+	INTERDESC_STREAM_ISOC(2, &endpdesc_hi[1]),
+	INTERDESC_STREAM_ISOC(3, &endpdesc_hi[2]),
+	INTERDESC_STREAM_ISOC(4, &endpdesc_hi[3]),
+#else
 	{	/* Standard Video Streaming Interface Descriptor */
 		/* Alternate setting 0 = Operational Setting */
 		USB_DT_INTERFACE_SIZE,
@@ -306,6 +743,7 @@ struct SceUdcdInterfaceDescriptor interdesc_hi[3] = {
 		(void *)&video_streaming_descriptors,
 		sizeof(video_streaming_descriptors)
 	},
+#endif
 	{
 		0
 	}
@@ -315,7 +753,7 @@ struct SceUdcdInterfaceDescriptor interdesc_hi[3] = {
 static
 struct SceUdcdInterfaceSettings settings_hi[2] = {
 	{&interdesc_hi[0], 0, 1},
-	{&interdesc_hi[1], 0, 1},
+	{&interdesc_hi[1], 0, 1 + UVC_ISOC * UVC_ISOC_NUM_TIERS_HI},
 };
 
 /* Hi-Speed configuration descriptor */
@@ -323,7 +761,9 @@ static
 struct SceUdcdConfigDescriptor confdesc_hi = {
 	USB_DT_CONFIG_SIZE,
 	USB_DT_CONFIG,
-	(USB_DT_CONFIG_SIZE + 2 * USB_DT_INTERFACE_SIZE + 1 * USB_DT_ENDPOINT_SIZE +
+	(USB_DT_CONFIG_SIZE +
+		(2 + UVC_ISOC * NUM_STREAM_ENDPOINTS_HI) * USB_DT_INTERFACE_SIZE +
+		NUM_STREAM_ENDPOINTS_HI * USB_DT_ENDPOINT_SIZE +
 		/* sizeof(interface_association_descriptor) + */
 		sizeof(video_control_descriptors) +
 		sizeof(video_streaming_descriptors)),	/* wTotalLength */
@@ -369,6 +809,9 @@ struct SceUdcdDeviceDescriptor devdesc_full = {
 static
 struct SceUdcdEndpointDescriptor endpdesc_full[2] = {
 	/* Video Streaming endpoints */
+#if UVC_ISOC
+	ENDPDESC_ISOC(1023, 1),
+#else
 	{
 		USB_DT_ENDPOINT_SIZE,
 		USB_DT_ENDPOINT,
@@ -377,6 +820,7 @@ struct SceUdcdEndpointDescriptor endpdesc_full[2] = {
 		0x40,				/* wMaxPacketSize */
 		0x00				/* bInterval */
 	},
+#endif
 	{
 		0,
 	}
@@ -384,7 +828,7 @@ struct SceUdcdEndpointDescriptor endpdesc_full[2] = {
 
 /* Full-Speed interface descriptor */
 static
-struct SceUdcdInterfaceDescriptor interdesc_full[3] = {
+struct SceUdcdInterfaceDescriptor interdesc_full[3 + UVC_ISOC * UVC_ISOC_NUM_TIERS_FULL] = {
 	{	/* Standard Video Control Interface Descriptor */
 		USB_DT_INTERFACE_SIZE,
 		USB_DT_INTERFACE,
@@ -399,6 +843,25 @@ struct SceUdcdInterfaceDescriptor interdesc_full[3] = {
 		(void *)&video_control_descriptors,
 		sizeof(video_control_descriptors)
 	},
+#if UVC_ISOC
+	{	/* Standard Video Streaming Interface Descriptor */
+		/* Alternate setting 0 = Zero bandwidth */
+		USB_DT_INTERFACE_SIZE,
+		USB_DT_INTERFACE,
+		STREAM_INTERFACE,		/* bInterfaceNumber */
+		0,				/* bAlternateSetting */
+		0,				/* bNumEndpoints */
+		USB_CLASS_VIDEO,		/* bInterfaceClass */
+		UVC_SC_VIDEOSTREAMING,		/* bInterfaceSubClass */
+		UVC_PC_PROTOCOL_UNDEFINED,	/* bInterfaceProtocol */
+		0,				/* iInterface */
+		NULL,				/* endpoints */
+		(void *)&video_streaming_descriptors,
+		sizeof(video_streaming_descriptors)
+	},
+	/* Alternate setting 1 = Operational Setting */
+	INTERDESC_STREAM_ISOC(1, &endpdesc_full[0]),
+#else
 	{	/* Standard Video Streaming Interface Descriptor */
 		/* Alternate setting 0 = Operational Setting */
 		USB_DT_INTERFACE_SIZE,
@@ -414,6 +877,7 @@ struct SceUdcdInterfaceDescriptor interdesc_full[3] = {
 		(void *)&video_streaming_descriptors,
 		sizeof(video_streaming_descriptors)
 	},
+#endif
 	{
 		0
 	}
@@ -423,7 +887,7 @@ struct SceUdcdInterfaceDescriptor interdesc_full[3] = {
 static
 struct SceUdcdInterfaceSettings settings_full[2] = {
 	{&interdesc_full[0], 0, 1},
-	{&interdesc_full[1], 0, 1}
+	{&interdesc_full[1], 0, 1 + UVC_ISOC * UVC_ISOC_NUM_TIERS_FULL}
 };
 
 /* Full-Speed configuration descriptor */
@@ -431,7 +895,9 @@ static
 struct SceUdcdConfigDescriptor confdesc_full = {
 	USB_DT_CONFIG_SIZE,
 	USB_DT_CONFIG,
-	(USB_DT_CONFIG_SIZE + 2 * USB_DT_INTERFACE_SIZE + 1 * USB_DT_ENDPOINT_SIZE +
+	(USB_DT_CONFIG_SIZE +
+		(2 + UVC_ISOC * NUM_STREAM_ENDPOINTS_FULL) * USB_DT_INTERFACE_SIZE +
+		NUM_STREAM_ENDPOINTS_FULL * USB_DT_ENDPOINT_SIZE +
 		/* sizeof(interface_association_descriptor) + */
 		sizeof(video_control_descriptors) +
 		sizeof(video_streaming_descriptors)),	/* wTotalLength */
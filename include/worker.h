@@ -0,0 +1,26 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+/*
+ * Pool of threads, one per core available to us, that run the same job on
+ * different parts of a frame (MJPEG restart intervals, software CSC bands).
+ */
+#ifndef WORKER_POOL_SIZE
+#define WORKER_POOL_SIZE	3
+#endif
+
+#if WORKER_POOL_SIZE < 1 || WORKER_POOL_SIZE > 3
+#error "WORKER_POOL_SIZE must be between 1 and 3"
+#endif
+
+typedef void (*worker_job_t)(unsigned int worker, void *arg);
+
+int worker_pool_init(void);
+void worker_pool_term(void);
+
+/*
+ * Runs job on every worker and waits until all of them are done.
+ */
+int worker_pool_run(worker_job_t job, void *arg);
+
+#endif
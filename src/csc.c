@@ -0,0 +1,409 @@
+#include "csc.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define CSC_CHUNK		16
+
+const struct csc_matrix csc_matrix_bt601_full = {
+	.coef = {
+		{ 153,  300,   58},
+		{ -86, -169,  256},
+		{ 256, -214,  -41},
+	},
+	.offset = {0, 128, 128},
+};
+
+const struct csc_matrix csc_matrix_bt601_limited = {
+	.coef = {
+		{ 131,  258,   50},
+		{ -76, -149,  225},
+		{ 225, -188,  -37},
+	},
+	.offset = {16, 128, 128},
+};
+
+const struct csc_matrix csc_matrix_bt709_full = {
+	.coef = {
+		{ 109,  366,   37},
+		{ -59, -197,  256},
+		{ 256, -233,  -23},
+	},
+	.offset = {0, 128, 128},
+};
+
+const struct csc_matrix csc_matrix_bt709_limited = {
+	.coef = {
+		{  93,  314,   32},
+		{ -52, -173,  225},
+		{ 225, -204,  -21},
+	},
+	.offset = {16, 128, 128},
+};
+
+/* sin() of 0 to 90 degrees with 14 fractional bits */
+static const int16_t sin_table[91] = {
+	    0,   286,   572,   857,  1143,  1428,  1713,  1997,  2280,  2563,
+	 2845,  3126,  3406,  3686,  3964,  4240,  4516,  4790,  5063,  5334,
+	 5604,  5872,  6138,  6402,  6664,  6924,  7182,  7438,  7692,  7943,
+	 8192,  8438,  8682,  8923,  9162,  9397,  9630,  9860, 10087, 10311,
+	10531, 10749, 10963, 11174, 11381, 11585, 11786, 11982, 12176, 12365,
+	12551, 12733, 12911, 13085, 13255, 13421, 13583, 13741, 13894, 14044,
+	14189, 14330, 14466, 14598, 14726, 14849, 14968, 15082, 15191, 15296,
+	15396, 15491, 15582, 15668, 15749, 15826, 15897, 15964, 16026, 16083,
+	16135, 16182, 16225, 16262, 16294, 16322, 16344, 16362, 16374, 16382,
+	16384,
+};
+
+static int32_t sin_q14(int deg)
+{
+	deg %= 360;
+	if (deg < 0)
+		deg += 360;
+
+	if (deg <= 90)
+		return sin_table[deg];
+	else if (deg <= 180)
+		return sin_table[180 - deg];
+	else if (deg <= 270)
+		return -sin_table[deg - 180];
+	else
+		return -sin_table[360 - deg];
+}
+
+static int32_t div_round(int64_t n, int64_t d)
+{
+	return n >= 0 ? (n + d / 2) / d : -((-n + d / 2) / d);
+}
+
+void csc_matrix_adjust(struct csc_matrix *dst, const struct csc_matrix *base,
+		       const struct csc_adjust *adjust)
+{
+	int64_t s = sin_q14(adjust->hue);
+	int64_t c = sin_q14(adjust->hue + 90);
+	int64_t cb, cr;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		cb = base->coef[1][i];
+		cr = base->coef[2][i];
+
+		dst->coef[0][i] = div_round((int64_t)base->coef[0][i] * adjust->contrast, 100);
+		dst->coef[1][i] = div_round((c * cb - s * cr) * adjust->saturation, 100 << 14);
+		dst->coef[2][i] = div_round((s * cb + c * cr) * adjust->saturation, 100 << 14);
+	}
+
+	/* Like the IFTU's, offsets can't be negative */
+	dst->offset[0] = base->offset[0] + adjust->brightness;
+	if (dst->offset[0] < 0)
+		dst->offset[0] = 0;
+	else if (dst->offset[0] > 255)
+		dst->offset[0] = 255;
+	dst->offset[1] = base->offset[1];
+	dst->offset[2] = base->offset[2];
+}
+
+static inline uint32_t rgba5551_to_rgba8888(uint16_t p)
+{
+	uint32_t r = p & 0x1F;
+	uint32_t g = (p >> 5) & 0x1F;
+	uint32_t b = (p >> 10) & 0x1F;
+
+	r = (r << 3) | (r >> 2);
+	g = (g << 3) | (g >> 2);
+	b = (b << 3) | (b >> 2);
+
+	return r | (g << 8) | (b << 16) | 0xFF000000;
+}
+
+/*
+ * Samples count destination pixels starting at x0 from a source row.
+ */
+static void gather(const struct csc_src *src, const void *row,
+		   unsigned int x0, unsigned int count, uint32_t step,
+		   uint32_t out[CSC_CHUNK])
+{
+	unsigned int i, sx;
+
+	for (i = 0; i < count; i++) {
+		sx = ((x0 + i) * step + step / 2) >> 16;
+		if (sx >= src->width)
+			sx = src->width - 1;
+
+		if (src->format == CSC_SRC_RGBA5551)
+			out[i] = rgba5551_to_rgba8888(((const uint16_t *)row)[sx]);
+		else
+			out[i] = ((const uint32_t *)row)[sx];
+	}
+}
+
+static inline const void *read_row(const struct csc_src *src, unsigned int dst_y,
+				   unsigned int dst_height, void *buf)
+{
+	uint32_t step = ((uint32_t)src->height << 16) / dst_height;
+	unsigned int sy = (dst_y * step + step / 2) >> 16;
+
+	if (sy >= src->height)
+		sy = src->height - 1;
+
+	return src->read_row(src, sy, buf);
+}
+
+static inline uint8_t clamp_u8(int32_t val)
+{
+	return val < 0 ? 0 : (val > 255 ? 255 : val);
+}
+
+/*
+ * r, g and b are sums of 1 << (shift - CSC_COEF_BITS) samples.
+ */
+static inline int32_t dot(const int32_t coef[3], int32_t r, int32_t g, int32_t b,
+			  unsigned int shift)
+{
+	return (coef[0] * r + coef[1] * g + coef[2] * b + (1 << (shift - 1))) >> shift;
+}
+
+#define R(p)	((int32_t)((p) & 0xFF))
+#define G(p)	((int32_t)(((p) >> 8) & 0xFF))
+#define B(p)	((int32_t)(((p) >> 16) & 0xFF))
+
+static void nv12_chunk_scalar(const struct csc_matrix *m,
+			      const uint32_t *p0, const uint32_t *p1,
+			      unsigned int count,
+			      uint8_t *y0, uint8_t *y1, uint8_t *uv)
+{
+	unsigned int i;
+	int32_t r, g, b;
+
+	for (i = 0; i < count; i += 2) {
+		y0[i + 0] = clamp_u8(dot(m->coef[0], R(p0[i]), G(p0[i]), B(p0[i]), CSC_COEF_BITS) + m->offset[0]);
+		y0[i + 1] = clamp_u8(dot(m->coef[0], R(p0[i + 1]), G(p0[i + 1]), B(p0[i + 1]), CSC_COEF_BITS) + m->offset[0]);
+		y1[i + 0] = clamp_u8(dot(m->coef[0], R(p1[i]), G(p1[i]), B(p1[i]), CSC_COEF_BITS) + m->offset[0]);
+		y1[i + 1] = clamp_u8(dot(m->coef[0], R(p1[i + 1]), G(p1[i + 1]), B(p1[i + 1]), CSC_COEF_BITS) + m->offset[0]);
+
+		r = R(p0[i]) + R(p0[i + 1]) + R(p1[i]) + R(p1[i + 1]);
+		g = G(p0[i]) + G(p0[i + 1]) + G(p1[i]) + G(p1[i + 1]);
+		b = B(p0[i]) + B(p0[i + 1]) + B(p1[i]) + B(p1[i + 1]);
+
+		uv[i + 0] = clamp_u8(dot(m->coef[1], r, g, b, CSC_COEF_BITS + 2) + m->offset[1]);
+		uv[i + 1] = clamp_u8(dot(m->coef[2], r, g, b, CSC_COEF_BITS + 2) + m->offset[2]);
+	}
+}
+
+static void yuy2_chunk_scalar(const struct csc_matrix *m, const uint32_t *p,
+			      unsigned int count, uint8_t *dst)
+{
+	unsigned int i;
+	int32_t r, g, b;
+
+	for (i = 0; i < count; i += 2) {
+		r = R(p[i]) + R(p[i + 1]);
+		g = G(p[i]) + G(p[i + 1]);
+		b = B(p[i]) + B(p[i + 1]);
+
+		dst[2 * i + 0] = clamp_u8(dot(m->coef[0], R(p[i]), G(p[i]), B(p[i]), CSC_COEF_BITS) + m->offset[0]);
+		dst[2 * i + 1] = clamp_u8(dot(m->coef[1], r, g, b, CSC_COEF_BITS + 1) + m->offset[1]);
+		dst[2 * i + 2] = clamp_u8(dot(m->coef[0], R(p[i + 1]), G(p[i + 1]), B(p[i + 1]), CSC_COEF_BITS) + m->offset[0]);
+		dst[2 * i + 3] = clamp_u8(dot(m->coef[2], r, g, b, CSC_COEF_BITS + 1) + m->offset[2]);
+	}
+}
+
+#if defined(__ARM_NEON)
+
+/*
+ * Bit-exact with dot() + clamp_u8(): rounding shift, offset, saturation.
+ */
+static inline uint8x8_t neon_dot8(const int32_t coef[3], int16x8_t r, int16x8_t g,
+				  int16x8_t b, int shift, int32_t offset)
+{
+	const int32x4_t vshift = vdupq_n_s32(-shift);
+	const int32x4_t voffset = vdupq_n_s32(offset);
+	int32x4_t lo, hi;
+
+	lo = vmull_n_s16(vget_low_s16(r), coef[0]);
+	lo = vmlal_n_s16(lo, vget_low_s16(g), coef[1]);
+	lo = vmlal_n_s16(lo, vget_low_s16(b), coef[2]);
+	hi = vmull_n_s16(vget_high_s16(r), coef[0]);
+	hi = vmlal_n_s16(hi, vget_high_s16(g), coef[1]);
+	hi = vmlal_n_s16(hi, vget_high_s16(b), coef[2]);
+
+	lo = vaddq_s32(vrshlq_s32(lo, vshift), voffset);
+	hi = vaddq_s32(vrshlq_s32(hi, vshift), voffset);
+
+	return vqmovn_u16(vcombine_u16(vqmovun_s32(lo), vqmovun_s32(hi)));
+}
+
+#define S16(x)	vreinterpretq_s16_u16(x)
+
+static inline uint8x16_t neon_luma16(const struct csc_matrix *m, uint8x16x4_t p)
+{
+	uint8x8_t lo = neon_dot8(m->coef[0],
+				 S16(vmovl_u8(vget_low_u8(p.val[0]))),
+				 S16(vmovl_u8(vget_low_u8(p.val[1]))),
+				 S16(vmovl_u8(vget_low_u8(p.val[2]))),
+				 CSC_COEF_BITS, m->offset[0]);
+	uint8x8_t hi = neon_dot8(m->coef[0],
+				 S16(vmovl_u8(vget_high_u8(p.val[0]))),
+				 S16(vmovl_u8(vget_high_u8(p.val[1]))),
+				 S16(vmovl_u8(vget_high_u8(p.val[2]))),
+				 CSC_COEF_BITS, m->offset[0]);
+
+	return vcombine_u8(lo, hi);
+}
+
+static void nv12_chunk_neon(const struct csc_matrix *m,
+			    const uint32_t *p0, const uint32_t *p1,
+			    uint8_t *y0, uint8_t *y1, uint8_t *uv)
+{
+	uint8x16x4_t a = vld4q_u8((const uint8_t *)p0);
+	uint8x16x4_t b = vld4q_u8((const uint8_t *)p1);
+	int16x8_t r, g, bl;
+	uint8x8x2_t c;
+
+	vst1q_u8(y0, neon_luma16(m, a));
+	vst1q_u8(y1, neon_luma16(m, b));
+
+	r = S16(vpadalq_u8(vpaddlq_u8(a.val[0]), b.val[0]));
+	g = S16(vpadalq_u8(vpaddlq_u8(a.val[1]), b.val[1]));
+	bl = S16(vpadalq_u8(vpaddlq_u8(a.val[2]), b.val[2]));
+
+	c.val[0] = neon_dot8(m->coef[1], r, g, bl, CSC_COEF_BITS + 2, m->offset[1]);
+	c.val[1] = neon_dot8(m->coef[2], r, g, bl, CSC_COEF_BITS + 2, m->offset[2]);
+	vst2_u8(uv, c);
+}
+
+static void yuy2_chunk_neon(const struct csc_matrix *m, const uint32_t *p,
+			    uint8_t *dst)
+{
+	uint8x16x4_t a = vld4q_u8((const uint8_t *)p);
+	uint8x16_t y = neon_luma16(m, a);
+	uint8x8x2_t yy = vuzp_u8(vget_low_u8(y), vget_high_u8(y));
+	int16x8_t r = S16(vpaddlq_u8(a.val[0]));
+	int16x8_t g = S16(vpaddlq_u8(a.val[1]));
+	int16x8_t b = S16(vpaddlq_u8(a.val[2]));
+	uint8x8x4_t out;
+
+	out.val[0] = yy.val[0];
+	out.val[1] = neon_dot8(m->coef[1], r, g, b, CSC_COEF_BITS + 1, m->offset[1]);
+	out.val[2] = yy.val[1];
+	out.val[3] = neon_dot8(m->coef[2], r, g, b, CSC_COEF_BITS + 1, m->offset[2]);
+	vst4_u8(dst, out);
+}
+
+#endif
+
+int csc_to_nv12(const struct csc_matrix *matrix, const struct csc_src *src,
+		uint8_t *dst_y, uint8_t *dst_uv,
+		unsigned int dst_width, unsigned int dst_height,
+		unsigned int band_y, unsigned int band_height,
+		void *row_buf)
+{
+	uint32_t p0[CSC_CHUNK], p1[CSC_CHUNK];
+	uint32_t step_x = ((uint32_t)src->width << 16) / dst_width;
+	uint8_t *buf0 = row_buf;
+	uint8_t *buf1 = buf0 + src->width * 4;
+	const void *row0, *row1;
+	unsigned int x, y, count;
+
+	for (y = band_y; y < band_y + band_height; y += 2) {
+		row0 = read_row(src, y, dst_height, buf0);
+		row1 = read_row(src, y + 1, dst_height, buf1);
+		if (!row0 || !row1)
+			return -1;
+
+		for (x = 0; x < dst_width; x += CSC_CHUNK) {
+			count = dst_width - x;
+			if (count > CSC_CHUNK)
+				count = CSC_CHUNK;
+
+			gather(src, row0, x, count, step_x, p0);
+			gather(src, row1, x, count, step_x, p1);
+
+#if defined(__ARM_NEON)
+			if (count == CSC_CHUNK) {
+				nv12_chunk_neon(matrix, p0, p1, dst_y + x,
+						dst_y + dst_width + x, dst_uv + x);
+				continue;
+			}
+#endif
+			nv12_chunk_scalar(matrix, p0, p1, count, dst_y + x,
+					  dst_y + dst_width + x, dst_uv + x);
+		}
+
+		dst_y += 2 * dst_width;
+		dst_uv += dst_width;
+	}
+
+	return 0;
+}
+
+int csc_to_yuy2(const struct csc_matrix *matrix, const struct csc_src *src,
+		uint8_t *dst, unsigned int dst_width, unsigned int dst_height,
+		unsigned int band_y, unsigned int band_height,
+		void *row_buf)
+{
+	uint32_t p[CSC_CHUNK];
+	uint32_t step_x = ((uint32_t)src->width << 16) / dst_width;
+	const void *row;
+	unsigned int x, y, count;
+
+	for (y = band_y; y < band_y + band_height; y++) {
+		row = read_row(src, y, dst_height, row_buf);
+		if (!row)
+			return -1;
+
+		for (x = 0; x < dst_width; x += CSC_CHUNK) {
+			count = dst_width - x;
+			if (count > CSC_CHUNK)
+				count = CSC_CHUNK;
+
+			gather(src, row, x, count, step_x, p);
+
+#if defined(__ARM_NEON)
+			if (count == CSC_CHUNK) {
+				yuy2_chunk_neon(matrix, p, dst + 2 * x);
+				continue;
+			}
+#endif
+			yuy2_chunk_scalar(matrix, p, count, dst + 2 * x);
+		}
+
+		dst += 2 * dst_width;
+	}
+
+	return 0;
+}
+
+int csc_to_bgrx(const struct csc_src *src,
+		uint8_t *dst, unsigned int dst_width, unsigned int dst_height,
+		unsigned int band_y, unsigned int band_height,
+		void *row_buf)
+{
+	uint32_t step_x = ((uint32_t)src->width << 16) / dst_width;
+	uint32_t *out;
+	const void *row;
+	unsigned int i, x, y, count;
+
+	for (y = band_y; y < band_y + band_height; y++) {
+		row = read_row(src, y, dst_height, row_buf);
+		if (!row)
+			return -1;
+
+		for (x = 0; x < dst_width; x += CSC_CHUNK) {
+			count = dst_width - x;
+			if (count > CSC_CHUNK)
+				count = CSC_CHUNK;
+
+			out = (uint32_t *)dst + x;
+			gather(src, row, x, count, step_x, out);
+			for (i = 0; i < count; i++)
+				out[i] = (out[i] & 0xFF00FF00) | ((out[i] >> 16) & 0xFF) |
+					 ((out[i] & 0xFF) << 16);
+		}
+
+		dst += 4 * dst_width;
+	}
+
+	return 0;
+}
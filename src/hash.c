@@ -0,0 +1,26 @@
+#include "hash.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+void frame_hash_block(uint32_t lanes[4], const uint32_t *data, unsigned int count)
+{
+	unsigned int i;
+#if defined(__ARM_NEON)
+	uint32x4_t h = vld1q_u32(lanes);
+	const uint32x4_t prime = vdupq_n_u32(FRAME_HASH_PRIME);
+
+	for (i = 0; i < count; i += 4)
+		h = vmulq_u32(veorq_u32(h, vld1q_u32(&data[i])), prime);
+
+	vst1q_u32(lanes, h);
+#else
+	for (i = 0; i < count; i += 4) {
+		lanes[0] = (lanes[0] ^ data[i + 0]) * FRAME_HASH_PRIME;
+		lanes[1] = (lanes[1] ^ data[i + 1]) * FRAME_HASH_PRIME;
+		lanes[2] = (lanes[2] ^ data[i + 2]) * FRAME_HASH_PRIME;
+		lanes[3] = (lanes[3] ^ data[i + 3]) * FRAME_HASH_PRIME;
+	}
+#endif
+}
@@ -0,0 +1,155 @@
+#include <string.h>
+#include "isoc.h"
+
+unsigned int uvc_isoc_frame_packets(const struct uvc_frame_layout *layout,
+				    unsigned int packet_size)
+{
+	unsigned int i, size, packets = 0;
+	unsigned int max = packet_size - UVC_PAYLOAD_HEADER_SIZE;
+
+	for (i = 0; i < layout->num_slices; i++) {
+		size = layout->payload_size[i] - UVC_PAYLOAD_HEADER_SIZE;
+		packets += (size + max - 1) / max;
+	}
+
+	return packets;
+}
+
+/*
+ * Smallest tier that carries a frame of the mode every interval, -1 if
+ * none does.
+ */
+static int uvc_isoc_tier_find(unsigned int format_index, const struct uvc_mode *mode,
+			      unsigned int interval, const struct uvc_negotiate_ops *ops,
+			      const struct uvc_isoc_tiers *tiers)
+{
+	struct uvc_frame_layout layout;
+	unsigned int i;
+	uint64_t packets;
+
+	ops->mode_layout(format_index, mode, &layout);
+
+	for (i = 0; i < tiers->num_tiers; i++) {
+		packets = uvc_isoc_frame_packets(&layout, tiers->packet_size[i]);
+		if (packets * 10000000 <= (uint64_t)tiers->packets_per_second * interval)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Fastest interval of a frame, no faster than min_interval, that some tier
+ * carries. Returns 0 if there's none.
+ */
+static unsigned int uvc_isoc_interval_find(unsigned int format_index,
+					   const struct uvc_mode *mode,
+					   unsigned int min_interval,
+					   const struct uvc_negotiate_ops *ops,
+					   const struct uvc_isoc_tiers *tiers)
+{
+	unsigned int i, best = 0;
+
+	for (i = 0; i < mode->num_intervals; i++) {
+		if (mode->interval[i] < min_interval ||
+		    (best != 0 && mode->interval[i] >= best))
+			continue;
+		if (uvc_isoc_tier_find(format_index, mode, mode->interval[i], ops, tiers) >= 0)
+			best = mode->interval[i];
+	}
+
+	return best;
+}
+
+/*
+ * Largest frame of a format that fits at one of its intervals. Returns its
+ * index and interval, 0 if there's none.
+ */
+static unsigned int uvc_isoc_frame_find(unsigned int format_index, unsigned int *interval,
+					const struct uvc_negotiate_ops *ops,
+					const struct uvc_isoc_tiers *tiers)
+{
+	struct uvc_mode mode;
+	unsigned int frame_index, found, best = 0, best_area = 0;
+
+	for (frame_index = 1; ops->mode_get(format_index, frame_index, &mode) == 0; frame_index++) {
+		if (mode.width * mode.height <= best_area)
+			continue;
+
+		found = uvc_isoc_interval_find(format_index, &mode, 0, ops, tiers);
+		if (found != 0) {
+			best = frame_index;
+			best_area = mode.width * mode.height;
+			*interval = found;
+		}
+	}
+
+	return best;
+}
+
+int uvc_isoc_negotiate(struct uvc_streaming_control *ctrl,
+		       const struct uvc_streaming_control *def,
+		       const struct uvc_negotiate_ops *ops,
+		       const struct uvc_isoc_tiers *tiers)
+{
+	struct uvc_streaming_control req = *ctrl;
+	struct uvc_mode mode;
+	unsigned int interval;
+	int tier;
+
+	ops->mode_get(ctrl->bFormatIndex, ctrl->bFrameIndex, &mode);
+
+	tier = uvc_isoc_tier_find(ctrl->bFormatIndex, &mode, ctrl->dwFrameInterval, ops, tiers);
+	if (tier >= 0) {
+		ctrl->dwMaxPayloadTransferSize = tiers->packet_size[tier];
+		return 0;
+	}
+
+	interval = uvc_isoc_interval_find(ctrl->bFormatIndex, &mode, ctrl->dwFrameInterval,
+					  ops, tiers);
+	if (interval != 0) {
+		req.dwFrameInterval = interval;
+	} else {
+		req.bFrameIndex = uvc_isoc_frame_find(req.bFormatIndex, &interval, ops, tiers);
+		if (req.bFrameIndex == 0) {
+			req.bFormatIndex = def->bFormatIndex;
+			req.bFrameIndex = uvc_isoc_frame_find(req.bFormatIndex, &interval,
+							      ops, tiers);
+		}
+		if (req.bFrameIndex == 0) {
+			ctrl->dwMaxPayloadTransferSize = tiers->packet_size[tiers->num_tiers - 1];
+			return -1;
+		}
+		req.dwFrameInterval = interval;
+	}
+
+	uvc_negotiate(ctrl, &req, def, ops);
+	ops->mode_get(ctrl->bFormatIndex, ctrl->bFrameIndex, &mode);
+	tier = uvc_isoc_tier_find(ctrl->bFormatIndex, &mode, ctrl->dwFrameInterval, ops, tiers);
+	ctrl->dwMaxPayloadTransferSize = tiers->packet_size[tier];
+
+	return 1;
+}
+
+unsigned int uvc_isoc_pack(unsigned char *dst, const unsigned char *data,
+			   unsigned int size, const unsigned char *header,
+			   int eof, unsigned int packet_size)
+{
+	unsigned int max = packet_size - UVC_PAYLOAD_HEADER_SIZE;
+	unsigned int chunk, len = 0;
+
+	while (size > 0) {
+		chunk = (size < max) ? size : max;
+
+		memcpy(dst + len, header, UVC_PAYLOAD_HEADER_SIZE);
+		if (!eof || chunk != size)
+			dst[len + 1] &= ~UVC_STREAM_EOF;
+		memcpy(dst + len + UVC_PAYLOAD_HEADER_SIZE, data, chunk);
+
+		len += UVC_PAYLOAD_HEADER_SIZE + chunk;
+		data += chunk;
+		size -= chunk;
+	}
+
+	return len;
+}
@@ -0,0 +1,771 @@
+#include <string.h>
+#include "jpeg.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define ARRAY_SIZE(x)		(sizeof(x) / sizeof((x)[0]))
+
+/*
+ * Tables from ITU-T T.81 Annex K.
+ */
+static const uint8_t std_luma_qt[64] = {
+	16,  11,  10,  16,  24,  40,  51,  61,
+	12,  12,  14,  19,  26,  58,  60,  55,
+	14,  13,  16,  24,  40,  57,  69,  56,
+	14,  17,  22,  29,  51,  87,  80,  62,
+	18,  22,  37,  56,  68, 109, 103,  77,
+	24,  35,  55,  64,  81, 104, 113,  92,
+	49,  64,  78,  87, 103, 121, 120, 101,
+	72,  92,  95,  98, 112, 100, 103,  99
+};
+
+static const uint8_t std_chroma_qt[64] = {
+	17,  18,  24,  47,  99,  99,  99,  99,
+	18,  21,  26,  66,  99,  99,  99,  99,
+	24,  26,  56,  99,  99,  99,  99,  99,
+	47,  66,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99
+};
+
+/* Natural order index of each zigzag position */
+static const uint8_t zigzag[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static const uint8_t dc_luma_bits[16] = {
+	0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0
+};
+
+static const uint8_t dc_chroma_bits[16] = {
+	0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0
+};
+
+static const uint8_t dc_vals[12] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+static const uint8_t ac_luma_bits[16] = {
+	0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d
+};
+
+static const uint8_t ac_luma_vals[162] = {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+	0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+	0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+	0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+	0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+	0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+	0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+	0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+	0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+	0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+};
+
+static const uint8_t ac_chroma_bits[16] = {
+	0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77
+};
+
+static const uint8_t ac_chroma_vals[162] = {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+	0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+	0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+	0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+	0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+	0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+	0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+	0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+	0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+	0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+	0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+};
+
+struct huff_table {
+	uint16_t code[256];
+	uint8_t size[256];
+};
+
+static struct {
+	int initialized;
+	struct huff_table dc[2];
+	struct huff_table ac[2];
+} huff_tables;
+
+static void huff_table_build(struct huff_table *table, const uint8_t bits[16],
+			     const uint8_t *vals)
+{
+	unsigned int len, i, k = 0;
+	uint16_t code = 0;
+
+	memset(table, 0, sizeof(*table));
+
+	for (len = 1; len <= 16; len++) {
+		for (i = 0; i < bits[len - 1]; i++) {
+			table->code[vals[k]] = code;
+			table->size[vals[k]] = len;
+			code++;
+			k++;
+		}
+		code <<= 1;
+	}
+}
+
+static void huff_tables_init(void)
+{
+	if (huff_tables.initialized)
+		return;
+
+	huff_table_build(&huff_tables.dc[0], dc_luma_bits, dc_vals);
+	huff_table_build(&huff_tables.dc[1], dc_chroma_bits, dc_vals);
+	huff_table_build(&huff_tables.ac[0], ac_luma_bits, ac_luma_vals);
+	huff_table_build(&huff_tables.ac[1], ac_chroma_bits, ac_chroma_vals);
+	huff_tables.initialized = 1;
+}
+
+void jpeg_encoder_set_quality(struct jpeg_encoder *enc, unsigned int quality)
+{
+	const uint8_t *std_qt[2] = {std_luma_qt, std_chroma_qt};
+	unsigned int scale, i, t;
+	unsigned int q;
+
+	if (quality < 1)
+		quality = 1;
+	else if (quality > 100)
+		quality = 100;
+
+	/* IJG quality scaling */
+	scale = (quality < 50) ? 5000 / quality : 200 - 2 * quality;
+
+	for (t = 0; t < 2; t++) {
+		for (i = 0; i < 64; i++) {
+			q = (std_qt[t][zigzag[i]] * scale + 50) / 100;
+			if (q < 1)
+				q = 1;
+			else if (q > 255)
+				q = 255;
+
+			enc->qt[t][i] = q;
+			/* The FDCT output is scaled up by 8 */
+			enc->qt_recip[t][zigzag[i]] = ((1 << 18) + 4 * q) / (8 * q);
+		}
+	}
+
+	enc->quality = quality;
+}
+
+void jpeg_encoder_init(struct jpeg_encoder *enc, unsigned int width,
+		       unsigned int height, unsigned int quality)
+{
+	huff_tables_init();
+
+	enc->width = width;
+	enc->height = height;
+	enc->mcu_cols = (width + JPEG_MCU_SIZE - 1) / JPEG_MCU_SIZE;
+	enc->mcu_rows = (height + JPEG_MCU_SIZE - 1) / JPEG_MCU_SIZE;
+
+	jpeg_encoder_set_quality(enc, quality);
+}
+
+/*
+ * Headers
+ */
+
+struct byte_writer {
+	uint8_t *buf;
+	unsigned int size;
+	unsigned int pos;
+};
+
+static inline void put_u8(struct byte_writer *bw, uint8_t val)
+{
+	if (bw->pos < bw->size)
+		bw->buf[bw->pos] = val;
+	bw->pos++;
+}
+
+static inline void put_u16(struct byte_writer *bw, uint16_t val)
+{
+	put_u8(bw, val >> 8);
+	put_u8(bw, val);
+}
+
+static void put_dht(struct byte_writer *bw, uint8_t class_id,
+		    const uint8_t bits[16], const uint8_t *vals)
+{
+	unsigned int i, count = 0;
+
+	for (i = 0; i < 16; i++)
+		count += bits[i];
+
+	put_u8(bw, class_id);
+	for (i = 0; i < 16; i++)
+		put_u8(bw, bits[i]);
+	for (i = 0; i < count; i++)
+		put_u8(bw, vals[i]);
+}
+
+int jpeg_write_headers(const struct jpeg_encoder *enc, uint8_t *out,
+		       unsigned int out_size, unsigned int restart_interval)
+{
+	struct byte_writer bw = {out, out_size, 0};
+	unsigned int i, t;
+
+	/* SOI */
+	put_u16(&bw, 0xFFD8);
+
+	/* DQT */
+	put_u16(&bw, 0xFFDB);
+	put_u16(&bw, 2 + 2 * 65);
+	for (t = 0; t < 2; t++) {
+		put_u8(&bw, t);
+		for (i = 0; i < 64; i++)
+			put_u8(&bw, enc->qt[t][i]);
+	}
+
+	/* SOF0: Y 2x2, Cb 1x1, Cr 1x1 */
+	put_u16(&bw, 0xFFC0);
+	put_u16(&bw, 8 + 3 * 3);
+	put_u8(&bw, 8);
+	put_u16(&bw, enc->height);
+	put_u16(&bw, enc->width);
+	put_u8(&bw, 3);
+	put_u8(&bw, 1); put_u8(&bw, 0x22); put_u8(&bw, 0);
+	put_u8(&bw, 2); put_u8(&bw, 0x11); put_u8(&bw, 1);
+	put_u8(&bw, 3); put_u8(&bw, 0x11); put_u8(&bw, 1);
+
+	/* DHT */
+	put_u16(&bw, 0xFFC4);
+	put_u16(&bw, 2 + 4 * 17 + 2 * ARRAY_SIZE(dc_vals) + 2 * ARRAY_SIZE(ac_luma_vals));
+	put_dht(&bw, 0x00, dc_luma_bits, dc_vals);
+	put_dht(&bw, 0x10, ac_luma_bits, ac_luma_vals);
+	put_dht(&bw, 0x01, dc_chroma_bits, dc_vals);
+	put_dht(&bw, 0x11, ac_chroma_bits, ac_chroma_vals);
+
+	/* DRI */
+	if (restart_interval) {
+		put_u16(&bw, 0xFFDD);
+		put_u16(&bw, 4);
+		put_u16(&bw, restart_interval);
+	}
+
+	/* SOS */
+	put_u16(&bw, 0xFFDA);
+	put_u16(&bw, 6 + 2 * 3);
+	put_u8(&bw, 3);
+	put_u8(&bw, 1); put_u8(&bw, 0x00);
+	put_u8(&bw, 2); put_u8(&bw, 0x11);
+	put_u8(&bw, 3); put_u8(&bw, 0x11);
+	put_u8(&bw, 0);
+	put_u8(&bw, 63);
+	put_u8(&bw, 0);
+
+	if (bw.pos > bw.size)
+		return -1;
+
+	return bw.pos;
+}
+
+/*
+ * Entropy coding
+ */
+
+struct bit_writer {
+	uint8_t *buf;
+	unsigned int size;
+	unsigned int pos;
+	uint32_t acc;
+	unsigned int bits;
+};
+
+static inline void put_bits(struct bit_writer *bw, uint32_t code, unsigned int len)
+{
+	uint8_t byte;
+
+	bw->acc = (bw->acc << len) | (code & ((1 << len) - 1));
+	bw->bits += len;
+
+	while (bw->bits >= 8) {
+		bw->bits -= 8;
+		byte = bw->acc >> bw->bits;
+
+		if (bw->pos < bw->size)
+			bw->buf[bw->pos] = byte;
+		bw->pos++;
+
+		/* Byte stuffing */
+		if (byte == 0xFF) {
+			if (bw->pos < bw->size)
+				bw->buf[bw->pos] = 0;
+			bw->pos++;
+		}
+	}
+}
+
+static inline void flush_bits(struct bit_writer *bw)
+{
+	if (bw->bits)
+		put_bits(bw, 0x7F, 8 - bw->bits);
+}
+
+static inline unsigned int bit_length(unsigned int val)
+{
+	return val ? 32 - __builtin_clz(val) : 0;
+}
+
+static void encode_block(struct bit_writer *bw, const int32_t block[64],
+			 int *dc_pred, unsigned int table)
+{
+	const struct huff_table *dc = &huff_tables.dc[table];
+	const struct huff_table *ac = &huff_tables.ac[table];
+	unsigned int k, run, nbits, sym;
+	int val, diff;
+
+	diff = block[0] - *dc_pred;
+	*dc_pred = block[0];
+
+	nbits = bit_length(diff < 0 ? -diff : diff);
+	put_bits(bw, dc->code[nbits], dc->size[nbits]);
+	if (nbits)
+		put_bits(bw, diff < 0 ? diff - 1 : diff, nbits);
+
+	run = 0;
+	for (k = 1; k < 64; k++) {
+		val = block[zigzag[k]];
+		if (val == 0) {
+			run++;
+			continue;
+		}
+
+		while (run > 15) {
+			put_bits(bw, ac->code[0xF0], ac->size[0xF0]);
+			run -= 16;
+		}
+
+		nbits = bit_length(val < 0 ? -val : val);
+		sym = (run << 4) | nbits;
+		put_bits(bw, ac->code[sym], ac->size[sym]);
+		put_bits(bw, val < 0 ? val - 1 : val, nbits);
+		run = 0;
+	}
+
+	if (run)
+		put_bits(bw, ac->code[0x00], ac->size[0x00]);
+}
+
+/*
+ * Forward DCT: integer LLM algorithm, as in the IJG "islow" FDCT.
+ * The output is scaled up by 8.
+ */
+
+#define CONST_BITS		13
+#define PASS1_BITS		2
+#define FIX_0_298631336		2446
+#define FIX_0_390180644		3196
+#define FIX_0_541196100		4433
+#define FIX_0_765366865		6270
+#define FIX_0_899976223		7373
+#define FIX_1_175875602		9633
+#define FIX_1_501321110		12299
+#define FIX_1_847759065		15137
+#define FIX_1_961570560		16069
+#define FIX_2_053119869		16819
+#define FIX_2_562915447		20995
+#define FIX_3_072711026		25172
+#define DESCALE(x, n)		(((x) + (1 << ((n) - 1))) >> (n))
+
+#if defined(__ARM_NEON)
+/*
+ * NEON version of fdct_pass(), bit-exact with it: each vector holds one
+ * sample of 8 rows (or columns) in 16 bits, which is enough for the islow
+ * data ranges. Products are only taken of the tmp values so that no 16-bit
+ * sum can overflow: z1-z5 are folded into the constants.
+ */
+static void fdct_pass_neon(int16x8_t v[8], int last)
+{
+	int16x8_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int16x8_t tmp10, tmp11, tmp12, tmp13;
+	int32x4_t lo, hi;
+
+	tmp0 = vaddq_s16(v[0], v[7]);
+	tmp7 = vsubq_s16(v[0], v[7]);
+	tmp1 = vaddq_s16(v[1], v[6]);
+	tmp6 = vsubq_s16(v[1], v[6]);
+	tmp2 = vaddq_s16(v[2], v[5]);
+	tmp5 = vsubq_s16(v[2], v[5]);
+	tmp3 = vaddq_s16(v[3], v[4]);
+	tmp4 = vsubq_s16(v[3], v[4]);
+
+	tmp10 = vaddq_s16(tmp0, tmp3);
+	tmp13 = vsubq_s16(tmp0, tmp3);
+	tmp11 = vaddq_s16(tmp1, tmp2);
+	tmp12 = vsubq_s16(tmp1, tmp2);
+
+	if (last) {
+		v[0] = vrshrq_n_s16(vaddq_s16(tmp10, tmp11), PASS1_BITS);
+		v[4] = vrshrq_n_s16(vsubq_s16(tmp10, tmp11), PASS1_BITS);
+	} else {
+		v[0] = vshlq_n_s16(vaddq_s16(tmp10, tmp11), PASS1_BITS);
+		v[4] = vshlq_n_s16(vsubq_s16(tmp10, tmp11), PASS1_BITS);
+	}
+
+/* out = DESCALE(a * ca + b * cb [+ c * cc + d * cd], shift_odd) */
+#define FDCT_MUL2(out, a, ca, b, cb)						\
+	do {									\
+		lo = vmull_n_s16(vget_low_s16(a), ca);				\
+		hi = vmull_n_s16(vget_high_s16(a), ca);				\
+		lo = vmlal_n_s16(lo, vget_low_s16(b), cb);			\
+		hi = vmlal_n_s16(hi, vget_high_s16(b), cb);			\
+		FDCT_DESCALE(out);						\
+	} while (0)
+#define FDCT_MUL4(out, ca, cb, cc, cd)						\
+	do {									\
+		lo = vmull_n_s16(vget_low_s16(tmp4), ca);			\
+		hi = vmull_n_s16(vget_high_s16(tmp4), ca);			\
+		lo = vmlal_n_s16(lo, vget_low_s16(tmp5), cb);			\
+		hi = vmlal_n_s16(hi, vget_high_s16(tmp5), cb);			\
+		lo = vmlal_n_s16(lo, vget_low_s16(tmp6), cc);			\
+		hi = vmlal_n_s16(hi, vget_high_s16(tmp6), cc);			\
+		lo = vmlal_n_s16(lo, vget_low_s16(tmp7), cd);			\
+		hi = vmlal_n_s16(hi, vget_high_s16(tmp7), cd);			\
+		FDCT_DESCALE(out);						\
+	} while (0)
+#define FDCT_DESCALE(out)							\
+	do {									\
+		if (last)							\
+			out = vcombine_s16(vrshrn_n_s32(lo, CONST_BITS + PASS1_BITS), \
+					   vrshrn_n_s32(hi, CONST_BITS + PASS1_BITS)); \
+		else								\
+			out = vcombine_s16(vrshrn_n_s32(lo, CONST_BITS - PASS1_BITS), \
+					   vrshrn_n_s32(hi, CONST_BITS - PASS1_BITS)); \
+	} while (0)
+
+	FDCT_MUL2(v[2], tmp13, FIX_0_541196100 + FIX_0_765366865,
+		  tmp12, FIX_0_541196100);
+	FDCT_MUL2(v[6], tmp13, FIX_0_541196100,
+		  tmp12, FIX_0_541196100 - FIX_1_847759065);
+
+	FDCT_MUL4(v[7],
+		  FIX_0_298631336 - FIX_0_899976223 - FIX_1_961570560 + FIX_1_175875602,
+		  FIX_1_175875602,
+		  FIX_1_175875602 - FIX_1_961570560,
+		  FIX_1_175875602 - FIX_0_899976223);
+	FDCT_MUL4(v[5],
+		  FIX_1_175875602,
+		  FIX_2_053119869 - FIX_2_562915447 - FIX_0_390180644 + FIX_1_175875602,
+		  FIX_1_175875602 - FIX_2_562915447,
+		  FIX_1_175875602 - FIX_0_390180644);
+	FDCT_MUL4(v[3],
+		  FIX_1_175875602 - FIX_1_961570560,
+		  FIX_1_175875602 - FIX_2_562915447,
+		  FIX_3_072711026 - FIX_2_562915447 - FIX_1_961570560 + FIX_1_175875602,
+		  FIX_1_175875602);
+	FDCT_MUL4(v[1],
+		  FIX_1_175875602 - FIX_0_899976223,
+		  FIX_1_175875602 - FIX_0_390180644,
+		  FIX_1_175875602,
+		  FIX_1_501321110 - FIX_0_899976223 - FIX_0_390180644 + FIX_1_175875602);
+
+#undef FDCT_MUL2
+#undef FDCT_MUL4
+#undef FDCT_DESCALE
+}
+
+static void transpose_8x8(int16x8_t v[8])
+{
+	int16x8x2_t t01 = vtrnq_s16(v[0], v[1]);
+	int16x8x2_t t23 = vtrnq_s16(v[2], v[3]);
+	int16x8x2_t t45 = vtrnq_s16(v[4], v[5]);
+	int16x8x2_t t67 = vtrnq_s16(v[6], v[7]);
+	int32x4x2_t t02 = vtrnq_s32(vreinterpretq_s32_s16(t01.val[0]),
+				    vreinterpretq_s32_s16(t23.val[0]));
+	int32x4x2_t t13 = vtrnq_s32(vreinterpretq_s32_s16(t01.val[1]),
+				    vreinterpretq_s32_s16(t23.val[1]));
+	int32x4x2_t t46 = vtrnq_s32(vreinterpretq_s32_s16(t45.val[0]),
+				    vreinterpretq_s32_s16(t67.val[0]));
+	int32x4x2_t t57 = vtrnq_s32(vreinterpretq_s32_s16(t45.val[1]),
+				    vreinterpretq_s32_s16(t67.val[1]));
+
+#define TRANSPOSE_ROW(lo, hi, half)						\
+	vreinterpretq_s16_s32(vcombine_s32(vget_##half##_s32(lo), vget_##half##_s32(hi)))
+
+	v[0] = TRANSPOSE_ROW(t02.val[0], t46.val[0], low);
+	v[1] = TRANSPOSE_ROW(t13.val[0], t57.val[0], low);
+	v[2] = TRANSPOSE_ROW(t02.val[1], t46.val[1], low);
+	v[3] = TRANSPOSE_ROW(t13.val[1], t57.val[1], low);
+	v[4] = TRANSPOSE_ROW(t02.val[0], t46.val[0], high);
+	v[5] = TRANSPOSE_ROW(t13.val[0], t57.val[0], high);
+	v[6] = TRANSPOSE_ROW(t02.val[1], t46.val[1], high);
+	v[7] = TRANSPOSE_ROW(t13.val[1], t57.val[1], high);
+
+#undef TRANSPOSE_ROW
+}
+
+/*
+ * The row pass works on columns of samples, so the block is transposed
+ * before each pass. The second transpose brings it back to rows.
+ */
+static void fdct_neon(int32_t block[64])
+{
+	int16x8_t v[8];
+	unsigned int i;
+
+	for (i = 0; i < 8; i++)
+		v[i] = vcombine_s16(vmovn_s32(vld1q_s32(&block[i * 8])),
+				    vmovn_s32(vld1q_s32(&block[i * 8 + 4])));
+
+	transpose_8x8(v);
+	fdct_pass_neon(v, 0);	/* rows */
+	transpose_8x8(v);
+	fdct_pass_neon(v, 1);	/* columns */
+
+	for (i = 0; i < 8; i++) {
+		vst1q_s32(&block[i * 8], vmovl_s16(vget_low_s16(v[i])));
+		vst1q_s32(&block[i * 8 + 4], vmovl_s16(vget_high_s16(v[i])));
+	}
+}
+#else
+static void fdct_pass(int32_t *data, unsigned int stride, int last)
+{
+	int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int32_t tmp10, tmp11, tmp12, tmp13;
+	int32_t z1, z2, z3, z4, z5;
+	unsigned int i, step = (stride == 1) ? 8 : 1;
+	unsigned int shift_odd = last ? CONST_BITS + PASS1_BITS : CONST_BITS - PASS1_BITS;
+	int32_t *d;
+
+	for (i = 0; i < 8; i++) {
+		d = data + i * step;
+
+		tmp0 = d[0 * stride] + d[7 * stride];
+		tmp7 = d[0 * stride] - d[7 * stride];
+		tmp1 = d[1 * stride] + d[6 * stride];
+		tmp6 = d[1 * stride] - d[6 * stride];
+		tmp2 = d[2 * stride] + d[5 * stride];
+		tmp5 = d[2 * stride] - d[5 * stride];
+		tmp3 = d[3 * stride] + d[4 * stride];
+		tmp4 = d[3 * stride] - d[4 * stride];
+
+		tmp10 = tmp0 + tmp3;
+		tmp13 = tmp0 - tmp3;
+		tmp11 = tmp1 + tmp2;
+		tmp12 = tmp1 - tmp2;
+
+		if (last) {
+			d[0 * stride] = DESCALE(tmp10 + tmp11, PASS1_BITS);
+			d[4 * stride] = DESCALE(tmp10 - tmp11, PASS1_BITS);
+		} else {
+			d[0 * stride] = (tmp10 + tmp11) << PASS1_BITS;
+			d[4 * stride] = (tmp10 - tmp11) << PASS1_BITS;
+		}
+
+		z1 = (tmp12 + tmp13) * FIX_0_541196100;
+		d[2 * stride] = DESCALE(z1 + tmp13 * FIX_0_765366865, shift_odd);
+		d[6 * stride] = DESCALE(z1 - tmp12 * FIX_1_847759065, shift_odd);
+
+		z1 = tmp4 + tmp7;
+		z2 = tmp5 + tmp6;
+		z3 = tmp4 + tmp6;
+		z4 = tmp5 + tmp7;
+		z5 = (z3 + z4) * FIX_1_175875602;
+
+		tmp4 *= FIX_0_298631336;
+		tmp5 *= FIX_2_053119869;
+		tmp6 *= FIX_3_072711026;
+		tmp7 *= FIX_1_501321110;
+		z1 *= -FIX_0_899976223;
+		z2 *= -FIX_2_562915447;
+		z3 *= -FIX_1_961570560;
+		z4 *= -FIX_0_390180644;
+
+		z3 += z5;
+		z4 += z5;
+
+		d[7 * stride] = DESCALE(tmp4 + z1 + z3, shift_odd);
+		d[5 * stride] = DESCALE(tmp5 + z2 + z4, shift_odd);
+		d[3 * stride] = DESCALE(tmp6 + z2 + z3, shift_odd);
+		d[1 * stride] = DESCALE(tmp7 + z1 + z4, shift_odd);
+	}
+}
+#endif
+
+static void fdct_quantize(int32_t block[64], const uint32_t recip[64])
+{
+	unsigned int i;
+
+#if defined(__ARM_NEON)
+	const uint32x4_t round = vdupq_n_u32(1 << 17);
+
+	fdct_neon(block);
+
+	for (i = 0; i < 64; i += 4) {
+		int32x4_t coef = vld1q_s32(&block[i]);
+		uint32x4_t sign = vcltq_s32(coef, vdupq_n_s32(0));
+		uint32x4_t mag = vreinterpretq_u32_s32(vabsq_s32(coef));
+		int32x4_t q;
+
+		mag = vshrq_n_u32(vmlaq_u32(round, mag, vld1q_u32(&recip[i])), 18);
+		q = vreinterpretq_s32_u32(mag);
+		q = vbslq_s32(sign, vnegq_s32(q), q);
+		vst1q_s32(&block[i], q);
+	}
+#else
+	fdct_pass(block, 1, 0);	/* rows */
+	fdct_pass(block, 8, 1);	/* columns */
+
+	for (i = 0; i < 64; i++) {
+		int32_t coef = block[i];
+		uint32_t mag = ((uint32_t)(coef < 0 ? -coef : coef) * recip[i] +
+				(1 << 17)) >> 18;
+		block[i] = coef < 0 ? -(int32_t)mag : (int32_t)mag;
+	}
+#endif
+}
+
+static void load_luma_block(int32_t block[64], const struct jpeg_encoder *enc,
+			    const uint8_t *y, unsigned int x0, unsigned int y0)
+{
+	unsigned int i, j, row, col;
+	const uint8_t *src;
+
+	for (i = 0; i < 8; i++) {
+		row = y0 + i;
+		if (row >= enc->height)
+			row = enc->height - 1;
+		src = y + row * enc->width;
+
+		for (j = 0; j < 8; j++) {
+			col = x0 + j;
+			if (col >= enc->width)
+				col = enc->width - 1;
+			block[i * 8 + j] = (int32_t)src[col] - 128;
+		}
+	}
+}
+
+/*
+ * Loads the Cb (component 0) or Cr (component 1) block of an MCU from the
+ * interleaved NV12 UV plane.
+ */
+static void load_chroma_block(int32_t block[64], const struct jpeg_encoder *enc,
+			      const uint8_t *uv, unsigned int x0, unsigned int y0,
+			      unsigned int component)
+{
+	unsigned int chroma_width = (enc->width + 1) / 2;
+	unsigned int chroma_height = (enc->height + 1) / 2;
+	unsigned int i, j, row, col;
+	const uint8_t *src;
+
+	for (i = 0; i < 8; i++) {
+		row = y0 + i;
+		if (row >= chroma_height)
+			row = chroma_height - 1;
+		src = uv + row * enc->width;
+
+		for (j = 0; j < 8; j++) {
+			col = x0 + j;
+			if (col >= chroma_width)
+				col = chroma_width - 1;
+			block[i * 8 + j] = (int32_t)src[2 * col + component] - 128;
+		}
+	}
+}
+
+int jpeg_encode_mcu_rows(const struct jpeg_encoder *enc, const uint8_t *y,
+			 const uint8_t *uv, unsigned int first_row,
+			 unsigned int num_rows, uint8_t *out,
+			 unsigned int out_size)
+{
+	struct bit_writer bw = {out, out_size, 0, 0, 0};
+	int dc_pred[3] = {0, 0, 0};
+	int32_t block[64];
+	unsigned int mx, my, b, x0, y0;
+
+	for (my = first_row; my < first_row + num_rows && my < enc->mcu_rows; my++) {
+		for (mx = 0; mx < enc->mcu_cols; mx++) {
+			x0 = mx * JPEG_MCU_SIZE;
+			y0 = my * JPEG_MCU_SIZE;
+
+			for (b = 0; b < 4; b++) {
+				load_luma_block(block, enc, y, x0 + (b & 1) * 8,
+						y0 + (b >> 1) * 8);
+				fdct_quantize(block, enc->qt_recip[0]);
+				encode_block(&bw, block, &dc_pred[0], 0);
+			}
+
+			for (b = 0; b < 2; b++) {
+				load_chroma_block(block, enc, uv, x0 / 2, y0 / 2, b);
+				fdct_quantize(block, enc->qt_recip[1]);
+				encode_block(&bw, block, &dc_pred[1 + b], 1);
+			}
+		}
+
+		/* Bail out early instead of encoding the rest for nothing */
+		if (bw.pos > bw.size)
+			return -1;
+	}
+
+	flush_bits(&bw);
+
+	if (bw.pos > bw.size)
+		return -1;
+
+	return bw.pos;
+}
+
+unsigned int jpeg_rate_control_update(const struct jpeg_rate_control *rc,
+				      unsigned int quality,
+				      unsigned int frame_size)
+{
+	unsigned int next = quality;
+
+	/*
+	 * Over budget: scale the quality down proportionally. Comfortably
+	 * under budget: creep back up one step at a time.
+	 */
+	if (frame_size > rc->budget) {
+		next = (quality * rc->budget) / frame_size;
+		if (next >= quality)
+			next = quality - 1;
+	} else if (frame_size < rc->budget - rc->budget / 4) {
+		next = quality + 1;
+	}
+
+	if (next < rc->quality_min)
+		next = rc->quality_min;
+	if (next > rc->quality_max)
+		next = rc->quality_max;
+
+	return next;
+}
@@ -9,6 +9,13 @@
 #include <string.h>
 #include "usb_descriptors.h"
 #include "uvc.h"
+#include "mjpeg.h"
+#include "csc.h"
+#include "hash.h"
+#include "pacer.h"
+#include "negotiate.h"
+#include "isoc.h"
+#include "worker.h"
 
 #ifdef DEBUG
 
@@ -33,12 +40,6 @@
 #define UVC_DRIVER_NAME			"VITAUVC00"
 #define UVC_USB_PID			0x1337
 
-#define MAX_UVC_VIDEO_FRAME_SIZE	VIDEO_FRAME_SIZE_NV12(1280, 720)
-
-#define UVC_PAYLOAD_HEADER_SIZE		12
-#define UVC_PAYLOAD_SIZE(frame_size)	(UVC_PAYLOAD_HEADER_SIZE + (frame_size))
-#define MAX_UVC_PAYLOAD_TRANSFER_SIZE	UVC_PAYLOAD_SIZE(MAX_UVC_VIDEO_FRAME_SIZE)
-
 #define SCE_DISPLAY_PIXELFORMAT_BGRA5551 0x50000000
 
 int ksceOledDisplayOn();
@@ -63,23 +64,23 @@ typedef struct SceIftuPlaneState_updated {
 	unsigned int dst_y;             /* offset into the destination buffer */
 	unsigned int src_x;             /* offset into the source buffer in 8.8 fixed point, strictly less than 4.0 */
 	unsigned int src_y;             /* offset into the source buffer in 8.8 fixed point, strictly less than 4.0 */
-	unsigned int crop_top;
-	unsigned int crop_bot;
-	unsigned int crop_left;
-	unsigned int crop_right;
+	unsigned int crop[4];           /* top, bottom, left, right: unused, see uvc_stream_plan_source() */
 } SceIftuPlaneState_updated;
 
 /*
- * We want the data field (raw pixel data) to be aligned to 16B for the IFTU CSC to work properly.
- * It seems the USB controller is fine with data aligned to 4B (starts reading from header field).
+ * dst_x and dst_y of the source planes, as set by the original full screen
+ * conversion: the 960x544 screen size in 8.8 fixed point minus the source
+ * size, both divided by 512.
  */
-#define UVC_FRAME_PADDING_SIZE (16 - UVC_PAYLOAD_HEADER_SIZE)
-struct uvc_frame {
-	unsigned char padding[UVC_FRAME_PADDING_SIZE];
-	unsigned char header[UVC_PAYLOAD_HEADER_SIZE];
-	unsigned char data[];
-} __attribute__((packed));
+#define IFTU_SCREEN_WIDTH		960
+#define IFTU_SCREEN_HEIGHT		544
+#define IFTU_PLANE_DST_X(src_width)	((IFTU_SCREEN_WIDTH << 8) / 512 - (src_width) / 512)
+#define IFTU_PLANE_DST_Y(src_height)	((IFTU_SCREEN_HEIGHT << 8) / 512 - (src_height) / 512)
 
+/*
+ * The frame and payload sizes are filled in by uvc_streaming_negotiate()
+ * for the selected mode.
+ */
 static const struct uvc_streaming_control uvc_probe_control_setting_default = {
 	.bmHint				= 0,
 	.bFormatIndex			= FORMAT_INDEX_UNCOMPRESSED_NV12,
@@ -90,30 +91,485 @@ static const struct uvc_streaming_control uvc_probe_control_setting_default = {
 	.wCompQuality			= 0,
 	.wCompWindowSize		= 0,
 	.wDelay				= 0,
-	.dwMaxVideoFrameSize		= MAX_UVC_VIDEO_FRAME_SIZE,
-	.dwMaxPayloadTransferSize	= MAX_UVC_PAYLOAD_TRANSFER_SIZE,
-	.dwClockFrequency		= 0,
+	.dwMaxVideoFrameSize		= 0,
+	.dwMaxPayloadTransferSize	= 0,
+	.dwClockFrequency		= UVC_CLOCK_FREQUENCY,
 	.bmFramingInfo			= 0,
 	.bPreferedVersion		= 1,
 	.bMinVersion			= 0,
 	.bMaxVersion			= 0,
 };
 
+/* Being negotiated by the host */
 static struct uvc_streaming_control uvc_probe_control_setting;
+/* Used by the stream */
+static struct uvc_streaming_control uvc_commit_control_setting;
 
-static struct {
+static int uvc_streaming_negotiate(struct uvc_streaming_control *ctrl,
+				   const struct uvc_streaming_control *req);
+
+/*
+ * EP0 requests are owned by the controller until their onComplete, so each
+ * one gets its own descriptor and data buffer from a fixed pool instead of
+ * reusing a single one that a new request would clobber. A reply that never
+ * completes (host timeout, reset) would keep its slot forever: once the
+ * pool runs out, the requests still queued on EP0 are cancelled and their
+ * slots reclaimed, which is safe as a new SETUP has ended their control
+ * transfers. The same happens on detach.
+ */
+#define USB_EP0_REQ_POOL_SIZE	4
+
+static struct usb_ep0_req {
+	SceUdcdDeviceRequest req;
+	SceUdcdEP0DeviceRequest ep0_req;	/* Setup of a data OUT stage */
 	unsigned char buffer[64];
-	SceUdcdEP0DeviceRequest ep0_req;
-} pending_recv;
+	int busy;
+} usb_ep0_reqs[USB_EP0_REQ_POOL_SIZE];
+
+/*
+ * uvc_event_flag_id bits.
+ */
+#define UVC_EVENT_FRAME			(1 << 0)	/* vblank tick, commit or stop */
+#define UVC_EVENT_XFER_DONE		(1 << 1)	/* bulk request onComplete */
+#define UVC_EVENT_FLIP			(1 << 2)	/* the app set a new framebuffer */
 
 static SceUID uvc_thread_id;
 static SceUID uvc_event_flag_id;
 static int uvc_thread_run;
 static int stream;
 
-static SceUID uvc_frame_buffer_uid = -1;
-static struct uvc_frame *uvc_frame_buffer_addr;
-SceUID uvc_frame_req_evflag;
+/*
+ * Each frame can be split into UVC_FRAME_SLICES horizontal bands, each one
+ * sent as its own payload (same FID, EOF only on the last one), so that
+ * band k + 1 is converted while band k is on the wire.
+ */
+#ifndef UVC_FRAME_SLICES
+#define UVC_FRAME_SLICES	1
+#endif
+
+#if UVC_FRAME_SLICES < 1 || UVC_FRAME_SLICES > UVC_MAX_FRAME_SLICES
+#error "UVC_FRAME_SLICES must be between 1 and UVC_MAX_FRAME_SLICES"
+#endif
+
+static struct uvc_frame_layout uvc_frame_layout;
+
+/*
+ * uvc_thread only blocks on uvc_event_flag_id when it has no work left:
+ * capture/conversion is driven by UVC_EVENT_FRAME and submission by
+ * UVC_EVENT_XFER_DONE, so a slow transfer doesn't keep it from reacting
+ * to vblanks, commits or aborts.
+ */
+/*
+ * There's no draining state: stopping the stream cancels the endpoint, and
+ * everything in flight is retired at once since cancelled requests may
+ * never complete.
+ */
+enum uvc_stream_state {
+	UVC_STREAM_STATE_IDLE,		/* Nothing converted nor in flight */
+	UVC_STREAM_STATE_CONVERTING,	/* The IFTU is writing into a ring buffer */
+	UVC_STREAM_STATE_IN_FLIGHT,	/* Payloads are queued on the bulk endpoint */
+};
+
+/*
+ * Identifies the contents of a source framebuffer: a new flip or a different
+ * buffer means a new frame. With UVC_FRAME_HASH, a sampled hash of the pixels
+ * also catches apps that redraw into the same buffer without flipping.
+ */
+#ifndef UVC_FRAME_HASH
+#define UVC_FRAME_HASH		0
+#endif
+#define UVC_FRAME_HASH_ROWS	16
+
+/*
+ * Region of the source framebuffer that is captured. x and width are
+ * multiples of 16 pixels, y and height are even.
+ */
+struct uvc_frame_roi {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+};
+
+/*
+ * Fixed region of interest as x,y,width,height in source pixels, the
+ * whole framebuffer if empty. Otherwise, with UVC_AUTO_CROP, black borders
+ * are detected every UVC_AUTO_CROP_INTERVAL microseconds and cropped out.
+ * Either way the region is grown to the aspect ratio of the mode and
+ * scaled to fit it.
+ */
+#ifndef UVC_ROI
+#define UVC_ROI			0, 0, 0, 0
+#endif
+#ifndef UVC_AUTO_CROP
+#define UVC_AUTO_CROP		0
+#endif
+#define UVC_AUTO_CROP_INTERVAL	(1000 * 1000)
+#define UVC_AUTO_CROP_THRESHOLD	24	/* Max R, G and B of a black pixel */
+#define UVC_AUTO_CROP_STEP	8	/* Pixel step when checking rows */
+
+static const struct uvc_frame_roi uvc_roi_manual = {UVC_ROI};
+
+static struct {
+	uint64_t last_detect;
+	struct uvc_frame_roi candidate;	/* Last detection */
+	struct uvc_frame_roi roi;	/* Applied once detected twice in a row */
+	int valid;
+} uvc_auto_crop;
+
+/*
+ * Converts on the CPU (NEON, all the cores) instead of with the IFTU.
+ * Otherwise the CPU is only used when the IFTU fails.
+ */
+#ifndef UVC_SW_CSC
+#define UVC_SW_CSC		0
+#endif
+
+struct uvc_frame_source {
+	uintptr_t paddr;
+	unsigned int vblankcount;
+	unsigned int width;
+	unsigned int height;
+	unsigned int pixelformat;
+	uint32_t hash;
+	int valid;
+};
+
+/*
+ * Unchanged frames aren't converted again: the previous converted buffer is
+ * resent instead, at most once every UVC_UNCHANGED_KEEPALIVE_INTERVAL
+ * microseconds (0 resends it on every tick).
+ */
+#ifndef UVC_UNCHANGED_KEEPALIVE_INTERVAL
+#define UVC_UNCHANGED_KEEPALIVE_INTERVAL	0
+#endif
+
+/*
+ * Captures frames when the app sets a new framebuffer instead of on
+ * vblanks, so that each captured frame is one the app actually produced.
+ * Vblanks still keep the stream going when nothing has been flipped for
+ * UVC_FLIP_TIMEOUT microseconds (static screens, loading screens).
+ */
+#ifndef UVC_FLIP_CAPTURE
+#define UVC_FLIP_CAPTURE	0
+#endif
+#define UVC_FLIP_TIMEOUT	(100 * 1000)
+
+static uint64_t uvc_flip_time;
+
+/*
+ * What happens to a new frame when both ring buffers are taken, that is
+ * when the host reads slower than frames come. next is the mailbox between
+ * capture and transmission:
+ *
+ * - DROP_NEWEST: the new frame is dropped and next is sent.
+ * - DROP_OLDEST: the new frame replaces next, unless next is being sent
+ *   already. The host always gets the freshest image.
+ * - BLOCK: the capture waits for a free buffer, further frame ticks are
+ *   folded into it.
+ */
+#define FRAME_POLICY_DROP_NEWEST	0
+#define FRAME_POLICY_DROP_OLDEST	1
+#define FRAME_POLICY_BLOCK		2
+
+#ifndef UVC_FRAME_POLICY
+#define UVC_FRAME_POLICY	FRAME_POLICY_DROP_OLDEST
+#endif
+
+static struct {
+	enum uvc_stream_state state;
+	int cur;			/* Ring index being sent, -1 if none */
+	int next;			/* Ring index captured after cur, -1 if none */
+	int last;			/* Ring index of the newest converted frame, -1 if none */
+	struct uvc_frame_source last_source;
+	uint64_t last_queue_time;
+	unsigned int fid;
+	int stalled;			/* Stopped by the watchdog, retried until a payload gets through */
+	unsigned int errors;		/* In a row, since the last payload got through */
+	uint64_t stall_time;
+	unsigned int restarts;		/* By the watchdog since the last commit or SET_INTERFACE */
+	int capture_pending;		/* FRAME_POLICY_BLOCK: waiting for a free buffer */
+} uvc_stream = {
+	.state		= UVC_STREAM_STATE_IDLE,
+	.cur		= -1,
+	.next		= -1,
+	.last		= -1,
+};
+
+struct uvc_stat {
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+	uint32_t count;
+};
+
+/*
+ * Pipeline statistics, read by the host through the Extension Unit. The
+ * counters run since the plugin was loaded, the timings since the last
+ * mode change.
+ */
+static struct {
+	uint32_t frames_sent;
+	uint32_t frames_skipped;	/* New frames dropped, no ring buffer free */
+	uint32_t vblanks;
+	struct uvc_stat csc;		/* Per slice, includes MJPEG encoding */
+	struct uvc_stat xfer;		/* Per payload */
+	uint32_t xfer_errors;
+	uint32_t reallocations;		/* Of the frame ring */
+	uint32_t stalls;		/* Transfers stopped by the watchdog */
+	uint32_t frames_replaced;	/* Queued frames dropped for a newer one */
+	uint32_t frames_dropped;	/* Failed to capture, convert or send */
+	uint32_t isoc_clamps;		/* Commits moved to a setting the isochronous tiers carry */
+} uvc_stats;
+
+/*
+ * UVC_XU_STATS_CONTROL GET_CUR payload, little endian.
+ */
+struct uvc_xu_stats {
+	uint32_t frames_sent;
+	uint32_t frames_skipped;
+	uint32_t vblanks;
+	uint32_t csc_min_us;
+	uint32_t csc_avg_us;
+	uint32_t csc_max_us;
+	uint32_t xfer_min_us;
+	uint32_t xfer_avg_us;
+	uint32_t xfer_max_us;
+	uint32_t xfer_errors;
+	uint32_t reallocations;
+	uint32_t stalls;
+	uint32_t frames_replaced;
+	uint32_t frames_dropped;
+	uint32_t isoc_clamps;
+} __attribute__((packed));
+
+/*
+ * Processing Unit controls, all of them 2 bytes long.
+ */
+struct uvc_pu_control {
+	uint8_t selector;
+	int16_t min;
+	int16_t max;
+	int16_t def;
+	int16_t res;
+	int16_t cur;
+};
+
+static struct uvc_pu_control uvc_pu_controls[] = {
+	{UVC_PU_BRIGHTNESS_CONTROL,    -16,    64,   0,   1,   0},
+	{UVC_PU_CONTRAST_CONTROL,        0,   200, 100,   1, 100},
+	{UVC_PU_HUE_CONTROL,        -18000, 18000,   0, 100,   0},	/* 1/100 degree */
+	{UVC_PU_SATURATION_CONTROL,      0,   200, 100,   1, 100},
+};
+
+static const struct csc_matrix *const colorimetry_matrices[] = {
+	[COLORIMETRY_BT601_FULL]	= &csc_matrix_bt601_full,
+	[COLORIMETRY_BT601_LIMITED]	= &csc_matrix_bt601_limited,
+	[COLORIMETRY_BT709_FULL]	= &csc_matrix_bt709_full,
+	[COLORIMETRY_BT709_LIMITED]	= &csc_matrix_bt709_limited,
+};
+
+/* Selected by the host, applied right away: the ring is reallocated */
+static uint8_t uvc_frame_placement = UVC_FRAME_PLACEMENT;
+
+/*
+ * Conversion matrix shared by the IFTU and the software fallback. It's
+ * rebuilt from the committed colorimetry and the Processing Unit controls
+ * before converting the next frame after any of them changes.
+ */
+static struct {
+	unsigned int colorimetry;
+	struct csc_matrix matrix;
+	SceIftuCscParams iftu;
+	int dirty;
+} uvc_csc = {
+	.colorimetry	= UVC_COLORIMETRY,
+	.dirty		= 1,
+};
+
+static void uvc_stat_add(struct uvc_stat *stat, uint64_t us)
+{
+	if (stat->count == 0 || us < stat->min)
+		stat->min = us;
+	if (us > stat->max)
+		stat->max = us;
+	stat->total += us;
+	stat->count++;
+}
+
+static void uvc_stats_get(struct uvc_xu_stats *out)
+{
+	out->frames_sent = uvc_stats.frames_sent;
+	out->frames_skipped = uvc_stats.frames_skipped;
+	out->vblanks = uvc_stats.vblanks;
+	out->csc_min_us = uvc_stats.csc.min;
+	out->csc_avg_us = uvc_stats.csc.count ?
+		uvc_stats.csc.total / uvc_stats.csc.count : 0;
+	out->csc_max_us = uvc_stats.csc.max;
+	out->xfer_min_us = uvc_stats.xfer.min;
+	out->xfer_avg_us = uvc_stats.xfer.count ?
+		uvc_stats.xfer.total / uvc_stats.xfer.count : 0;
+	out->xfer_max_us = uvc_stats.xfer.max;
+	out->xfer_errors = uvc_stats.xfer_errors;
+	out->reallocations = uvc_stats.reallocations;
+	out->stalls = uvc_stats.stalls;
+	out->frames_replaced = uvc_stats.frames_replaced;
+	out->frames_dropped = uvc_stats.frames_dropped;
+	out->isoc_clamps = uvc_stats.isoc_clamps;
+}
+
+/*
+ * Ring of converted frames: while the USB controller DMAs frame N out of one
+ * buffer, the IFTU converts frame N + 1 into the next one.
+ */
+#define UVC_FRAME_RING_SIZE	2
+
+static struct {
+	SceUID uid;
+	unsigned char *addr;
+	SceDisplayFrameBufInfo fb_info;	/* Captured source framebuffer */
+	struct uvc_frame_roi roi;	/* Region of fb_info to convert */
+	uint64_t capture_time;
+	unsigned int fid;		/* Assigned when its first payload is submitted */
+	int dropped;
+	unsigned int converted;		/* Slices converted */
+	unsigned int sent;		/* Payloads submitted */
+	unsigned int sent_offset;	/* Bytes of payload sent already submitted */
+	unsigned int done;		/* Payloads completed */
+	unsigned int num_payloads;
+	unsigned int payload_size;	/* Compressed formats, including the header */
+} uvc_frame_ring[UVC_FRAME_RING_SIZE] = {
+	[0 ... UVC_FRAME_RING_SIZE - 1] = {.uid = -1}
+};
+static unsigned int uvc_frame_ring_index;
+
+/*
+ * The ring buffers are allocated for the largest mode committed so far and
+ * reused across resolution changes. They are only released after the stream
+ * has been idle for UVC_FRAME_POOL_RELEASE_DELAY microseconds.
+ */
+#ifndef UVC_FRAME_POOL_RELEASE_DELAY
+#define UVC_FRAME_POOL_RELEASE_DELAY	(30 * 1000 * 1000)
+#endif
+
+static unsigned int uvc_frame_pool_size;
+static uint64_t uvc_frame_pool_last_use;
+static unsigned int uvc_frame_pool_placement;	/* uvc_frame_placement it was allocated for */
+static unsigned int uvc_frame_pool_memory;	/* Where it is: FRAME_PLACEMENT_PHYCONT or _CDRAM */
+
+/*
+ * FRAME_PLACEMENT_AUTO only takes CDRAM if this much is left for the game.
+ */
+#define UVC_FRAME_CDRAM_RESERVE	(16 * 1024 * 1024)
+
+/*
+ * Benchmark mode (UVC_BENCH): the ring alternates between CDRAM and main
+ * RAM every UVC_BENCH_PAYLOADS payloads sent, and the average conversion
+ * and transfer times of the mode are logged for each. Resolutions are
+ * covered by selecting them on the host.
+ */
+#ifndef UVC_BENCH
+#define UVC_BENCH		0
+#endif
+#define UVC_BENCH_PAYLOADS	600
+
+/*
+ * Conversion plan of the committed mode, built by uvc_stream_plan_build()
+ * once the ring is laid out: the IFTU destination of every band of every
+ * ring buffer, with its physical addresses resolved. The source half only
+ * depends on the framebuffer the app renders to, and is rebuilt when its
+ * pixel format, pitch or the ROI change. Converting a band then only takes
+ * patching in the source address.
+ */
+struct uvc_plan_band {
+	unsigned char *dst0, *dst1;	/* For the CPU fallback */
+	SceIftuFrameBuf dst;
+};
+
+static struct {
+	unsigned int format_index;	/* 0 if there's no plan */
+	unsigned int frame_index;
+	unsigned int dst_pixelfmt;
+	unsigned int num_bands;
+	unsigned int band_y[UVC_MAX_FRAME_SLICES];
+	unsigned int band_height[UVC_MAX_FRAME_SLICES];
+	struct uvc_plan_band bands[UVC_FRAME_RING_SIZE][UVC_MAX_FRAME_SLICES];
+	SceIftuConvParams params;
+	struct {
+		unsigned int pixelformat;
+		unsigned int pitch;	/* 0 if not built yet */
+		struct uvc_frame_roi roi;
+		uintptr_t offset[UVC_MAX_FRAME_SLICES];	/* From the framebuffer paddr */
+		SceIftuPlaneState_updated src[UVC_MAX_FRAME_SLICES];
+	} source;
+} uvc_stream_plan;
+
+/*
+ * Payloads queued on the bulk endpoint. Up to UVC_XFER_DEPTH of them are
+ * owned by the controller at once, so that it always has the next one
+ * when a transfer ends. They complete in submission order: entries are
+ * used as a FIFO, from uvc_xfer_retired (oldest in flight) to
+ * uvc_xfer_submitted.
+ */
+#ifndef UVC_XFER_DEPTH
+#define UVC_XFER_DEPTH		3
+#endif
+
+#if UVC_XFER_DEPTH < 2 || UVC_XFER_DEPTH > 4
+#error "UVC_XFER_DEPTH must be between 2 and 4"
+#endif
+
+static struct uvc_xfer {
+	SceUdcdDeviceRequest req;
+	int index;			/* Ring index of the frame */
+	unsigned int payload;
+	unsigned int size;
+	int last;			/* Completes the payload (isochronous chunks) */
+	uint64_t submit_time;
+	volatile int done;		/* Set by the request's onComplete, < 0 on error */
+} uvc_xfers[UVC_XFER_DEPTH];
+
+static unsigned int uvc_xfer_submitted;
+static unsigned int uvc_xfer_retired;
+static uint64_t uvc_xfer_last_done;
+
+/*
+ * Isochronous streaming (UVC_ISOC), see isoc.h: each xfer is packetized
+ * into its slot of the staging buffer.
+ */
+static struct {
+	const SceUdcdInterfaceSettings *settings;	/* Streaming interface, current speed */
+	unsigned int packet_size;	/* 0 until an operational setting is selected */
+	SceUID staging_uid;
+	unsigned char *staging;
+} uvc_isoc = {
+	.staging_uid	= -1,
+};
+
+/*
+ * Transfer watchdog: a host that stops reading the bulk endpoint without
+ * telling us (crashed player, suspended laptop) would keep the payloads in
+ * flight forever. A payload that isn't done UVC_WATCHDOG_FRAMES frame
+ * intervals after it could start stops the stream instead. It is restarted
+ * after UVC_WATCHDOG_RETRY_INTERVAL microseconds, then after twice as long
+ * every time, and the watchdog gives up after UVC_WATCHDOG_MAX_RESTARTS
+ * until the host commits again or selects an alternate setting.
+ */
+#define UVC_WATCHDOG_FRAMES		4
+#define UVC_WATCHDOG_RETRY_INTERVAL	(1000 * 1000)
+#define UVC_WATCHDOG_MAX_RESTARTS	5
+
+/*
+ * A frame that fails to capture, convert or send is dropped and the stream
+ * goes on with the next one. After UVC_STREAM_MAX_ERRORS failures in a row
+ * the stream is stopped and restarted like a stalled one.
+ */
+#define UVC_STREAM_MAX_ERRORS		8
+
+static inline unsigned int uvc_xfer_in_flight(void)
+{
+	return uvc_xfer_submitted - uvc_xfer_retired;
+}
 
 static int uvc_frame_init(unsigned int size);
 static int uvc_frame_term();
@@ -122,17 +578,83 @@ static int uvc_frame_term();
 static int prev_brightness;
 #endif
 
+/*
+ * Only called while handling a SETUP (or on detach): whatever is still
+ * queued on EP0 belongs to a control transfer that has ended. Cancelling
+ * hands the requests back before their slots are freed, so that a late
+ * onComplete can't free a slot that has been reused.
+ */
+static void usb_ep0_req_reclaim(void)
+{
+	int i;
+
+	ksceUdcdReqCancelAll(&endpoints[0]);
+
+	for (i = 0; i < USB_EP0_REQ_POOL_SIZE; i++)
+		usb_ep0_reqs[i].busy = 0;
+}
+
+static struct usb_ep0_req *usb_ep0_req_alloc(unsigned int size)
+{
+	int i;
+
+	if (size > sizeof(usb_ep0_reqs[0].buffer))
+		return NULL;
+
+	for (i = 0; i < USB_EP0_REQ_POOL_SIZE; i++) {
+		if (!usb_ep0_reqs[i].busy) {
+			usb_ep0_reqs[i].busy = 1;
+			return &usb_ep0_reqs[i];
+		}
+	}
+
+	LOG("No free EP0 request, reclaiming them\n");
+
+	usb_ep0_req_reclaim();
+
+	usb_ep0_reqs[0].busy = 1;
+
+	return &usb_ep0_reqs[0];
+}
+
+static struct usb_ep0_req *usb_ep0_req_get(SceUdcdDeviceRequest *req)
+{
+	int i;
+
+	for (i = 0; i < USB_EP0_REQ_POOL_SIZE; i++) {
+		if (&usb_ep0_reqs[i].req == req)
+			return &usb_ep0_reqs[i];
+	}
+
+	return NULL;
+}
+
+static void usb_ep0_req_send_on_complete(SceUdcdDeviceRequest *req)
+{
+	struct usb_ep0_req *ep0 = usb_ep0_req_get(req);
+
+	if (ep0)
+		ep0->busy = 0;
+}
+
 static int usb_ep0_req_send(const void *data, unsigned int size)
 {
-	static SceUdcdDeviceRequest req;
+	struct usb_ep0_req *ep0 = usb_ep0_req_alloc(size);
+	int ret;
 
-	req = (SceUdcdDeviceRequest){
+	if (!ep0)
+		return -1;
+
+	memcpy(ep0->buffer, data, size);
+	ksceKernelDcacheCleanRange(ep0->buffer, size);
+
+	ep0->req = (SceUdcdDeviceRequest){
 		.endpoint = &endpoints[0],
-		.data = (void *)data,
+		.data = (void *)ep0->buffer,
 		.attributes = 0,
 		.size = size,
 		.isControlRequest = 0,
-		.onComplete = NULL,
+		.onComplete = usb_ep0_req_send_on_complete,
 		.transmitted = 0,
 		.returnCode = 0,
 		.next = NULL,
@@ -140,22 +662,30 @@ static int usb_ep0_req_send(const void *data, unsigned int size)
 		.physicalAddress = NULL
 	};
 
-	return ksceUdcdReqSend(&req);
+	ret = ksceUdcdReqSend(&ep0->req);
+	if (ret < 0)
+		ep0->busy = 0;
+
+	return ret;
 }
 
 static void usb_ep0_req_recv_on_complete(SceUdcdDeviceRequest *req);
 
 static int usb_ep0_enqueue_recv_for_req(const SceUdcdEP0DeviceRequest *ep0_req)
 {
-	static SceUdcdDeviceRequest req;
+	struct usb_ep0_req *ep0 = usb_ep0_req_alloc(ep0_req->wLength);
+	int ret;
+
+	if (!ep0)
+		return -1;
 
-	pending_recv.ep0_req = *ep0_req;
+	ep0->ep0_req = *ep0_req;
 
-	req = (SceUdcdDeviceRequest){
+	ep0->req = (SceUdcdDeviceRequest){
 		.endpoint = &endpoints[0],
-		.data = (void *)pending_recv.buffer,
+		.data = (void *)ep0->buffer,
 		.attributes = 0,
-		.size = pending_recv.ep0_req.wLength,
+		.size = ep0_req->wLength,
 		.isControlRequest = 0,
 		.onComplete = &usb_ep0_req_recv_on_complete,
 		.transmitted = 0,
@@ -165,46 +695,56 @@ static int usb_ep0_enqueue_recv_for_req(const SceUdcdEP0DeviceRequest *ep0_req)
 		.physicalAddress = NULL
 	};
 
-	ksceKernelDcacheInvalidateRange(pending_recv.buffer,
-		pending_recv.ep0_req.wLength);
+	ksceKernelDcacheInvalidateRange(ep0->buffer, ep0_req->wLength);
+
+	ret = ksceUdcdReqRecv(&ep0->req);
+	if (ret < 0)
+		ep0->busy = 0;
 
-	return ksceUdcdReqRecv(&req);
+	return ret;
 }
 
-static int uvc_frame_req_init(void)
+static struct uvc_xfer *uvc_xfer_get(SceUdcdDeviceRequest *req)
 {
-	uvc_frame_req_evflag = ksceKernelCreateEventFlag("uvc_frame_req_evflag", 0, 0, NULL);
-	if (uvc_frame_req_evflag < 0) {
-		return uvc_frame_req_evflag;
+	int i;
+
+	for (i = 0; i < UVC_XFER_DEPTH; i++) {
+		if (&uvc_xfers[i].req == req)
+			return &uvc_xfers[i];
 	}
 
-	return 0;
+	return NULL;
 }
 
-static int uvc_frame_req_fini(void)
+static void uvc_frame_req_submit_phycont_on_complete(SceUdcdDeviceRequest *req)
 {
-	int ret;
+	struct uvc_xfer *xfer = uvc_xfer_get(req);
 
-	ret = ksceKernelDeleteEventFlag(uvc_frame_req_evflag);
-	if (ret < 0)
-		return ret;
+	if (req->returnCode != 0)
+		uvc_stats.xfer_errors++;
 
-	return 0;
-}
+	if (xfer)
+		xfer->done = (req->returnCode == 0) ? 1 : -1;
 
-static void uvc_frame_req_submit_phycont_on_complete(SceUdcdDeviceRequest *req)
-{
-	ksceKernelSetEventFlag(uvc_frame_req_evflag, 1);
+	ksceKernelSetEventFlag(uvc_event_flag_id, UVC_EVENT_XFER_DONE);
 }
 
-static int uvc_frame_req_submit_phycont(const void *data, unsigned int size)
+/*
+ * Sends a payload, header included, in a single request: the host could
+ * otherwise get a header followed by only part of the data if queuing the
+ * rest failed.
+ *
+ * Doesn't wait for the transfer to finish: its completion is reported to
+ * uvc_thread through UVC_EVENT_XFER_DONE.
+ */
+static int uvc_frame_req_submit_payload(struct uvc_xfer *xfer,
+					const unsigned char *payload, unsigned int size)
 {
-	static SceUdcdDeviceRequest req;
-	int ret;
+	xfer->done = 0;
 
-	req = (SceUdcdDeviceRequest){
+	xfer->req = (SceUdcdDeviceRequest){
 		.endpoint = &endpoints[1],
-		.data = (void *)data,
+		.data = (void *)payload,
 		.attributes = SCE_UDCD_DEVICE_REQUEST_ATTR_PHYCONT,
 		.size = size,
 		.isControlRequest = 0,
@@ -216,104 +756,364 @@ static int uvc_frame_req_submit_phycont(const void *data, unsigned int size)
 		.physicalAddress = NULL
 	};
 
-	ret = ksceUdcdReqSend(&req);
-	if (ret < 0)
-		return ret;
+	return ksceUdcdReqSend(&xfer->req);
+}
 
-	ret = ksceKernelWaitEventFlagCB(uvc_frame_req_evflag, 1, SCE_EVENT_WAITOR |
-					SCE_EVENT_WAITCLEAR_PAT, NULL, NULL);
+static const SceUdcdInterfaceSettings *uvc_isoc_stream_settings(void)
+{
+	return uvc_isoc.settings ? uvc_isoc.settings : &settings_hi[STREAM_INTERFACE];
+}
 
-	return ret;
+/*
+ * Bytes per (micro)frame of the endpoint of an alternate setting.
+ */
+static unsigned int uvc_isoc_alt_packet_size(unsigned int alt)
+{
+	const SceUdcdInterfaceSettings *settings = uvc_isoc_stream_settings();
+	unsigned int max_packet_size;
+
+	if (alt == 0 || alt >= settings->numDescriptors)
+		return 0;
+
+	max_packet_size = settings->descriptors[alt].endpoints[0].wMaxPacketSize;
+
+	return (max_packet_size & 0x7FF) * (((max_packet_size >> 11) & 3) + 1);
+}
+
+static unsigned int uvc_isoc_packets_per_second(void)
+{
+	return (uvc_isoc_stream_settings() == &settings_full[STREAM_INTERFACE]) ?
+		1000 : 8000;
+}
+
+static void uvc_isoc_select_alt(unsigned int alt)
+{
+	uvc_isoc.packet_size = uvc_isoc_alt_packet_size(alt);
+
+	LOG("Isochronous alternate setting %d: %d bytes\n", alt, uvc_isoc.packet_size);
+
+	if (uvc_isoc.packet_size > 0)
+		ksceKernelSetEventFlag(uvc_event_flag_id, UVC_EVENT_FRAME);
 }
 
-static void uvc_handle_video_streaming_req_recv(const SceUdcdEP0DeviceRequest *req)
+static void uvc_handle_video_streaming_req_recv(const SceUdcdEP0DeviceRequest *req,
+						const unsigned char *data)
 {
-	struct uvc_streaming_control *streaming_control =
-		(struct uvc_streaming_control *)pending_recv.buffer;
+	struct uvc_streaming_control streaming_control;
+
+	/* UVC 1.0 hosts send the shorter 26 bytes version */
+	memset(&streaming_control, 0, sizeof(streaming_control));
+	memcpy(&streaming_control, data,
+	       req->wLength < sizeof(streaming_control) ?
+	       req->wLength : sizeof(streaming_control));
 
 	switch (req->wValue >> 8) {
 	case UVC_VS_PROBE_CONTROL:
 		switch (req->bRequest) {
 		case UVC_SET_CUR:
-			uvc_probe_control_setting.bFormatIndex = streaming_control->bFormatIndex;
-			uvc_probe_control_setting.bFrameIndex = streaming_control->bFrameIndex;
-			uvc_probe_control_setting.dwFrameInterval = streaming_control->dwFrameInterval;
-			LOG("Probe SET_CUR, bFormatIndex: %d, bmFramingInfo: %x\n",
+			uvc_streaming_negotiate(&uvc_probe_control_setting, &streaming_control);
+			LOG("Probe SET_CUR, bFormatIndex: %d, bFrameIndex: %d, dwFrameInterval: %d\n",
 			    uvc_probe_control_setting.bFormatIndex,
-			    uvc_probe_control_setting.bmFramingInfo);
+			    uvc_probe_control_setting.bFrameIndex,
+			    uvc_probe_control_setting.dwFrameInterval);
 			break;
 		}
 		break;
 	case UVC_VS_COMMIT_CONTROL:
 		switch (req->bRequest) {
 		case UVC_SET_CUR:
-			uvc_probe_control_setting.bFormatIndex = streaming_control->bFormatIndex;
-			uvc_probe_control_setting.bFrameIndex = streaming_control->bFrameIndex;
-			uvc_probe_control_setting.dwFrameInterval = streaming_control->dwFrameInterval;
-			LOG("Commit SET_CUR, bFormatIndex: %d, bmFramingInfo: %x\n",
-			    uvc_probe_control_setting.bFormatIndex,
-			    uvc_probe_control_setting.bmFramingInfo);
-
+			if (uvc_streaming_negotiate(&uvc_commit_control_setting,
+						    &streaming_control))
+				uvc_stats.isoc_clamps++;
+			LOG("Commit SET_CUR, bFormatIndex: %d, bFrameIndex: %d, dwFrameInterval: %d\n",
+			    uvc_commit_control_setting.bFormatIndex,
+			    uvc_commit_control_setting.bFrameIndex,
+			    uvc_commit_control_setting.dwFrameInterval);
+
+			uvc_csc.colorimetry =
+				uvc_commit_control_setting.bFormatIndex == FORMAT_INDEX_MJPEG ?
+				COLORIMETRY_BT601_FULL : UVC_COLORIMETRY;
+			uvc_csc.dirty = 1;
+
+			uvc_stream.restarts = 0;
+			uvc_stream.errors = 0;
 			stream = 1;
-			ksceKernelSetEventFlag(uvc_event_flag_id, 1);
+			ksceKernelSetEventFlag(uvc_event_flag_id, UVC_EVENT_FRAME);
 			break;
 		}
 		break;
 	}
 }
 
-void usb_ep0_req_recv_on_complete(SceUdcdDeviceRequest *req)
+static struct uvc_pu_control *uvc_pu_control_get(unsigned int selector)
 {
-	switch (pending_recv.ep0_req.wIndex & 0xFF) {
-	case STREAM_INTERFACE:
-		uvc_handle_video_streaming_req_recv(&pending_recv.ep0_req);
-		break;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(uvc_pu_controls) / sizeof(uvc_pu_controls[0]); i++) {
+		if (uvc_pu_controls[i].selector == selector)
+			return &uvc_pu_controls[i];
 	}
-}
 
-static void uvc_handle_interface_ctrl_req(const SceUdcdEP0DeviceRequest *req)
-{
-	LOG("  uvc_handle_interface_ctrl_req\n");
+	return NULL;
 }
 
-static void uvc_handle_input_terminal_req(const SceUdcdEP0DeviceRequest *req)
+static void uvc_handle_processing_unit_req_recv(const SceUdcdEP0DeviceRequest *req,
+						const unsigned char *data)
 {
-	LOG("  uvc_handle_input_terminal_req %x, %x\n", req->wValue, req->bRequest);
+	struct uvc_pu_control *control = uvc_pu_control_get(req->wValue >> 8);
+	int16_t value;
+
+	if (!control || req->bRequest != UVC_SET_CUR || req->wLength < sizeof(value))
+		return;
+
+	memcpy(&value, data, sizeof(value));
+	if (value < control->min)
+		value = control->min;
+	else if (value > control->max)
+		value = control->max;
+
+	LOG("PU SET_CUR %d: %d\n", control->selector, value);
+
+	control->cur = value;
+	uvc_csc.dirty = 1;
 }
 
-static void uvc_handle_output_terminal_req(const SceUdcdEP0DeviceRequest *req)
+static void uvc_handle_extension_unit_req_recv(const SceUdcdEP0DeviceRequest *req,
+					       const unsigned char *data)
 {
-	LOG("  uvc_handle_output_terminal_req\n");
+	uint8_t value = data[0];
+
+	if (req->bRequest != UVC_SET_CUR || req->wLength < sizeof(value))
+		return;
+
+	switch (req->wValue >> 8) {
+	case UVC_XU_COLORIMETRY_CONTROL:
+		/* It's the one of the color matching descriptors */
+		if (value != UVC_COLORIMETRY)
+			LOG("XU colorimetry SET_CUR: %d rejected\n", value);
+		break;
+	case UVC_XU_PLACEMENT_CONTROL:
+		if (value > FRAME_PLACEMENT_AUTO)
+			return;
+
+		LOG("XU placement SET_CUR: %d\n", value);
+
+		uvc_frame_placement = value;
+		break;
+	}
 }
 
-static void uvc_handle_video_streaming_req(const SceUdcdEP0DeviceRequest *req)
+void usb_ep0_req_recv_on_complete(SceUdcdDeviceRequest *req)
 {
-	LOG("  uvc_handle_video_streaming_req %x, %x\n", req->wValue, req->bRequest);
+	struct usb_ep0_req *ep0 = usb_ep0_req_get(req);
 
-	switch (req->wValue >> 8) {
-	case UVC_VS_PROBE_CONTROL:
-		switch (req->bRequest) {
-		case UVC_GET_INFO:
+	if (!ep0)
+		return;
+
+	switch (ep0->ep0_req.wIndex & 0xFF) {
+	case CONTROL_INTERFACE:
+		switch (ep0->ep0_req.wIndex >> 8) {
+		case PROCESSING_UNIT_ID:
+			uvc_handle_processing_unit_req_recv(&ep0->ep0_req, ep0->buffer);
 			break;
-		case UVC_GET_LEN:
+		case EXTENSION_UNIT_ID:
+			uvc_handle_extension_unit_req_recv(&ep0->ep0_req, ep0->buffer);
 			break;
-		case UVC_GET_MIN:
-		case UVC_GET_MAX:
-		case UVC_GET_DEF:
-			LOG("Probe GET_DEF, bFormatIndex: %d, bmFramingInfo: %x\n",
-			    uvc_probe_control_setting_default.bFormatIndex,
-			    uvc_probe_control_setting_default.bmFramingInfo);
-			usb_ep0_req_send(&uvc_probe_control_setting_default,
-					 sizeof(uvc_probe_control_setting_default));
+		}
+		break;
+	case STREAM_INTERFACE:
+		uvc_handle_video_streaming_req_recv(&ep0->ep0_req, ep0->buffer);
+		break;
+	}
+
+	ep0->busy = 0;
+}
+
+static void uvc_handle_xu_stats_req(const SceUdcdEP0DeviceRequest *req)
+{
+	struct uvc_xu_stats stats;
+	uint16_t len;
+	uint8_t info;
+
+	switch (req->bRequest) {
+	case UVC_GET_INFO:
+		info = UVC_CONTROL_CAP_GET;
+		usb_ep0_req_send(&info, sizeof(info));
+		break;
+	case UVC_GET_LEN:
+		len = sizeof(stats);
+		usb_ep0_req_send(&len, sizeof(len));
+		break;
+	case UVC_GET_CUR:
+		uvc_stats_get(&stats);
+		usb_ep0_req_send(&stats, req->wLength < sizeof(stats) ?
+					 req->wLength : sizeof(stats));
+		break;
+	}
+}
+
+/*
+ * Read/write 1 byte controls: the value is set in
+ * uvc_handle_extension_unit_req_recv().
+ */
+static void uvc_handle_xu_u8_req(const SceUdcdEP0DeviceRequest *req,
+				 uint8_t cur, uint8_t min, uint8_t max, uint8_t def)
+{
+	uint16_t len;
+	uint8_t value;
+
+	switch (req->bRequest) {
+	case UVC_SET_CUR:
+		usb_ep0_enqueue_recv_for_req(req);
+		return;
+	case UVC_GET_LEN:
+		len = sizeof(value);
+		usb_ep0_req_send(&len, sizeof(len));
+		return;
+	case UVC_GET_INFO:
+		value = UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET;
+		break;
+	case UVC_GET_CUR:
+		value = cur;
+		break;
+	case UVC_GET_MIN:
+		value = min;
+		break;
+	case UVC_GET_MAX:
+		value = max;
+		break;
+	case UVC_GET_DEF:
+		value = def;
+		break;
+	case UVC_GET_RES:
+		value = 1;
+		break;
+	default:
+		return;
+	}
+
+	usb_ep0_req_send(&value, sizeof(value));
+}
+
+static void uvc_handle_extension_unit_req(const SceUdcdEP0DeviceRequest *req)
+{
+	switch (req->wValue >> 8) {
+	case UVC_XU_STATS_CONTROL:
+		uvc_handle_xu_stats_req(req);
+		break;
+	case UVC_XU_COLORIMETRY_CONTROL:
+		uvc_handle_xu_u8_req(req, UVC_COLORIMETRY, UVC_COLORIMETRY,
+				     UVC_COLORIMETRY, UVC_COLORIMETRY);
+		break;
+	case UVC_XU_PLACEMENT_CONTROL:
+		uvc_handle_xu_u8_req(req, uvc_frame_placement, FRAME_PLACEMENT_PHYCONT,
+				     FRAME_PLACEMENT_AUTO, UVC_FRAME_PLACEMENT);
+		break;
+	}
+}
+
+static void uvc_handle_interface_ctrl_req(const SceUdcdEP0DeviceRequest *req)
+{
+	LOG("  uvc_handle_interface_ctrl_req %x, %x\n", req->wValue, req->bRequest);
+
+	switch (req->wIndex >> 8) {
+	case EXTENSION_UNIT_ID:
+		uvc_handle_extension_unit_req(req);
+		break;
+	}
+}
+
+static void uvc_handle_processing_unit_req(const SceUdcdEP0DeviceRequest *req)
+{
+	const struct uvc_pu_control *control = uvc_pu_control_get(req->wValue >> 8);
+	int16_t value;
+	uint8_t info;
+
+	LOG("  uvc_handle_processing_unit_req %x, %x\n", req->wValue, req->bRequest);
+
+	if (!control)
+		return;
+
+	switch (req->bRequest) {
+	case UVC_SET_CUR:
+		usb_ep0_enqueue_recv_for_req(req);
+		return;
+	case UVC_GET_INFO:
+		info = UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET;
+		usb_ep0_req_send(&info, sizeof(info));
+		return;
+	case UVC_GET_CUR:
+		value = control->cur;
+		break;
+	case UVC_GET_MIN:
+		value = control->min;
+		break;
+	case UVC_GET_MAX:
+		value = control->max;
+		break;
+	case UVC_GET_DEF:
+		value = control->def;
+		break;
+	case UVC_GET_RES:
+		value = control->res;
+		break;
+	default:
+		return;
+	}
+
+	usb_ep0_req_send(&value, sizeof(value));
+}
+
+static void uvc_handle_input_terminal_req(const SceUdcdEP0DeviceRequest *req)
+{
+	LOG("  uvc_handle_input_terminal_req %x, %x\n", req->wValue, req->bRequest);
+}
+
+static void uvc_handle_output_terminal_req(const SceUdcdEP0DeviceRequest *req)
+{
+	LOG("  uvc_handle_output_terminal_req\n");
+}
+
+static void uvc_streaming_control_send(const SceUdcdEP0DeviceRequest *req,
+				       const struct uvc_streaming_control *ctrl)
+{
+	usb_ep0_req_send(ctrl, req->wLength < sizeof(*ctrl) ?
+			       req->wLength : sizeof(*ctrl));
+}
+
+static void uvc_handle_video_streaming_req(const SceUdcdEP0DeviceRequest *req)
+{
+	struct uvc_streaming_control probe_reply;
+	struct uvc_streaming_control probe_req;
+
+	LOG("  uvc_handle_video_streaming_req %x, %x\n", req->wValue, req->bRequest);
+
+	switch (req->wValue >> 8) {
+	case UVC_VS_PROBE_CONTROL:
+		switch (req->bRequest) {
+		case UVC_GET_INFO:
+			break;
+		case UVC_GET_LEN:
+			break;
+		case UVC_GET_MIN:
+		case UVC_GET_MAX:
+			/* Shortest or longest interval of the probed frame */
+			probe_req = uvc_probe_control_setting;
+			probe_req.dwFrameInterval = (req->bRequest == UVC_GET_MIN) ? 1 : ~0u;
+			uvc_streaming_negotiate(&probe_reply, &probe_req);
+			uvc_streaming_control_send(req, &probe_reply);
+			break;
+		case UVC_GET_DEF:
+			uvc_streaming_negotiate(&probe_reply, &uvc_probe_control_setting_default);
+			LOG("Probe GET_DEF, bFormatIndex: %d, bFrameIndex: %d\n",
+			    probe_reply.bFormatIndex, probe_reply.bFrameIndex);
+			uvc_streaming_control_send(req, &probe_reply);
 			break;
 		case UVC_GET_CUR:
-			LOG("Probe GET_CUR, bFormatIndex: %d, bmFramingInfo: %x\n",
+			LOG("Probe GET_CUR, bFormatIndex: %d, bFrameIndex: %d\n",
 			    uvc_probe_control_setting.bFormatIndex,
-			    uvc_probe_control_setting.bmFramingInfo);
-			ksceKernelDcacheCleanRange(&uvc_probe_control_setting,
-					 sizeof(uvc_probe_control_setting));
-			usb_ep0_req_send(&uvc_probe_control_setting,
-					 sizeof(uvc_probe_control_setting));
+			    uvc_probe_control_setting.bFrameIndex);
+			uvc_streaming_control_send(req, &uvc_probe_control_setting);
 			break;
 		case UVC_SET_CUR:
 			usb_ep0_enqueue_recv_for_req(req);
@@ -327,10 +1127,7 @@ static void uvc_handle_video_streaming_req(const SceUdcdEP0DeviceRequest *req)
 		case UVC_GET_LEN:
 			break;
 		case UVC_GET_CUR:
-			ksceKernelDcacheCleanRange(&uvc_probe_control_setting,
-					 sizeof(uvc_probe_control_setting));
-			usb_ep0_req_send(&uvc_probe_control_setting,
-					 sizeof(uvc_probe_control_setting));
+			uvc_streaming_control_send(req, &uvc_commit_control_setting);
 			break;
 		case UVC_SET_CUR:
 			usb_ep0_enqueue_recv_for_req(req);
@@ -344,11 +1141,20 @@ static void uvc_handle_video_abort(void)
 {
 	LOG("uvc_handle_video_abort\n");
 
+	/* Stopped by the host: don't let the watchdog restart it */
+	uvc_stream.stalled = 0;
+
 	if (stream) {
 		stream = 0;
 
 		ksceUdcdClearFIFO(&endpoints[1]);
 		ksceUdcdReqCancelAll(&endpoints[1]);
+
+		/*
+		 * Let uvc_thread drain in case the cancelled request never
+		 * reaches its onComplete callback.
+		 */
+		ksceKernelSetEventFlag(uvc_event_flag_id, UVC_EVENT_XFER_DONE);
 	}
 }
 
@@ -360,6 +1166,12 @@ static void uvc_handle_set_interface(const SceUdcdEP0DeviceRequest *req)
 	 * stopping to stream. This application needs to stop streaming. */
 	if ((req->wIndex == STREAM_INTERFACE) && (req->wValue == 0))
 		uvc_handle_video_abort();
+
+	/* The host is back: the watchdog can restart the stream again */
+	if (req->wIndex == STREAM_INTERFACE) {
+		uvc_stream.restarts = 0;
+		uvc_stream.errors = 0;
+	}
 }
 
 static void uvc_handle_clear_feature(const SceUdcdEP0DeviceRequest *req)
@@ -400,6 +1212,7 @@ static int uvc_udcd_process_request(int recipient, int arg, SceUdcdEP0DeviceRequ
 		case CONTROL_INTERFACE:
 			switch (req->wIndex >> 8) {
 			case INTERFACE_CTRL_ID:
+			case EXTENSION_UNIT_ID:
 				uvc_handle_interface_ctrl_req(req);
 				break;
 			case INPUT_TERMINAL_ID:
@@ -408,6 +1221,9 @@ static int uvc_udcd_process_request(int recipient, int arg, SceUdcdEP0DeviceRequ
 			case OUTPUT_TERMINAL_ID:
 				uvc_handle_output_terminal_req(req);
 				break;
+			case PROCESSING_UNIT_ID:
+				uvc_handle_processing_unit_req(req);
+				break;
 			}
 			break;
 		case STREAM_INTERFACE:
@@ -452,6 +1268,9 @@ static int uvc_udcd_change_setting(int interfaceNumber, int alternateSetting, in
 {
 	LOG("uvc_udcd_change %d %d\n", interfaceNumber, alternateSetting);
 
+	if (UVC_ISOC && interfaceNumber == STREAM_INTERFACE)
+		uvc_isoc_select_alt(alternateSetting);
+
 	return 0;
 }
 
@@ -477,6 +1296,7 @@ static void uvc_udcd_detach(void *user_data)
 	LOG("uvc_udcd_detach\n");
 
 	uvc_handle_video_abort();
+	usb_ep0_req_reclaim();
 
 #if defined(DISPLAY_OFF_OLED)
 	ksceOledDisplayOn();
@@ -490,6 +1310,10 @@ static void uvc_udcd_detach(void *user_data)
 static void uvc_udcd_configure(int usb_version, int desc_count, SceUdcdInterfaceSettings *settings, void *user_data)
 {
 	LOG("uvc_udcd_configure %d %d %p %d\n", usb_version, desc_count, settings, settings->numDescriptors);
+
+	/* Tells which speed the isochronous alternate settings are for */
+	if (settings == settings_hi || settings == settings_full)
+		uvc_isoc.settings = &settings[STREAM_INTERFACE];
 }
 
 static int uvc_driver_start(int size, void *p, void *user_data)
@@ -528,232 +1352,1591 @@ static SceUdcdDriver uvc_udcd_driver = {
 	.user_data			= NULL
 };
 
-static unsigned int uvc_frame_transfer(struct uvc_frame *frame,
-				       unsigned int frame_size,
-				       int fid, int eof)
+/*
+ * Converts ksceKernelGetSystemTimeWide() microseconds to UVC_CLOCK_FREQUENCY ticks.
+ */
+static inline uint32_t uvc_clock_from_us(uint64_t time)
+{
+	return time * (UVC_CLOCK_FREQUENCY / 1000000);
+}
+
+static inline void put_le32(unsigned char *p, uint32_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+}
+
+/*
+ * The PTS is the time the frame was captured and has to be the same for all
+ * the payloads of a frame. The SCR is sampled right before submitting the
+ * payload. There's no access to the controller's SOF counter, so the 1 KHz
+ * SOF token is derived from the same clock.
+ */
+static void uvc_payload_header_fill(unsigned char *header, int fid, int eof,
+				    uint64_t pts)
+{
+	uint64_t now = ksceKernelGetSystemTimeWide();
+	uint16_t sof = (now / 1000) & 0x7FF;
+
+	header[0] = UVC_PAYLOAD_HEADER_SIZE;
+	header[1] = UVC_STREAM_EOH | UVC_STREAM_PTS | UVC_STREAM_SCR;
+
+	if (fid)
+		header[1] |= UVC_STREAM_FID;
+	if (eof)
+		header[1] |= UVC_STREAM_EOF;
+
+	put_le32(&header[2], uvc_clock_from_us(pts));
+	put_le32(&header[6], uvc_clock_from_us(now));
+	header[10] = sof;
+	header[11] = sof >> 8;
+}
+
+/*
+ * The header goes at the end of the header slot in front of the data (see
+ * struct uvc_frame_layout).
+ */
+static int uvc_frame_transfer(struct uvc_xfer *xfer,
+			      unsigned char *data, unsigned int size,
+			      int fid, int eof, uint64_t pts)
+{
+	unsigned char *header = data - UVC_PAYLOAD_HEADER_SIZE;
+	int ret;
+
+	uvc_payload_header_fill(header, fid, eof, pts);
+	ksceKernelDcacheCleanRange(header, UVC_PAYLOAD_HEADER_SIZE);
+
+	ret = uvc_frame_req_submit_payload(xfer, header, UVC_PAYLOAD_HEADER_SIZE + size);
+	if (ret < 0) {
+		LOG("Error sending frame: 0x%08X\n", ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Every isochronous packet is a payload: a header is written in front of
+ * each packet_size bytes of data while copying it to the staging buffer.
+ */
+static int uvc_frame_transfer_isoc(struct uvc_xfer *xfer,
+				   const unsigned char *data, unsigned int size,
+				   int fid, int eof, uint64_t pts)
+{
+	unsigned char *dst = uvc_isoc.staging + (xfer - uvc_xfers) * UVC_ISOC_CHUNK_SIZE;
+	unsigned char header[UVC_PAYLOAD_HEADER_SIZE];
+	unsigned int len;
+	int ret;
+
+	ksceKernelDcacheInvalidateRange(data, size);
+
+	uvc_payload_header_fill(header, fid, eof, pts);
+	len = uvc_isoc_pack(dst, data, size, header, eof, uvc_isoc.packet_size);
+
+	ksceKernelDcacheCleanRange(dst, len);
+
+	ret = uvc_frame_req_submit_payload(xfer, dst, len);
+	if (ret < 0) {
+		LOG("Error sending frame: 0x%08X\n", ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+int uvc_start(void);
+int uvc_stop(void);
+
+static inline unsigned int display_to_iftu_pixelformat(unsigned int fmt)
+{
+	switch (fmt) {
+	case SCE_DISPLAY_PIXELFORMAT_A8B8G8R8:
+	default:
+		return SCE_IFTU_PIXELFORMAT_BGRX8888;
+	case SCE_DISPLAY_PIXELFORMAT_BGRA5551:
+		return SCE_IFTU_PIXELFORMAT_BGRA5551;
+	}
+}
+
+static inline unsigned int display_pixelformat_bpp(unsigned int fmt)
+{
+	switch (fmt) {
+	case SCE_DISPLAY_PIXELFORMAT_A8B8G8R8:
+	default:
+		return 4;
+	case SCE_DISPLAY_PIXELFORMAT_BGRA5551:
+		return 2;
+	}
+}
+
+#define UVC_MODE_FROM_FRAME(mode, frame) \
+	do { \
+		unsigned int __i; \
+		(mode)->width = (frame)->wWidth; \
+		(mode)->height = (frame)->wHeight; \
+		(mode)->default_interval = (frame)->dwDefaultFrameInterval; \
+		(mode)->num_intervals = (frame)->bFrameIntervalType; \
+		for (__i = 0; __i < (mode)->num_intervals; __i++) \
+			(mode)->interval[__i] = (frame)->dwFrameInterval[__i]; \
+	} while (0)
+
+/*
+ * Returns the default frame index of a format, 0 if it doesn't exist.
+ */
+static unsigned int uvc_format_default_frame(unsigned int format_index)
+{
+	switch (format_index) {
+	case FORMAT_INDEX_UNCOMPRESSED_NV12:
+		return video_streaming_descriptors.format_uncompressed_nv12.bDefaultFrameIndex;
+	case FORMAT_INDEX_UNCOMPRESSED_YUY2:
+		return video_streaming_descriptors.format_uncompressed_yuy2.bDefaultFrameIndex;
+	case FORMAT_INDEX_MJPEG:
+		return video_streaming_descriptors.format_mjpeg.bDefaultFrameIndex;
+	case FORMAT_INDEX_UNCOMPRESSED_RGB32:
+		return video_streaming_descriptors.format_uncompressed_rgb32.bDefaultFrameIndex;
+	default:
+		return 0;
+	}
+}
+
+static int uvc_mode_get(unsigned int format_index, unsigned int frame_index,
+			struct uvc_mode *mode)
+{
+	if (frame_index < 1)
+		return -1;
+
+	switch (format_index) {
+	case FORMAT_INDEX_UNCOMPRESSED_NV12:
+		if (frame_index > video_streaming_descriptors.format_uncompressed_nv12.bNumFrameDescriptors)
+			return -1;
+		UVC_MODE_FROM_FRAME(mode, &video_streaming_descriptors.frames_uncompressed_nv12[frame_index - 1]);
+		return 0;
+	case FORMAT_INDEX_UNCOMPRESSED_YUY2:
+		if (frame_index > video_streaming_descriptors.format_uncompressed_yuy2.bNumFrameDescriptors)
+			return -1;
+		UVC_MODE_FROM_FRAME(mode, &video_streaming_descriptors.frames_uncompressed_yuy2[frame_index - 1]);
+		return 0;
+	case FORMAT_INDEX_MJPEG:
+		if (frame_index > video_streaming_descriptors.format_mjpeg.bNumFrameDescriptors)
+			return -1;
+		UVC_MODE_FROM_FRAME(mode, &video_streaming_descriptors.frames_mjpeg[frame_index - 1]);
+		return 0;
+	case FORMAT_INDEX_UNCOMPRESSED_RGB32:
+		if (frame_index > video_streaming_descriptors.format_uncompressed_rgb32.bNumFrameDescriptors)
+			return -1;
+		UVC_MODE_FROM_FRAME(mode, &video_streaming_descriptors.frames_uncompressed_rgb32[frame_index - 1]);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static void uvc_mode_layout(unsigned int format_index, const struct uvc_mode *mode,
+			    struct uvc_frame_layout *layout)
+{
+	switch (format_index) {
+	case FORMAT_INDEX_UNCOMPRESSED_NV12:
+		uvc_frame_layout_nv12(layout, mode->width, mode->height,
+				      UVC_FRAME_SLICES);
+		break;
+	case FORMAT_INDEX_UNCOMPRESSED_YUY2:
+		uvc_frame_layout_packed(layout, mode->width, mode->height, 2,
+					UVC_FRAME_SLICES);
+		break;
+	case FORMAT_INDEX_UNCOMPRESSED_RGB32:
+		uvc_frame_layout_packed(layout, mode->width, mode->height, 4,
+					UVC_FRAME_SLICES);
+		break;
+	case FORMAT_INDEX_MJPEG:
+		uvc_frame_layout_mjpeg(layout, mode->width, mode->height);
+		break;
+	}
+}
+
+static const struct uvc_negotiate_ops uvc_negotiate_ops = {
+	.default_frame	= uvc_format_default_frame,
+	.mode_get	= uvc_mode_get,
+	.mode_layout	= uvc_mode_layout,
+};
+
+/*
+ * Isochronous payloads are one (micro)frame long: dwMaxPayloadTransferSize
+ * is the bandwidth of the smallest alternate setting that sustains the
+ * frame rate, which the host then selects. A setting none of them sustains
+ * is moved to the closest one that fits, see uvc_isoc_negotiate().
+ */
+static int uvc_streaming_isoc_negotiate(struct uvc_streaming_control *ctrl)
 {
+	const SceUdcdInterfaceSettings *settings = uvc_isoc_stream_settings();
+	struct uvc_isoc_tiers tiers;
+	unsigned int alt;
 	int ret;
 
-	frame->header[0] = UVC_PAYLOAD_HEADER_SIZE;
-	frame->header[1] = UVC_STREAM_EOH;
+	tiers.num_tiers = 0;
+	for (alt = 1; alt < settings->numDescriptors && tiers.num_tiers < UVC_ISOC_MAX_TIERS; alt++)
+		tiers.packet_size[tiers.num_tiers++] = uvc_isoc_alt_packet_size(alt);
+	tiers.packets_per_second = uvc_isoc_packets_per_second();
+
+	ret = uvc_isoc_negotiate(ctrl, &uvc_probe_control_setting_default,
+				 &uvc_negotiate_ops, &tiers);
+	if (ret > 0)
+		LOG("Isochronous bandwidth exceeded, moved to format %d frame %d interval %d\n",
+		    ctrl->bFormatIndex, ctrl->bFrameIndex, ctrl->dwFrameInterval);
+	else if (ret < 0)
+		LOG("No isochronous tier carries format %d frame %d\n",
+		    ctrl->bFormatIndex, ctrl->bFrameIndex);
+
+	return ret;
+}
+
+/*
+ * Returns 1 if an isochronous stream couldn't get the requested setting.
+ */
+static int uvc_streaming_negotiate(struct uvc_streaming_control *ctrl,
+				   const struct uvc_streaming_control *req)
+{
+	uvc_negotiate(ctrl, req, &uvc_probe_control_setting_default,
+		      &uvc_negotiate_ops);
+
+	if (UVC_ISOC)
+		return uvc_streaming_isoc_negotiate(ctrl) != 0;
+
+	return 0;
+}
+
+static inline unsigned char *uvc_frame_payload(unsigned char *base,
+					       const struct uvc_frame_layout *layout,
+					       unsigned int payload)
+{
+	return base + layout->offset[payload];
+}
+
+/*
+ * The IFTU works with 10-bit samples: offsets and clamps are 10-bit and the
+ * coefficients are 12-bit two's complement. csc_matrix_adjust() keeps the
+ * offsets in [0, 255].
+ */
+static void iftu_csc_params_from_matrix(SceIftuCscParams *params,
+					const struct csc_matrix *matrix)
+{
+	int i, j;
+
+	/* Cb and Cr are rounded to nearest */
+	params->post_add_0 = matrix->offset[0] << 2;
+	params->post_add_1_2 = (matrix->offset[1] << 2) + 2;
+	params->post_clamp_max_0 = 0x3FF;
+	params->post_clamp_min_0 = 0;
+	params->post_clamp_max_1_2 = 0x3FF;
+	params->post_clamp_min_1_2 = 0;
+
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++)
+			params->ctm[i][j] = matrix->coef[i][j] & 0xFFF;
+}
+
+static int uvc_pu_control_cur(unsigned int selector)
+{
+	return uvc_pu_control_get(selector)->cur;
+}
+
+/*
+ * Folds the Processing Unit controls into the matrix of the committed
+ * colorimetry, once per change.
+ */
+static void uvc_csc_update(void)
+{
+	struct csc_adjust adjust;
+
+	if (!uvc_csc.dirty)
+		return;
+
+	uvc_csc.dirty = 0;
+
+	adjust.brightness = uvc_pu_control_cur(UVC_PU_BRIGHTNESS_CONTROL);
+	adjust.contrast = uvc_pu_control_cur(UVC_PU_CONTRAST_CONTROL);
+	adjust.saturation = uvc_pu_control_cur(UVC_PU_SATURATION_CONTROL);
+	adjust.hue = uvc_pu_control_cur(UVC_PU_HUE_CONTROL) / 100;
+
+	csc_matrix_adjust(&uvc_csc.matrix, colorimetry_matrices[uvc_csc.colorimetry],
+			  &adjust);
+	iftu_csc_params_from_matrix(&uvc_csc.iftu, &uvc_csc.matrix);
+}
+
+/*
+ * Resolves the IFTU destination of every band of every ring buffer for the
+ * mode uvc_frame_layout was laid out for. MJPEG frames are converted in one
+ * go into the encoder's NV12 scratch buffer.
+ */
+static void uvc_stream_plan_build(unsigned int format_index, unsigned int frame_index)
+{
+	const struct uvc_frame_layout *layout = &uvc_frame_layout;
+	struct uvc_plan_band *band;
+	unsigned int i, j;
+	uintptr_t paddr0, paddr1;
+
+	memset(&uvc_stream_plan, 0, sizeof(uvc_stream_plan));
+
+	switch (format_index) {
+	case FORMAT_INDEX_UNCOMPRESSED_YUY2:
+		uvc_stream_plan.dst_pixelfmt = SCE_IFTU_PIXELFORMAT_YUV422;
+		break;
+	case FORMAT_INDEX_UNCOMPRESSED_RGB32:
+		uvc_stream_plan.dst_pixelfmt = SCE_IFTU_PIXELFORMAT_RGBX8888;
+		break;
+	default:
+		uvc_stream_plan.dst_pixelfmt = SCE_IFTU_PIXELFORMAT_NV12;
+		break;
+	}
+
+	if (format_index == FORMAT_INDEX_MJPEG) {
+		uvc_stream_plan.num_bands = 1;
+		uvc_stream_plan.band_y[0] = 0;
+		uvc_stream_plan.band_height[0] = layout->height;
+	} else {
+		uvc_stream_plan.num_bands = layout->num_slices;
+		for (j = 0; j < layout->num_slices; j++) {
+			uvc_stream_plan.band_y[j] = j * layout->slice_height;
+			uvc_stream_plan.band_height[j] = layout->height - uvc_stream_plan.band_y[j];
+			if (uvc_stream_plan.band_height[j] > layout->slice_height)
+				uvc_stream_plan.band_height[j] = layout->slice_height;
+		}
+	}
+
+	for (i = 0; i < UVC_FRAME_RING_SIZE; i++) {
+		unsigned char *base = uvc_frame_ring[i].addr;
+
+		for (j = 0; j < uvc_stream_plan.num_bands; j++) {
+			band = &uvc_stream_plan.bands[i][j];
+
+			if (format_index == FORMAT_INDEX_MJPEG) {
+				mjpeg_get_nv12(&band->dst0, &band->dst1);
+			} else if (format_index == FORMAT_INDEX_UNCOMPRESSED_NV12) {
+				band->dst0 = uvc_frame_payload(base, layout, j);
+				band->dst1 = base + layout->uv_offset +
+					     uvc_stream_plan.band_y[j] * layout->width / 2;
+			} else {
+				band->dst0 = uvc_frame_payload(base, layout, j);
+				band->dst1 = NULL;
+			}
+
+			paddr0 = 0;
+			paddr1 = 0;
+			ksceKernelGetPaddr(band->dst0, &paddr0);
+			if (band->dst1)
+				ksceKernelGetPaddr(band->dst1, &paddr1);
+
+			band->dst.pixelformat = uvc_stream_plan.dst_pixelfmt;
+			band->dst.width = layout->width;
+			band->dst.height = uvc_stream_plan.band_height[j];
+			band->dst.leftover_stride = 0;
+			band->dst.leftover_align = 0;
+			band->dst.paddr0 = paddr0;
+			band->dst.paddr1 = paddr1;
+		}
+	}
+
+	/*
+	 * The CSC is bypassed for RGBX8888: the IFTU only swaps R and B from
+	 * the R, G, B, X bytes of the framebuffer to the B, G, R, X ones of RGB32.
+	 */
+	uvc_stream_plan.params.size = sizeof(uvc_stream_plan.params);
+	uvc_stream_plan.params.csc_params1 = &uvc_csc.iftu;
+	uvc_stream_plan.params.csc_params2 = NULL;
+	uvc_stream_plan.params.csc_control =
+		(uvc_stream_plan.dst_pixelfmt != SCE_IFTU_PIXELFORMAT_RGBX8888);
+	uvc_stream_plan.params.alpha = 0xFF;
+
+	uvc_stream_plan.format_index = format_index;
+	uvc_stream_plan.frame_index = frame_index;
+}
+
+/*
+ * Builds the source side of every band for the roi of a framebuffer of
+ * that format and pitch, unless the plan already has it. A band starts at
+ * the source row it maps to: the integer part goes to the source address
+ * offset and the fractional part to src_y. The roi is cropped the same
+ * way, through the source address and size, so the crop fields of the
+ * plane state stay at 0.
+ */
+static void uvc_stream_plan_source(const SceDisplayFrameBufInfo *fb_info,
+				   const struct uvc_frame_roi *roi)
+{
+	const struct uvc_frame_layout *layout = &uvc_frame_layout;
+	unsigned int src_pitch = fb_info->framebuf.pitch;
+	unsigned int src_pixelfmt = fb_info->framebuf.pixelformat;
+	unsigned int src_pixelfmt_bpp = display_pixelformat_bpp(src_pixelfmt);
+	unsigned int src_width = roi->width;
+	unsigned int src_width_aligned = ALIGN(src_width, 16);
+	unsigned int src_height = roi->height;
+	unsigned int scale_h = (src_height * 0x10000) / layout->height;
+	unsigned int band_y, band_height, band_src_top, band_src_row, band_src_rows;
+	SceIftuPlaneState_updated *src;
+	unsigned int i;
+
+	if (uvc_stream_plan.source.pitch == src_pitch &&
+	    uvc_stream_plan.source.pixelformat == src_pixelfmt &&
+	    !memcmp(&uvc_stream_plan.source.roi, roi, sizeof(*roi)))
+		return;
+
+	for (i = 0; i < uvc_stream_plan.num_bands; i++) {
+		band_y = uvc_stream_plan.band_y[i];
+		band_height = uvc_stream_plan.band_height[i];
+		band_src_top = band_y * scale_h;
+		band_src_row = band_src_top >> 16;
+		band_src_rows = (((band_y + band_height) * scale_h + 0xFFFF) >> 16) - band_src_row;
+
+		if (band_src_row + band_src_rows > src_height)
+			band_src_rows = src_height - band_src_row;
+
+		uvc_stream_plan.source.offset[i] =
+			((roi->y + band_src_row) * src_pitch + roi->x) * src_pixelfmt_bpp;
+
+		src = &uvc_stream_plan.source.src[i];
+		memset(src, 0, sizeof(*src));
+		src->fb.pixelformat = display_to_iftu_pixelformat(src_pixelfmt);
+		src->fb.width = src_width_aligned;
+		src->fb.height = band_src_rows;
+		src->fb.leftover_stride = (src_pitch - src_width_aligned) * src_pixelfmt_bpp;
+		src->fb.leftover_align = 0;
+		src->src_w = (src_width * 0x10000) / layout->width;
+		src->src_h = scale_h;
+		src->dst_x = IFTU_PLANE_DST_X(src_width);
+		src->dst_y = IFTU_PLANE_DST_Y(src_height);
+		src->src_x = 0;
+		src->src_y = (band_src_top >> 8) & 0xFF;
+	}
+
+	uvc_stream_plan.source.pixelformat = src_pixelfmt;
+	uvc_stream_plan.source.pitch = src_pitch;
+	uvc_stream_plan.source.roi = *roi;
+}
+
+/*
+ * Converts (and scales) a band of the roi of the ring buffer's source
+ * framebuffer following the plan.
+ */
+static int frame_convert(int index, unsigned int band)
+{
+	const SceDisplayFrameBufInfo *fb_info = &uvc_frame_ring[index].fb_info;
+	SceIftuPlaneState_updated src;
+
+	uvc_stream_plan_source(fb_info, &uvc_frame_ring[index].roi);
+
+	src = uvc_stream_plan.source.src[band];
+	src.fb.paddr0 = fb_info->paddr + uvc_stream_plan.source.offset[band];
+
+	return ksceIftuCsc(&uvc_stream_plan.bands[index][band].dst,
+			   (SceIftuPlaneState *)&src, &uvc_stream_plan.params);
+}
+
+/*
+ * Software fallback of frame_convert(): each worker of the pool converts
+ * an even number of rows of the band.
+ */
+#define CSC_MAX_SRC_WIDTH	1024
+
+static uint32_t csc_row_buf[WORKER_POOL_SIZE][2 * CSC_MAX_SRC_WIDTH];
+
+struct frame_convert_sw_job {
+	const SceDisplayFrameBufInfo *fb_info;
+	const struct uvc_frame_roi *roi;
+	struct csc_src src;
+	struct csc_matrix matrix;
+	unsigned int dst_pixelfmt;
+	unsigned char *dst0;
+	unsigned char *dst1;
+	unsigned int dst_width;
+	unsigned int dst_height;
+	unsigned int band_y;
+	unsigned int band_height;
+	unsigned int rows_per_worker;
+	int ret[WORKER_POOL_SIZE];
+};
+
+/*
+ * Copies count pixels of row y, starting at column x, of the source
+ * framebuffer, which lives in the address space of its process.
+ */
+static int frame_source_copy_row(const SceDisplayFrameBufInfo *fb_info,
+				 unsigned int x, unsigned int y,
+				 unsigned int count, void *buf)
+{
+	unsigned int bpp = display_pixelformat_bpp(fb_info->framebuf.pixelformat);
+	uintptr_t row = (uintptr_t)fb_info->framebuf.base +
+			(y * fb_info->framebuf.pitch + x) * bpp;
+
+	return ksceKernelMemcpyUserToKernelForPid(fb_info->pid, buf, row, count * bpp);
+}
+
+static const void *frame_source_read_row(const struct csc_src *src,
+					 unsigned int y, void *buf)
+{
+	const struct frame_convert_sw_job *job = src->user;
+
+	if (frame_source_copy_row(job->fb_info, job->roi->x, job->roi->y + y,
+				  src->width, buf) < 0)
+		return NULL;
+
+	return buf;
+}
+
+static void frame_convert_sw_job(unsigned int i, void *arg)
+{
+	struct frame_convert_sw_job *job = arg;
+	unsigned int y = i * job->rows_per_worker;
+	unsigned int rows = job->band_height - y;
+
+	job->ret[i] = 0;
+
+	if (y >= job->band_height)
+		return;
+	if (rows > job->rows_per_worker)
+		rows = job->rows_per_worker;
+
+	if (job->dst_pixelfmt == SCE_IFTU_PIXELFORMAT_NV12)
+		job->ret[i] = csc_to_nv12(&job->matrix, &job->src,
+					  job->dst0 + y * job->dst_width,
+					  job->dst1 + y / 2 * job->dst_width,
+					  job->dst_width, job->dst_height,
+					  job->band_y + y, rows, csc_row_buf[i]);
+	else if (job->dst_pixelfmt == SCE_IFTU_PIXELFORMAT_YUV422)
+		job->ret[i] = csc_to_yuy2(&job->matrix, &job->src,
+					  job->dst0 + y * job->dst_width * 2,
+					  job->dst_width, job->dst_height,
+					  job->band_y + y, rows, csc_row_buf[i]);
+	else
+		job->ret[i] = csc_to_bgrx(&job->src,
+					  job->dst0 + y * job->dst_width * 4,
+					  job->dst_width, job->dst_height,
+					  job->band_y + y, rows, csc_row_buf[i]);
+}
+
+static int frame_convert_sw(const SceDisplayFrameBufInfo *fb_info,
+			    const struct uvc_frame_roi *roi,
+			    unsigned int dst_pixelfmt,
+			    unsigned char *dst0, unsigned char *dst1,
+			    int dst_width, int dst_height,
+			    int band_y, int band_height)
+{
+	struct frame_convert_sw_job job;
+	int i, ret;
+
+	if (roi->width > CSC_MAX_SRC_WIDTH)
+		return -1;
+
+	job.fb_info = fb_info;
+	job.roi = roi;
+	job.src.format = (fb_info->framebuf.pixelformat == SCE_DISPLAY_PIXELFORMAT_BGRA5551) ?
+		CSC_SRC_RGBA5551 : CSC_SRC_RGBA8888;
+	job.src.width = roi->width;
+	job.src.height = roi->height;
+	job.src.read_row = frame_source_read_row;
+	job.src.user = &job;
+	job.matrix = uvc_csc.matrix;
+	job.dst_pixelfmt = dst_pixelfmt;
+	job.dst0 = dst0;
+	job.dst1 = dst1;
+	job.dst_width = dst_width;
+	job.dst_height = dst_height;
+	job.band_y = band_y;
+	job.band_height = band_height;
+	job.rows_per_worker = ALIGN((band_height + WORKER_POOL_SIZE - 1) / WORKER_POOL_SIZE, 2);
+
+	ret = worker_pool_run(frame_convert_sw_job, &job);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < WORKER_POOL_SIZE; i++) {
+		if (job.ret[i] < 0)
+			return job.ret[i];
+	}
+
+	/* The result is DMA'd (or read back through the cache by MJPEG) */
+	if (dst_pixelfmt == SCE_IFTU_PIXELFORMAT_NV12) {
+		ksceKernelDcacheCleanRange(dst0, dst_width * band_height);
+		ksceKernelDcacheCleanRange(dst1, dst_width * band_height / 2);
+	} else if (dst_pixelfmt == SCE_IFTU_PIXELFORMAT_YUV422) {
+		ksceKernelDcacheCleanRange(dst0, dst_width * band_height * 2);
+	} else {
+		ksceKernelDcacheCleanRange(dst0, dst_width * band_height * 4);
+	}
+
+	return 0;
+}
+
+/*
+ * Converts with the IFTU and falls back to the CPU if that fails or can't
+ * apply the current matrix, or always uses the CPU with UVC_SW_CSC.
+ */
+static int frame_convert_band(int index, unsigned int band)
+{
+	const struct uvc_plan_band *plan = &uvc_stream_plan.bands[index][band];
+	int ret;
+
+	if (!UVC_SW_CSC) {
+		ret = frame_convert(index, band);
+		if (ret >= 0)
+			return ret;
+
+		LOG("IFTU CSC failed (0x%08X), converting on the CPU\n", ret);
+	}
+
+	return frame_convert_sw(&uvc_frame_ring[index].fb_info,
+				&uvc_frame_ring[index].roi,
+				uvc_stream_plan.dst_pixelfmt, plan->dst0, plan->dst1,
+				uvc_frame_layout.width, uvc_frame_layout.height,
+				uvc_stream_plan.band_y[band],
+				uvc_stream_plan.band_height[band]);
+}
+
+/*
+ * Uncompressed formats: NV12, YUY2 or RGB32. A slice is a band of the
+ * plan.
+ */
+static int convert_slice_uncompressed(int index)
+{
+	int ret;
+	unsigned int slice = uvc_frame_ring[index].converted;
+	uint64_t time1, time2;
+	UNUSED(time1);
+	UNUSED(time2);
+
+	time1 = ksceKernelGetSystemTimeWide();
+
+	ret = frame_convert_band(index, slice);
+	if (ret < 0)
+		return ret;
+
+	time2 = ksceKernelGetSystemTimeWide();
+	LOG("CSC slice %d: %lldus\n", slice, time2 - time1);
+
+	uvc_frame_ring[index].converted++;
+
+	return 0;
+}
+
+static int convert_slice_mjpeg(int index)
+{
+	int ret;
+	const struct uvc_frame_layout *layout = &uvc_frame_layout;
+	unsigned char *dst = uvc_frame_payload(uvc_frame_ring[index].addr, layout, 0);
+	uint64_t time1, time2, time3;
+	UNUSED(time1);
+	UNUSED(time2);
+	UNUSED(time3);
+
+	time1 = ksceKernelGetSystemTimeWide();
+
+	ret = frame_convert_band(index, 0);
+	if (ret < 0)
+		return ret;
+
+	time2 = ksceKernelGetSystemTimeWide();
+
+	ret = mjpeg_encode(dst,
+			   layout->payload_size[0] - UVC_PAYLOAD_HEADER_SIZE,
+			   uvc_commit_control_setting.dwFrameInterval);
+	if (ret < 0)
+		return ret;
+
+	time3 = ksceKernelGetSystemTimeWide();
+	LOG("MJPEG CSC: %lldus, encode: %lldus, %d bytes\n",
+	    time2 - time1, time3 - time2, ret);
+
+	uvc_frame_ring[index].payload_size = UVC_PAYLOAD_SIZE(ret);
+	uvc_frame_ring[index].converted++;
+
+	return 0;
+}
+
+/*
+ * Returns the ring buffer the next frame can be captured into: neither
+ * being sent nor queued to be sent.
+ */
+static int uvc_frame_ring_get_free(void)
+{
+	int i, index;
+
+	for (i = 0; i < UVC_FRAME_RING_SIZE; i++) {
+		index = (uvc_frame_ring_index + i) % UVC_FRAME_RING_SIZE;
+		if (index != uvc_stream.cur && index != uvc_stream.next)
+			return index;
+	}
+
+	return -1;
+}
+
+/*
+ * No ring buffer is free: applies UVC_FRAME_POLICY. Returns the buffer the
+ * new frame goes to, or -1 if it doesn't get one.
+ */
+static int uvc_frame_ring_get_overflow(void)
+{
+	int index = uvc_stream.next;
+
+	if (UVC_FRAME_POLICY == FRAME_POLICY_BLOCK) {
+		uvc_stream.capture_pending = 1;
+		return -1;
+	}
+
+	/* Nothing of it may have been handed to the controller */
+	if (UVC_FRAME_POLICY == FRAME_POLICY_DROP_OLDEST && index >= 0 &&
+	    uvc_frame_ring[index].sent == 0 && uvc_frame_ring[index].sent_offset == 0) {
+		uvc_stats.frames_replaced++;
+		uvc_stream.next = -1;
+		return index;
+	}
+
+	uvc_stats.frames_skipped++;
+
+	return -1;
+}
+
+/*
+ * Hashes UVC_FRAME_HASH_ROWS rows evenly spread over the source framebuffer.
+ */
+static int frame_source_hash(const SceDisplayFrameBufInfo *fb_info, uint32_t *hash)
+{
+	static uint32_t row_buf[1024];
+	uint32_t lanes[4] = {FRAME_HASH_INIT, FRAME_HASH_INIT, FRAME_HASH_INIT, FRAME_HASH_INIT};
+	unsigned int bpp = display_pixelformat_bpp(fb_info->framebuf.pixelformat);
+	unsigned int row_size = fb_info->framebuf.width * bpp;
+	uintptr_t base = (uintptr_t)fb_info->framebuf.base;
+	unsigned int i, row;
+	int ret;
+
+	if (row_size > sizeof(row_buf))
+		row_size = sizeof(row_buf);
+	row_size &= ~15;
+
+	for (i = 0; i < UVC_FRAME_HASH_ROWS; i++) {
+		row = i * (fb_info->framebuf.height - 1) / (UVC_FRAME_HASH_ROWS - 1);
+		ret = ksceKernelMemcpyUserToKernelForPid(fb_info->pid, row_buf,
+			base + row * fb_info->framebuf.pitch * bpp, row_size);
+		if (ret < 0)
+			return ret;
+
+		frame_hash_block(lanes, row_buf, row_size / 4);
+	}
+
+	*hash = lanes[0] ^ lanes[1] ^ lanes[2] ^ lanes[3];
+
+	return 0;
+}
+
+static void frame_source_identify(const SceDisplayFrameBufInfo *fb_info,
+				  struct uvc_frame_source *source)
+{
+	source->paddr = fb_info->paddr;
+	source->vblankcount = fb_info->vblankcount;
+	source->width = fb_info->framebuf.width;
+	source->height = fb_info->framebuf.height;
+	source->pixelformat = fb_info->framebuf.pixelformat;
+	source->hash = 0;
+	source->valid = 1;
+
+	if (UVC_FRAME_HASH && frame_source_hash(fb_info, &source->hash) < 0)
+		source->valid = 0;
+}
+
+static inline int frame_source_equal(const struct uvc_frame_source *a,
+				     const struct uvc_frame_source *b)
+{
+	return a->valid && b->valid &&
+	       a->paddr == b->paddr &&
+	       a->vblankcount == b->vblankcount &&
+	       a->width == b->width &&
+	       a->height == b->height &&
+	       a->pixelformat == b->pixelformat &&
+	       a->hash == b->hash;
+}
+
+static inline int frame_pixel_is_black(const void *row, unsigned int x,
+				       unsigned int bpp)
+{
+	const unsigned int t = UVC_AUTO_CROP_THRESHOLD;
+	uint32_t p;
+
+	if (bpp == 2) {
+		p = ((const uint16_t *)row)[x];
+		return (p & 0x1F) <= (t >> 3) &&
+		       ((p >> 5) & 0x1F) <= (t >> 3) &&
+		       ((p >> 10) & 0x1F) <= (t >> 3);
+	}
+
+	p = ((const uint32_t *)row)[x];
+	return (p & 0xFF) <= t && ((p >> 8) & 0xFF) <= t && ((p >> 16) & 0xFF) <= t;
+}
+
+static int frame_row_is_black(const SceDisplayFrameBufInfo *fb_info,
+			      unsigned int y, void *buf)
+{
+	unsigned int bpp = display_pixelformat_bpp(fb_info->framebuf.pixelformat);
+	unsigned int x;
+
+	if (frame_source_copy_row(fb_info, 0, y, fb_info->framebuf.width, buf) < 0)
+		return 0;
+
+	for (x = 0; x < fb_info->framebuf.width; x += UVC_AUTO_CROP_STEP) {
+		if (!frame_pixel_is_black(buf, x, bpp))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Finds the bounding box of the non-black content of the source
+ * framebuffer. Returns < 0 if it's all black.
+ */
+static int frame_detect_content(const SceDisplayFrameBufInfo *fb_info,
+				struct uvc_frame_roi *roi)
+{
+	static uint32_t row_buf[CSC_MAX_SRC_WIDTH];
+	unsigned int width = fb_info->framebuf.width;
+	unsigned int height = fb_info->framebuf.height;
+	unsigned int bpp = display_pixelformat_bpp(fb_info->framebuf.pixelformat);
+	unsigned int top, bottom, left, right, i, x, y;
+
+	if (width > CSC_MAX_SRC_WIDTH)
+		return -1;
+
+	for (top = 0; top < height; top += 2) {
+		if (!frame_row_is_black(fb_info, top, row_buf))
+			break;
+	}
+	if (top >= height)
+		return -1;
+
+	for (bottom = height; bottom > top + 2; bottom -= 2) {
+		if (!frame_row_is_black(fb_info, bottom - 1, row_buf))
+			break;
+	}
+
+	/* Pillarbox: check a few rows of the content */
+	left = width;
+	right = 0;
+	for (i = 0; i < 8; i++) {
+		y = top + (bottom - top - 1) * i / 7;
+		if (frame_source_copy_row(fb_info, 0, y, width, row_buf) < 0)
+			return -1;
+
+		for (x = 0; x < left; x++) {
+			if (!frame_pixel_is_black(row_buf, x, bpp)) {
+				left = x;
+				break;
+			}
+		}
+		for (x = width; x > right; x--) {
+			if (!frame_pixel_is_black(row_buf, x - 1, bpp)) {
+				right = x;
+				break;
+			}
+		}
+	}
+	if (right <= left) {
+		left = 0;
+		right = width;
+	}
+
+	roi->x = left & ~15;
+	roi->width = ALIGN(right - roi->x, 16);
+	if (roi->x + roi->width > width)
+		roi->width = width - roi->x;
+	roi->y = top;
+	roi->height = ALIGN(bottom - top, 2);
+	if (roi->y + roi->height > height)
+		roi->height = height - roi->y;
+
+	return 0;
+}
+
+/*
+ * Aligns roi and makes sure it's within the framebuffer.
+ */
+static int uvc_frame_roi_clamp(struct uvc_frame_roi *roi,
+			       unsigned int fb_width, unsigned int fb_height)
+{
+	unsigned int right = roi->x + roi->width;
+
+	roi->x &= ~15;
+	roi->width = ALIGN(right - roi->x, 16);
+	roi->y &= ~1;
+	roi->height = ALIGN(roi->height, 2);
+
+	if (roi->width == 0 || roi->height == 0 ||
+	    roi->x >= fb_width || roi->y >= fb_height)
+		return -1;
+
+	if (roi->x + roi->width > fb_width)
+		roi->width = fb_width - roi->x;
+	if (roi->y + roi->height > fb_height)
+		roi->height = fb_height - roi->y;
+
+	return 0;
+}
+
+/*
+ * Grows roi around its center to the aspect ratio of the destination, as
+ * far as the framebuffer allows.
+ */
+static void uvc_frame_roi_fit(struct uvc_frame_roi *roi,
+			      unsigned int fb_width, unsigned int fb_height,
+			      unsigned int dst_width, unsigned int dst_height)
+{
+	unsigned int width, height;
+	int x, y;
+
+	if (roi->width * dst_height > roi->height * dst_width) {
+		height = ALIGN(roi->width * dst_height / dst_width, 2);
+		if (height > fb_height)
+			height = fb_height;
+
+		y = (int)roi->y - (int)(height - roi->height) / 2;
+		if (y < 0)
+			y = 0;
+		if (y + (int)height > (int)fb_height)
+			y = fb_height - height;
+
+		roi->y = y & ~1;
+		roi->height = height;
+	} else {
+		width = ALIGN(roi->height * dst_width / dst_height, 16);
+		if (width > fb_width)
+			width = fb_width;
+
+		x = (int)roi->x - (int)(width - roi->width) / 2;
+		if (x < 0)
+			x = 0;
+		if (x + (int)width > (int)fb_width)
+			x = fb_width - width;
+
+		roi->x = x & ~15;
+		roi->width = width;
+	}
+}
+
+static void uvc_frame_roi_select(const SceDisplayFrameBufInfo *fb_info,
+				 uint64_t now, struct uvc_frame_roi *roi)
+{
+	unsigned int fb_width = fb_info->framebuf.width;
+	unsigned int fb_height = fb_info->framebuf.height;
+	const struct uvc_frame_roi full = {0, 0, fb_width, fb_height};
+	struct uvc_frame_roi detected;
+
+	*roi = full;
+
+	if (uvc_roi_manual.width && uvc_roi_manual.height) {
+		*roi = uvc_roi_manual;
+	} else if (UVC_AUTO_CROP) {
+		if (now - uvc_auto_crop.last_detect >= UVC_AUTO_CROP_INTERVAL) {
+			uvc_auto_crop.last_detect = now;
+
+			if (frame_detect_content(fb_info, &detected) < 0)
+				detected = full;
+
+			/* Only follow detections that are stable */
+			if (memcmp(&detected, &uvc_auto_crop.candidate, sizeof(detected)) == 0) {
+				uvc_auto_crop.roi = detected;
+				uvc_auto_crop.valid = 1;
+			}
+			uvc_auto_crop.candidate = detected;
+		}
+
+		if (uvc_auto_crop.valid)
+			*roi = uvc_auto_crop.roi;
+	}
+
+	if (uvc_frame_roi_clamp(roi, fb_width, fb_height) < 0)
+		*roi = full;
+
+	uvc_frame_roi_fit(roi, fb_width, fb_height,
+			  uvc_frame_layout.width, uvc_frame_layout.height);
+}
+
+/*
+ * Logs the results of the current placement once it has sent enough
+ * payloads, and switches to the other one. The timings are reset by the
+ * reallocation.
+ */
+static void uvc_bench_tick(void)
+{
+	struct uvc_xu_stats stats;
+
+	if (uvc_frame_ring[0].uid < 0 || uvc_stats.xfer.count < UVC_BENCH_PAYLOADS)
+		return;
+
+	uvc_stats_get(&stats);
+
+	LOG("Bench format %d, %dx%d, %s: CSC %dus (max %dus), xfer %dus (max %dus)\n",
+	    uvc_commit_control_setting.bFormatIndex,
+	    uvc_frame_layout.width, uvc_frame_layout.height,
+	    uvc_frame_pool_memory == FRAME_PLACEMENT_CDRAM ? "CDRAM" : "main RAM",
+	    stats.csc_avg_us, stats.csc_max_us, stats.xfer_avg_us, stats.xfer_max_us);
+
+	uvc_frame_placement = (uvc_frame_pool_memory == FRAME_PLACEMENT_CDRAM) ?
+		FRAME_PLACEMENT_PHYCONT : FRAME_PLACEMENT_CDRAM;
+}
+
+static int capture_frame(void)
+{
+	unsigned int format_index = uvc_commit_control_setting.bFormatIndex;
+	unsigned int frame_index = uvc_commit_control_setting.bFrameIndex;
+	struct uvc_mode mode;
+	int ret, index;
+	uint64_t now;
+	SceDisplayFrameBufInfo fb_info;
+	struct uvc_frame_source source;
+	int head = ksceDisplayGetPrimaryHead();
+
+	/* Set again by uvc_frame_ring_get_overflow() if still blocked */
+	uvc_stream.capture_pending = 0;
+
+	if (UVC_BENCH)
+		uvc_bench_tick();
+
+	if (uvc_frame_ring[0].uid < 0 || format_index != uvc_stream_plan.format_index ||
+	    frame_index != uvc_stream_plan.frame_index ||
+	    uvc_frame_placement != uvc_frame_pool_placement) {
+		/* Validated on commit */
+		if (uvc_mode_get(format_index, frame_index, &mode) < 0)
+			return 0;
+
+		/*
+		 * Can't change the layout (or grow the ring) while the
+		 * controller reads from it, retry on the next tick.
+		 */
+		if (uvc_xfer_in_flight() > 0)
+			return 0;
+
+		uvc_stream.cur = -1;
+		uvc_stream.next = -1;
+		uvc_stream.last = -1;
+
+		uvc_mode_layout(format_index, &mode, &uvc_frame_layout);
+
+		ret = uvc_frame_init(uvc_frame_layout.size);
+		if (ret < 0) {
+			LOG("Error allocating the UVC frame (0x%08X)\n", ret);
+			return ret;
+		}
+
+		if (format_index == FORMAT_INDEX_MJPEG) {
+			ret = mjpeg_init(mode.width, mode.height);
+			if (ret < 0) {
+				LOG("Error initializing the MJPEG encoder (0x%08X)\n", ret);
+				return ret;
+			}
+		}
+
+		uvc_stream_plan_build(format_index, frame_index);
+
+		memset(&uvc_stats.csc, 0, sizeof(uvc_stats.csc));
+		memset(&uvc_stats.xfer, 0, sizeof(uvc_stats.xfer));
+	}
+
+	now = ksceKernelGetSystemTimeWide();
+	uvc_frame_pool_last_use = now;
+
+	memset(&fb_info, 0, sizeof(fb_info));
+	fb_info.size = sizeof(fb_info);
+	ret = ksceDisplayGetProcFrameBufInternal(-1, head, 0, &fb_info);
+	if (ret < 0 || fb_info.paddr == 0)
+		ret = ksceDisplayGetProcFrameBufInternal(-1, head, 1, &fb_info);
+	if (ret < 0)
+		return ret;
+
+	frame_source_identify(&fb_info, &source);
+
+	/*
+	 * The matrix changed (Processing Unit controls, colorimetry of a new
+	 * commit) and is applied on the next conversion: the last frame has
+	 * to be converted again even if the screen didn't change.
+	 */
+	if (uvc_csc.dirty)
+		uvc_stream.last = -1;
+
+	if (uvc_stream.last >= 0 &&
+	    frame_source_equal(&source, &uvc_stream.last_source)) {
+		/*
+		 * Nothing new on screen: skip the CSC and resend the last
+		 * converted frame, unless it's already queued.
+		 */
+		if (now - uvc_stream.last_queue_time < UVC_UNCHANGED_KEEPALIVE_INTERVAL)
+			return 0;
+
+		index = uvc_stream.last;
+		if (index == uvc_stream.cur || index == uvc_stream.next)
+			return 0;
+
+		uvc_frame_ring[index].converted = uvc_frame_ring[index].num_payloads;
+	} else {
+		index = uvc_frame_ring_get_free();
+		if (index < 0)
+			index = uvc_frame_ring_get_overflow();
+		if (index < 0)
+			return 0;
+
+		uvc_frame_ring[index].fb_info = fb_info;
+		uvc_frame_roi_select(&fb_info, now, &uvc_frame_ring[index].roi);
+		uvc_frame_ring[index].num_payloads = uvc_frame_layout.num_slices;
+		uvc_frame_ring[index].converted = 0;
+		uvc_stream.last = index;
+		uvc_stream.last_source = source;
+	}
+
+	uvc_frame_ring[index].dropped = 0;
+	uvc_frame_ring[index].sent = 0;
+	uvc_frame_ring[index].sent_offset = 0;
+	uvc_frame_ring[index].done = 0;
+	uvc_stream.last_queue_time = now;
+	uvc_frame_ring[index].capture_time = now;
+
+	if (uvc_stream.cur < 0)
+		uvc_stream.cur = index;
+	else
+		uvc_stream.next = index;
+
+	uvc_frame_ring_index = (index + 1) % UVC_FRAME_RING_SIZE;
+
+	return 0;
+}
+
+static int convert_slice(int index)
+{
+	uint64_t start = ksceKernelGetSystemTimeWide();
+	int ret;
+
+	/* Frames are converted in order, so this is a frame boundary */
+	if (uvc_frame_ring[index].converted == 0)
+		uvc_csc_update();
+
+	switch (uvc_commit_control_setting.bFormatIndex) {
+	case FORMAT_INDEX_UNCOMPRESSED_NV12:
+		ret = convert_slice_uncompressed(index);
+		if (ret < 0) {
+			LOG("Error converting NV12 frame: 0x%08X\n", ret);
+			return ret;
+		}
+		break;
+	case FORMAT_INDEX_UNCOMPRESSED_YUY2:
+		ret = convert_slice_uncompressed(index);
+		if (ret < 0) {
+			LOG("Error converting YUY2 frame: 0x%08X\n", ret);
+			return ret;
+		}
+		break;
+	case FORMAT_INDEX_UNCOMPRESSED_RGB32:
+		ret = convert_slice_uncompressed(index);
+		if (ret < 0) {
+			LOG("Error converting RGB32 frame: 0x%08X\n", ret);
+			return ret;
+		}
+		break;
+	case FORMAT_INDEX_MJPEG:
+		ret = convert_slice_mjpeg(index);
+		if (ret < 0) {
+			LOG("Error converting MJPEG frame: 0x%08X\n", ret);
+			return ret;
+		}
+		break;
+	}
+
+	uvc_stat_add(&uvc_stats.csc, ksceKernelGetSystemTimeWide() - start);
+
+	return 0;
+}
+
+/*
+ * Data of a payload, without the header.
+ */
+static unsigned char *uvc_stream_payload_data(int index, unsigned int payload,
+					      unsigned int *size)
+{
+	const struct uvc_frame_layout *layout = &uvc_frame_layout;
+
+	*size = (layout->compressed ? uvc_frame_ring[index].payload_size :
+				      layout->payload_size[payload]) -
+		UVC_PAYLOAD_HEADER_SIZE;
+
+	return uvc_frame_payload(uvc_frame_ring[index].addr, layout, payload);
+}
+
+/*
+ * Bulk payloads are submitted whole, isochronous ones a chunk at a time.
+ */
+static int send_payload(int index)
+{
+	int ret, eof;
+	struct uvc_xfer *xfer = &uvc_xfers[uvc_xfer_submitted % UVC_XFER_DEPTH];
+	unsigned int payload = uvc_frame_ring[index].sent;
+	unsigned int offset = uvc_frame_ring[index].sent_offset;
+	unsigned int size, max;
+	unsigned char *data;
+
+	data = uvc_stream_payload_data(index, payload, &size);
+	eof = payload == uvc_frame_ring[index].num_payloads - 1;
 
-	if (fid)
-		frame->header[1] |= UVC_STREAM_FID;
-	if (eof)
-		frame->header[1] |= UVC_STREAM_EOF;
+	/*
+	 * Frames dropped before anything was sent don't toggle the FID,
+	 * otherwise the host would merge the frames around them.
+	 */
+	if (payload == 0 && offset == 0)
+		uvc_frame_ring[index].fid = uvc_stream.fid;
+
+	xfer->index = index;
+	xfer->payload = payload;
+	xfer->submit_time = ksceKernelGetSystemTimeWide();
+
+	if (UVC_ISOC) {
+		max = UVC_ISOC_CHUNK_PACKETS * (uvc_isoc.packet_size - UVC_PAYLOAD_HEADER_SIZE);
+		xfer->size = (size - offset < max) ? size - offset : max;
+		xfer->last = offset + xfer->size == size;
+
+		ret = uvc_frame_transfer_isoc(xfer, data + offset, xfer->size,
+					      uvc_frame_ring[index].fid,
+					      eof && xfer->last,
+					      uvc_frame_ring[index].capture_time);
+	} else {
+		xfer->size = size;
+		xfer->last = 1;
 
-	ret = uvc_frame_req_submit_phycont(frame->header, frame_size);
+		ret = uvc_frame_transfer(xfer, data, size,
+					 uvc_frame_ring[index].fid, eof,
+					 uvc_frame_ring[index].capture_time);
+	}
 	if (ret < 0) {
-		LOG("Error sending frame: 0x%08X\n", ret);
+		uvc_stats.xfer_errors++;
 		return ret;
 	}
 
-	return 0;
-}
+	uvc_xfer_submitted++;
 
-int uvc_start(void);
-int uvc_stop(void);
+	if (payload == 0 && offset == 0)
+		uvc_stream.fid ^= 1;
 
-static inline unsigned int display_to_iftu_pixelformat(unsigned int fmt)
-{
-	switch (fmt) {
-	case SCE_DISPLAY_PIXELFORMAT_A8B8G8R8:
-	default:
-		return SCE_IFTU_PIXELFORMAT_BGRX8888;
-	case SCE_DISPLAY_PIXELFORMAT_BGRA5551:
-		return SCE_IFTU_PIXELFORMAT_BGRA5551;
+	if (xfer->last) {
+		uvc_frame_ring[index].sent++;
+		uvc_frame_ring[index].sent_offset = 0;
+	} else {
+		uvc_frame_ring[index].sent_offset += xfer->size;
 	}
-}
 
-static inline unsigned int display_pixelformat_bpp(unsigned int fmt)
-{
-	switch (fmt) {
-	case SCE_DISPLAY_PIXELFORMAT_A8B8G8R8:
-	default:
-		return 4;
-	case SCE_DISPLAY_PIXELFORMAT_BGRA5551:
-		return 2;
-	}
+	return 0;
 }
 
-static int frame_convert_to_nv12(int fid, const SceDisplayFrameBufInfo *fb_info,
-					int dst_width, int dst_height)
+/*
+ * Retires the completed payloads, oldest first. Once the stream is stopped
+ * the endpoint has been cancelled and everything in flight is retired, as
+ * cancelled requests may never complete.
+ */
+static void uvc_stream_xfer_done(void)
 {
-	uintptr_t dst_paddr;
-	uintptr_t src_paddr = fb_info->paddr;
-	unsigned int src_width = fb_info->framebuf.width;
-	unsigned int src_width_aligned = ALIGN(src_width, 16);
-	unsigned int src_pitch = fb_info->framebuf.pitch;
-	unsigned int src_height = fb_info->framebuf.height;
-	unsigned int src_pixelfmt = fb_info->framebuf.pixelformat;
-	unsigned int src_pixelfmt_bpp = display_pixelformat_bpp(src_pixelfmt);
-	unsigned char *uvc_frame_data = uvc_frame_buffer_addr->data;
-
-	static SceIftuCscParams RGB_to_YCbCr_JPEG_csc_params = {
-		0, 0x202, 0x3FF,
-		0, 0x3FF,     0,
-		{
-			{ 0x99, 0x12C,  0x3A},
-			{0xFAA, 0xF57, 0x100},
-			{0x100, 0xF2A, 0xFD7}
+	struct uvc_xfer *xfer;
+	uint64_t now, start;
+
+	while (uvc_xfer_in_flight() > 0) {
+		xfer = &uvc_xfers[uvc_xfer_retired % UVC_XFER_DEPTH];
+		if (!xfer->done && stream)
+			break;
+
+		/* Time on the wire, not spent queued behind the previous one */
+		now = ksceKernelGetSystemTimeWide();
+		start = (xfer->submit_time > uvc_xfer_last_done) ?
+			xfer->submit_time : uvc_xfer_last_done;
+		uvc_xfer_last_done = now;
+
+		if (xfer->done > 0) {
+			LOG("xfer payload %d: %lldus\n", xfer->payload, now - start);
+			uvc_stat_add(&uvc_stats.xfer, now - start);
+			uvc_stream.stalled = 0;
+			uvc_stream.errors = 0;
 		}
-	};
 
-	ksceKernelGetPaddr(uvc_frame_data, &dst_paddr);
+		uvc_xfer_retired++;
 
-	SceIftuConvParams params;
-	memset(&params, 0, sizeof(params));
-	params.size = sizeof(params);
-	params.unk04 = 0;
-	params.csc_params1 = &RGB_to_YCbCr_JPEG_csc_params;
-	params.csc_params2 = NULL;
-	params.csc_control = 1;
-	params.unk14 = 0;
-	params.unk18 = 0;
-	params.unk1C = 0;
-	params.alpha = 0xFF;
-	params.unk24 = 0;
+		if (xfer->last &&
+		    ++uvc_frame_ring[xfer->index].done == uvc_frame_ring[xfer->index].num_payloads &&
+		    xfer->index == uvc_stream.cur) {
+			if (!uvc_frame_ring[xfer->index].dropped)
+				uvc_stats.frames_sent++;
+			uvc_stream.cur = uvc_stream.next;
+			uvc_stream.next = -1;
+		}
+	}
+}
 
-	SceIftuPlaneState_updated src;
-	memset(&src, 0, sizeof(src));
-	src.fb.pixelformat = display_to_iftu_pixelformat(src_pixelfmt);
-	src.fb.width = src_width_aligned;
-	src.fb.height = src_height;
-	src.fb.leftover_stride = (src_pitch - src_width_aligned) * src_pixelfmt_bpp;
-	src.fb.leftover_align = 0;
-	src.fb.paddr0 = src_paddr;
-	src.unk20 = 0;
-	src.unk24 = 0;
-	src.unk28 = 0;
-	src.src_w = (src_width * 0x10000) / dst_width;
-	src.src_h = (src_height * 0x10000) / dst_height;
-	src.dst_x = 245760/512 - src_width/512;
-	src.dst_y = 139264/512 - src_height/512;
-	src.src_x = 0;
-	src.src_y = 0;
-	src.crop_top = 0;
-	src.crop_bot = 0;
-	src.crop_left = 0;
-	src.crop_right = 0;
+/*
+ * Returns the ring index that has a converted payload left to submit:
+ * cur, or next once all of cur has been submitted.
+ */
+static int uvc_stream_get_unsent(void)
+{
+	int index = uvc_stream.cur;
 
-	SceIftuFrameBuf dst;
-	memset(&dst, 0, sizeof(dst));
-	dst.pixelformat = SCE_IFTU_PIXELFORMAT_NV12;
-	dst.width = dst_width;
-	dst.height = dst_height;
-	dst.leftover_stride = 0;
-	dst.leftover_align = 0;
-	dst.paddr0 = dst_paddr;
-	dst.paddr1 = dst_paddr + dst_width * dst_height;
+	if (index < 0)
+		return -1;
+	if (uvc_frame_ring[index].sent < uvc_frame_ring[index].converted)
+		return index;
+	if (uvc_frame_ring[index].sent < uvc_frame_ring[index].num_payloads)
+		return -1;
 
-	return ksceIftuCsc(&dst, (SceIftuPlaneState *)&src, &params);
+	index = uvc_stream.next;
+	if (index >= 0 && uvc_frame_ring[index].sent < uvc_frame_ring[index].converted)
+		return index;
+
+	return -1;
 }
 
-static int convert_and_send_frame_nv12(int fid, const SceDisplayFrameBufInfo *fb_info,
-					int dst_width, int dst_height)
+/*
+ * Returns the ring index that has a slice left to convert, cur first.
+ */
+static int uvc_stream_get_unconverted(void)
 {
-	int ret;
-	uint64_t time1, time2, time3;
-	UNUSED(time1);
-	UNUSED(time2);
-	UNUSED(time3);
+	if (uvc_stream.cur >= 0 &&
+	    uvc_frame_ring[uvc_stream.cur].converted < uvc_frame_ring[uvc_stream.cur].num_payloads)
+		return uvc_stream.cur;
+	if (uvc_stream.next >= 0 &&
+	    uvc_frame_ring[uvc_stream.next].converted < uvc_frame_ring[uvc_stream.next].num_payloads)
+		return uvc_stream.next;
+
+	return -1;
+}
 
-	time1 = ksceKernelGetSystemTimeWide();
+/*
+ * Stops the stream for the watchdog to restart it later, unless it has
+ * been restarted too many times already.
+ */
+static void uvc_stream_stall(uint64_t now)
+{
+	if (!uvc_stream.stalled)
+		uvc_stats.stalls++;
 
-	ret = frame_convert_to_nv12(fid, fb_info, dst_width, dst_height);
-	if (ret < 0)
-		return ret;
+	uvc_handle_video_abort();
+	uvc_stream.errors = 0;
 
-	time2 = ksceKernelGetSystemTimeWide();
+	if (uvc_stream.restarts >= UVC_WATCHDOG_MAX_RESTARTS) {
+		LOG("Giving up on the stalled stream\n");
+		return;
+	}
 
-	ret = uvc_frame_transfer(uvc_frame_buffer_addr,
-				 UVC_PAYLOAD_SIZE(VIDEO_FRAME_SIZE_NV12(dst_width, dst_height)),
-				 fid, 1);
-	if (ret < 0)
-		return ret;
+	uvc_stream.stalled = 1;
+	uvc_stream.stall_time = now;
+}
 
-	time3 = ksceKernelGetSystemTimeWide();
-	LOG("NV12 CSC: %lldus xfer: %lldus\n", time2 - time1, time3 - time2);
+/*
+ * A frame failed to capture (index < 0), convert or send: it's dropped and
+ * the stream goes on. What was submitted of it still completes, the rest
+ * is never sent, and the host throws the truncated frame away when the
+ * next one toggles the FID.
+ */
+static void uvc_stream_error(int index)
+{
+	uvc_stats.frames_dropped++;
+
+	if (index >= 0) {
+		/* Payloads submitted in part never complete */
+		uvc_frame_ring[index].dropped = 1;
+		uvc_frame_ring[index].num_payloads = uvc_frame_ring[index].sent;
+		uvc_frame_ring[index].converted = uvc_frame_ring[index].sent;
+		uvc_frame_ring[index].sent_offset = 0;
+
+		if (index == uvc_stream.last)
+			uvc_stream.last = -1;
+
+		/* Otherwise uvc_stream_xfer_done() moves on once it's done */
+		if (uvc_frame_ring[index].done == uvc_frame_ring[index].num_payloads) {
+			if (index == uvc_stream.cur) {
+				uvc_stream.cur = uvc_stream.next;
+				uvc_stream.next = -1;
+			} else if (index == uvc_stream.next) {
+				uvc_stream.next = -1;
+			}
+		}
+	}
 
-	return 0;
+	if (++uvc_stream.errors >= UVC_STREAM_MAX_ERRORS) {
+		LOG("Too many errors in a row, stopping the stream\n");
+		uvc_stream_stall(ksceKernelGetSystemTimeWide());
+	}
 }
 
-static int send_frame(void)
+static void uvc_stream_process(unsigned int events)
 {
-	static int fid = 0;
+	int ret, index;
+	unsigned int out_bits;
 
-	int ret;
-	SceDisplayFrameBufInfo fb_info;
-	int head = ksceDisplayGetPrimaryHead();
+	if (events & UVC_EVENT_XFER_DONE)
+		uvc_stream_xfer_done();
 
-	memset(&fb_info, 0, sizeof(fb_info));
-	fb_info.size = sizeof(fb_info);
-	ret = ksceDisplayGetProcFrameBufInternal(-1, head, 0, &fb_info);
-	if (ret < 0 || fb_info.paddr == 0)
-		ret = ksceDisplayGetProcFrameBufInternal(-1, head, 1, &fb_info);
-	if (ret < 0)
-		return ret;
+	if (!stream)
+		goto stop;
 
-	switch (uvc_probe_control_setting.bFormatIndex) {
-	case FORMAT_INDEX_UNCOMPRESSED_NV12: {
-		const struct UVC_FRAME_UNCOMPRESSED(2) *frames =
-			video_streaming_descriptors.frames_uncompressed_nv12;
-		int cur_frame_index = uvc_probe_control_setting.bFrameIndex;
-		int dst_width = frames[cur_frame_index - 1].wWidth;
-		int dst_height = frames[cur_frame_index - 1].wHeight;
+	if (events & UVC_EVENT_FRAME) {
+		/* Folded into the capture that's already waiting */
+		if (uvc_stream.capture_pending)
+			uvc_stats.frames_skipped++;
 
-		static int last_frame_index = 0;
-		if (uvc_frame_buffer_uid < 0 || cur_frame_index != last_frame_index) {
-			uvc_frame_term();
-			ret = uvc_frame_init(UVC_FRAME_PADDING_SIZE + VIDEO_FRAME_SIZE_NV12(dst_width, dst_height));
+		ret = capture_frame();
+		if (ret < 0) {
+			LOG("Error capturing frame: 0x%08X\n", ret);
+			uvc_stream_error(-1);
+		}
+	}
+
+	for (;;) {
+		/*
+		 * Pick up completions that happened while converting.
+		 */
+		if (uvc_xfer_in_flight() > 0 &&
+		    ksceKernelPollEventFlag(uvc_event_flag_id, UVC_EVENT_XFER_DONE,
+					    SCE_EVENT_WAITOR | SCE_EVENT_WAITCLEAR_PAT,
+					    &out_bits) == 0)
+			uvc_stream_xfer_done();
+
+		if (!stream)
+			goto stop;
+
+		if (uvc_stream.capture_pending && uvc_frame_ring_get_free() >= 0) {
+			ret = capture_frame();
 			if (ret < 0) {
-				LOG("Error allocating the UVC frame (0x%08X)\n", ret);
-				return ret;
-			} else {
-				last_frame_index = cur_frame_index;
+				LOG("Error capturing frame: 0x%08X\n", ret);
+				uvc_stream_error(-1);
 			}
+			continue;
 		}
 
-		ret = convert_and_send_frame_nv12(fid, &fb_info, dst_width, dst_height);
-		if (ret < 0) {
-			LOG("Error sending NV12 frame: 0x%08X\n", ret);
-			return ret;
+		/* Isochronous streams wait for the host to select the bandwidth */
+		index = uvc_stream_get_unsent();
+		if (index >= 0 && uvc_xfer_in_flight() < UVC_XFER_DEPTH &&
+		    (!UVC_ISOC || uvc_isoc.packet_size > 0)) {
+			ret = send_payload(index);
+			if (ret < 0) {
+				LOG("Error sending frame: 0x%08X\n", ret);
+				uvc_stream_error(index);
+			}
+			continue;
+		}
+
+		index = uvc_stream_get_unconverted();
+		if (index >= 0) {
+			uvc_stream.state = UVC_STREAM_STATE_CONVERTING;
+			ret = convert_slice(index);
+			if (ret < 0)
+				uvc_stream_error(index);
+			continue;
 		}
 
 		break;
 	}
+
+	uvc_stream.state = uvc_xfer_in_flight() > 0 ?
+		UVC_STREAM_STATE_IN_FLIGHT : UVC_STREAM_STATE_IDLE;
+
+	return;
+
+stop:
+	/* The endpoint has been cancelled: nothing is left in flight */
+	uvc_stream_xfer_done();
+	uvc_stream.cur = -1;
+	uvc_stream.next = -1;
+	uvc_stream.capture_pending = 0;
+	uvc_stream.state = UVC_STREAM_STATE_IDLE;
+}
+
+/*
+ * The oldest payload in flight gets UVC_WATCHDOG_FRAMES frame intervals,
+ * counted from when the controller could start sending it. Hosts poll the
+ * bulk endpoint late now and then, which shouldn't restart the stream.
+ */
+static uint64_t uvc_xfer_deadline(void)
+{
+	const struct uvc_xfer *xfer = &uvc_xfers[uvc_xfer_retired % UVC_XFER_DEPTH];
+	uint64_t interval = uvc_commit_control_setting.dwFrameInterval / 10;
+	uint64_t start = (xfer->submit_time > uvc_xfer_last_done) ?
+			 xfer->submit_time : uvc_xfer_last_done;
+
+	return start + UVC_WATCHDOG_FRAMES * interval;
+}
+
+static uint64_t uvc_stream_restart_time(void)
+{
+	return uvc_stream.stall_time +
+	       ((uint64_t)UVC_WATCHDOG_RETRY_INTERVAL << uvc_stream.restarts);
+}
+
+static void uvc_stream_watchdog(uint64_t now)
+{
+	if (stream && uvc_xfer_in_flight() > 0 && now >= uvc_xfer_deadline()) {
+		LOG("Bulk transfer timed out\n");
+		uvc_stream_stall(now);
+	} else if (!stream && uvc_stream.stalled && now >= uvc_stream_restart_time()) {
+		LOG("Restarting the stalled stream\n");
+
+		uvc_stream.restarts++;
+		stream = 1;
+		ksceKernelSetEventFlag(uvc_event_flag_id, UVC_EVENT_FRAME);
 	}
+}
 
-	if (ret < 0) {
-		stream = 0;
-		return ret;
+/*
+ * How long uvc_thread can block before the watchdog has to run again, in
+ * microseconds.
+ */
+static unsigned int uvc_stream_wait_timeout(uint64_t now)
+{
+	uint64_t deadline;
+
+	if (stream && uvc_xfer_in_flight() > 0)
+		deadline = uvc_xfer_deadline();
+	else if (!stream && uvc_stream.stalled)
+		deadline = uvc_stream_restart_time();
+	else
+		return 1000 * 1000;
+
+	if (deadline <= now)
+		return 1;
+	if (deadline - now > 1000 * 1000)
+		return 1000 * 1000;
+
+	return deadline - now;
+}
+
+static struct uvc_pacer uvc_pacer;
+
+/*
+ * Returns 1 if a frame has to be captured now (in microseconds).
+ */
+static int uvc_pacer_frame_due(uint64_t now)
+{
+	unsigned int interval = uvc_commit_control_setting.dwFrameInterval;
+
+	if (!stream) {
+		uvc_pacer.running = 0;
+		return 0;
 	}
 
-	fid ^= 1;
+	if (!uvc_pacer.running || interval != uvc_pacer.interval)
+		uvc_pacer_reset(&uvc_pacer, interval);
 
-	return 0;
+	return uvc_pacer_tick(&uvc_pacer, now * 10);
 }
 
 static int display_vblank_cb_func(int notifyId, int notifyCount, int notifyArg, void *common)
 {
-	static unsigned int frames = 0;
-	unsigned int elapsed;
+	uint64_t now = ksceKernelGetSystemTimeWide();
 
 	/*LOG("VBlank: %d, %d, %d, %p\n", notifyId, notifyCount, notifyArg, common);*/
 
-	if (!stream)
-		return 0;
+	uvc_stats.vblanks++;
 
-	/*
-	 * VBlanks occur at ~60FPS.
-	 */
-	frames += notifyCount;
-	elapsed = FPS_TO_INTERVAL(60 / frames);
+	if (UVC_FLIP_CAPTURE && stream && now - uvc_flip_time < UVC_FLIP_TIMEOUT)
+		return 0;
 
-	if (elapsed >= uvc_probe_control_setting.dwFrameInterval) {
-		ksceKernelSetEventFlag(uvc_event_flag_id, 1);
-		frames = 0;
-	}
+	if (uvc_pacer_frame_due(now))
+		ksceKernelSetEventFlag(uvc_event_flag_id, UVC_EVENT_FRAME);
 
 	return 0;
 }
@@ -761,17 +2944,6 @@ static int display_vblank_cb_func(int notifyId, int notifyCount, int notifyArg,
 static int uvc_thread(SceSize args, void *argp)
 {
 	SceUID display_vblank_cb_uid;
-#if 0
-	/*
-	 * Wait until the MTP driver starts to takeover.
-	 */
-	SceUdcdWaitParam wait_param;
-	memset(&wait_param, 0, sizeof(wait_param));
-	wait_param.status = SCE_UDCD_STATUS_ACTIVATED;
-	wait_param.driverName = "USB_MTP_Driver";
-	ksceUdcdWaitState(&wait_param, 0);
-	ksceKernelDelayThread(250 * 1000);
-#endif
 
 	stream = 0;
 	uvc_start();
@@ -782,16 +2954,31 @@ static int uvc_thread(SceSize args, void *argp)
 	ksceDisplayRegisterVblankStartCallback(display_vblank_cb_uid);
 
 	while (uvc_thread_run) {
-		unsigned int out_bits;
+		unsigned int out_bits = 0;
 
-		int ret = ksceKernelWaitEventFlagCB(uvc_event_flag_id, 1,
-			SCE_EVENT_WAITOR | SCE_EVENT_WAITCLEAR_PAT,
-			&out_bits, (SceUInt32[]){1000000});
+		SceUInt32 timeout = uvc_stream_wait_timeout(ksceKernelGetSystemTimeWide());
 
-		if (ret == 0 && stream)
-			send_frame();
-		else if (ret == 0x80028005) /* SCE_KERNEL_ERROR_WAIT_TIMEOUT */
+		int ret = ksceKernelWaitEventFlagCB(uvc_event_flag_id,
+			UVC_EVENT_FRAME | UVC_EVENT_XFER_DONE | UVC_EVENT_FLIP,
+			SCE_EVENT_WAITOR | SCE_EVENT_WAITCLEAR_PAT,
+			&out_bits, &timeout);
+
+		/* Paced here so that the pacer is only used by this thread */
+		if (ret == 0 && (out_bits & UVC_EVENT_FLIP) &&
+		    uvc_pacer_frame_due(ksceKernelGetSystemTimeWide()))
+			out_bits |= UVC_EVENT_FRAME;
+
+		if (ret == 0)
+			uvc_stream_process(out_bits);
+		else if (ret == 0x80028005 && /* SCE_KERNEL_ERROR_WAIT_TIMEOUT */
+			 uvc_stream.state == UVC_STREAM_STATE_IDLE &&
+			 uvc_frame_ring[0].uid >= 0 &&
+			 ksceKernelGetSystemTimeWide() - uvc_frame_pool_last_use >=
+			 UVC_FRAME_POOL_RELEASE_DELAY)
 			uvc_frame_term();
+
+		/* Vblank ticks keep the wait from ever timing out while streaming */
+		uvc_stream_watchdog(ksceKernelGetSystemTimeWide());
 	}
 
 	ksceDisplayUnregisterVblankStartCallback(display_vblank_cb_uid);
@@ -802,16 +2989,16 @@ static int uvc_thread(SceSize args, void *argp)
 	return 0;
 }
 
-static int uvc_frame_init(unsigned int size)
+static int uvc_frame_alloc(unsigned int size, unsigned int placement,
+			   SceUID *uid, unsigned char **addr)
 {
 	int ret;
 
-	const int use_cdram = 0;
 	SceKernelAllocMemBlockKernelOpt opt;
 	SceKernelMemBlockType type;
 	SceKernelAllocMemBlockKernelOpt *optp;
 
-	if (use_cdram) {
+	if (placement == FRAME_PLACEMENT_CDRAM) {
 		type = 0x40408006;
 		size = ALIGN(size, 256 * 1024);
 		optp = NULL;
@@ -826,33 +3013,165 @@ static int uvc_frame_init(unsigned int size)
 		optp = &opt;
 	}
 
-	uvc_frame_buffer_uid = ksceKernelAllocMemBlock("uvc_frame_buffer", type, size, optp);
-	if (uvc_frame_buffer_uid < 0) {
-		LOG("Error allocating CSC dest memory: 0x%08X\n", uvc_frame_buffer_uid);
-		return uvc_frame_buffer_uid;
+	*uid = ksceKernelAllocMemBlock("uvc_frame_buffer", type, size, optp);
+	if (*uid < 0) {
+		LOG("Error allocating CSC dest memory: 0x%08X\n", *uid);
+		return *uid;
 	}
 
-	ret = ksceKernelGetMemBlockBase(uvc_frame_buffer_uid, (void **)&uvc_frame_buffer_addr);
+	ret = ksceKernelGetMemBlockBase(*uid, (void **)addr);
 	if (ret < 0) {
 		LOG("Error getting CSC desr memory addr: 0x%08X\n", ret);
-		ksceKernelFreeMemBlock(uvc_frame_buffer_uid);
-		uvc_frame_buffer_uid = -1;
+		ksceKernelFreeMemBlock(*uid);
+		*uid = -1;
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Resolves FRAME_PLACEMENT_AUTO for a ring of size bytes per buffer.
+ */
+static unsigned int uvc_frame_placement_resolve(unsigned int placement,
+						unsigned int size)
+{
+	SceKernelFreeMemorySizeInfo info;
+
+	if (placement != FRAME_PLACEMENT_AUTO)
+		return placement;
+
+	memset(&info, 0, sizeof(info));
+	info.size = sizeof(info);
+	if (ksceKernelGetFreeMemorySize(&info) < 0)
+		return FRAME_PLACEMENT_PHYCONT;
+
+	if (info.size_cdram >= UVC_FRAME_RING_SIZE * ALIGN(size, 256 * 1024) +
+			       UVC_FRAME_CDRAM_RESERVE)
+		return FRAME_PLACEMENT_CDRAM;
+
+	return FRAME_PLACEMENT_PHYCONT;
+}
+
+static int uvc_frame_ring_alloc(unsigned int size, unsigned int placement)
+{
+	int i, ret;
+
+	for (i = 0; i < UVC_FRAME_RING_SIZE; i++) {
+		ret = uvc_frame_alloc(size, placement, &uvc_frame_ring[i].uid,
+				      &uvc_frame_ring[i].addr);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int uvc_frame_init(unsigned int size)
+{
+	unsigned int memory;
+	int ret;
+
+	if (uvc_frame_ring[0].uid >= 0 && size <= uvc_frame_pool_size &&
+	    uvc_frame_pool_placement == uvc_frame_placement)
+		return 0;
+
+	uvc_frame_term();
+
+	memory = uvc_frame_placement_resolve(uvc_frame_placement, size);
+
+	LOG("Allocating UVC frame pool: %d x %d bytes in %s\n", UVC_FRAME_RING_SIZE, size,
+	    memory == FRAME_PLACEMENT_CDRAM ? "CDRAM" : "main RAM");
+
+	ret = uvc_frame_ring_alloc(size, memory);
+	if (ret < 0 && memory == FRAME_PLACEMENT_CDRAM &&
+	    uvc_frame_placement == FRAME_PLACEMENT_AUTO) {
+		/* Taken since it was checked */
+		uvc_frame_term();
+		memory = FRAME_PLACEMENT_PHYCONT;
+		ret = uvc_frame_ring_alloc(size, memory);
+	}
+	if (ret < 0) {
+		uvc_frame_term();
 		return ret;
 	}
 
+	/* Written by the CPU, stays in main RAM */
+	if (UVC_ISOC) {
+		ret = uvc_frame_alloc(UVC_XFER_DEPTH * UVC_ISOC_CHUNK_SIZE,
+				      FRAME_PLACEMENT_PHYCONT,
+				      &uvc_isoc.staging_uid, &uvc_isoc.staging);
+		if (ret < 0) {
+			uvc_frame_term();
+			return ret;
+		}
+	}
+
+	uvc_frame_ring_index = 0;
+	uvc_frame_pool_size = size;
+	uvc_frame_pool_placement = uvc_frame_placement;
+	uvc_frame_pool_memory = memory;
+	uvc_stats.reallocations++;
+
 	return 0;
 }
 
 static int uvc_frame_term()
 {
-	if (uvc_frame_buffer_uid >= 0) {
-		ksceKernelFreeMemBlock(uvc_frame_buffer_uid);
-		uvc_frame_buffer_uid = -1;
+	int i;
+
+	for (i = 0; i < UVC_FRAME_RING_SIZE; i++) {
+		if (uvc_frame_ring[i].uid >= 0) {
+			ksceKernelFreeMemBlock(uvc_frame_ring[i].uid);
+			uvc_frame_ring[i].uid = -1;
+		}
+	}
+
+	uvc_frame_pool_size = 0;
+	uvc_stream_plan.format_index = 0;
+
+	if (uvc_isoc.staging_uid >= 0) {
+		ksceKernelFreeMemBlock(uvc_isoc.staging_uid);
+		uvc_isoc.staging_uid = -1;
 	}
 
+	mjpeg_term();
+	worker_pool_term();
+
 	return 0;
 }
 
+/*
+ * The shell activates the MTP driver once it's up, which would stop ours:
+ * the device is only started after that. It gives up after
+ * UVC_STARTUP_TIMEOUT microseconds, in case the shell never does.
+ */
+#ifndef UVC_STARTUP_TIMEOUT
+#define UVC_STARTUP_TIMEOUT	(15 * 1000 * 1000)
+#endif
+#define UVC_STARTUP_SETTLE	(250 * 1000)
+
+#ifndef DEBUG
+static void uvc_wait_shell_usb(void)
+{
+	SceUdcdWaitParam wait_param;
+	int ret;
+
+	memset(&wait_param, 0, sizeof(wait_param));
+	wait_param.status = SCE_UDCD_STATUS_ACTIVATED;
+	wait_param.driverName = "USB_MTP_Driver";
+
+	ret = ksceUdcdWaitState(&wait_param, UVC_STARTUP_TIMEOUT);
+	if (ret < 0) {
+		LOG("USB_MTP_Driver not activated (0x%08X), starting anyway\n", ret);
+		return;
+	}
+
+	/* Let the shell finish with it before taking over */
+	ksceKernelDelayThreadCB(UVC_STARTUP_SETTLE);
+}
+#endif
+
 int uvc_start(void)
 {
 	int ret;
@@ -863,10 +3182,7 @@ int uvc_start(void)
 	ksceDisplayWaitSetFrameBufCB();
 
 #ifndef DEBUG
-	/*
-	 * Wait until LiveArea is more or less ready.
-	 */
-	ksceKernelDelayThreadCB(15 * 1000 * 1000);
+	uvc_wait_shell_usb();
 #endif
 
 	ret = ksceUdcdDeactivate();
@@ -898,22 +3214,15 @@ int uvc_start(void)
 		goto err_activate;
 	}
 
-	ret = uvc_frame_req_init();
-	if (ret < 0) {
-		LOG("Error allocating USB request (0x%08X)\n", ret);
-		goto err_alloc_uvc_frame_req;
-	}
-
 	/*
 	 * Set the current streaming settings to the default ones.
 	 */
-	memcpy(&uvc_probe_control_setting, &uvc_probe_control_setting_default,
-	       sizeof(uvc_probe_control_setting));
+	uvc_streaming_negotiate(&uvc_probe_control_setting,
+				&uvc_probe_control_setting_default);
+	uvc_commit_control_setting = uvc_probe_control_setting;
 
 	return 0;
 
-err_alloc_uvc_frame_req:
-	ksceUdcdDeactivate();
 err_activate:
 	ksceUdcdStop(UVC_DRIVER_NAME, 0, NULL);
 err_start_uvc_driver:
@@ -966,6 +3275,32 @@ static int SceUdcd_sub_01E1128C_hook_func(const SceUdcdConfigDescriptor *config_
 	return ret;
 }
 
+#if UVC_FLIP_CAPTURE
+static SceUID ksceDisplaySetFrameBufInternal_hook_uid = -1;
+static tai_hook_ref_t ksceDisplaySetFrameBufInternal_ref;
+
+/*
+ * Also reached by sceDisplaySetFrameBuf() from userland, which ends up in
+ * the same function. A NULL framebuffer just blanks the screen.
+ */
+static int ksceDisplaySetFrameBufInternal_hook_func(int head, int index,
+						    const SceDisplayFrameBuf *pParam,
+						    int sync)
+{
+	int ret;
+
+	ret = TAI_CONTINUE(int, ksceDisplaySetFrameBufInternal_ref, head, index,
+			   pParam, sync);
+
+	if (ret >= 0 && stream && pParam && head == ksceDisplayGetPrimaryHead()) {
+		uvc_flip_time = ksceKernelGetSystemTimeWide();
+		ksceKernelSetEventFlag(uvc_event_flag_id, UVC_EVENT_FLIP);
+	}
+
+	return ret;
+}
+#endif
+
 void _start() __attribute__((weak, alias("module_start")));
 
 int module_start(SceSize argc, const void *args)
@@ -988,11 +3323,20 @@ int module_start(SceSize argc, const void *args)
 		&SceUdcd_sub_01E1128C_ref, SceUdcd_modinfo.modid, 0,
 		0x01E1128C - 0x01E10000, 1, SceUdcd_sub_01E1128C_hook_func);
 
+#if UVC_FLIP_CAPTURE
+	ksceDisplaySetFrameBufInternal_hook_uid = taiHookFunctionExportForKernel(KERNEL_PID,
+		&ksceDisplaySetFrameBufInternal_ref, "SceDisplay", TAI_ANY_LIBRARY,
+		0x16466675, ksceDisplaySetFrameBufInternal_hook_func);
+	if (ksceDisplaySetFrameBufInternal_hook_uid < 0)
+		LOG("Error hooking ksceDisplaySetFrameBufInternal (0x%08X)\n",
+		    ksceDisplaySetFrameBufInternal_hook_uid);
+#endif
+
 	uvc_thread_id = ksceKernelCreateThread("uvc_thread", uvc_thread,
 					       0x3C, 0x1000, 0, 0x10000, 0);
 	if (uvc_thread_id < 0) {
 		LOG("Error creating the UVC thread (0x%08X)\n", uvc_thread_id);
-		goto err_return;
+		goto err_release_hooks;
 	}
 
 	uvc_event_flag_id = ksceKernelCreateEventFlag("uvc_event_flag", 0,
@@ -1024,22 +3368,38 @@ err_delete_event_flag:
 	ksceKernelDeleteEventFlag(uvc_event_flag_id);
 err_destroy_thread:
 	ksceKernelDeleteThread(uvc_thread_id);
-err_return:
+err_release_hooks:
+#if UVC_FLIP_CAPTURE
+	if (ksceDisplaySetFrameBufInternal_hook_uid > 0) {
+		taiHookReleaseForKernel(ksceDisplaySetFrameBufInternal_hook_uid,
+			ksceDisplaySetFrameBufInternal_ref);
+	}
+#endif
+	if (SceUdcd_sub_01E1128C_hook_uid > 0) {
+		taiHookReleaseForKernel(SceUdcd_sub_01E1128C_hook_uid,
+			SceUdcd_sub_01E1128C_ref);
+	}
+
 	return SCE_KERNEL_START_FAILED;
 }
 
 int module_stop(SceSize argc, const void *args)
 {
+#if UVC_FLIP_CAPTURE
+	if (ksceDisplaySetFrameBufInternal_hook_uid > 0) {
+		taiHookReleaseForKernel(ksceDisplaySetFrameBufInternal_hook_uid,
+			ksceDisplaySetFrameBufInternal_ref);
+	}
+#endif
+
 	uvc_thread_run = 0;
 
-	ksceKernelSetEventFlag(uvc_event_flag_id, 1);
+	ksceKernelSetEventFlag(uvc_event_flag_id, UVC_EVENT_FRAME);
 	ksceKernelWaitThreadEnd(uvc_thread_id, NULL, NULL);
 
 	ksceKernelDeleteEventFlag(uvc_event_flag_id);
 	ksceKernelDeleteThread(uvc_thread_id);
 
-	uvc_frame_req_fini();
-
 	ksceUdcdDeactivate();
 	ksceUdcdStop(UVC_DRIVER_NAME, 0, NULL);
 	ksceUdcdStop("USBDeviceControllerDriver", 0, NULL);
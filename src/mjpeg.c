@@ -0,0 +1,251 @@
+#include <psp2kern/kernel/sysmem.h>
+#include <psp2kern/kernel/cpu.h>
+#include <string.h>
+#include "jpeg.h"
+#include "mjpeg.h"
+#include "worker.h"
+
+#define ALIGN(x, a)			(((x) + ((a) - 1)) & ~((a) - 1))
+
+#define MJPEG_NUM_WORKERS		WORKER_POOL_SIZE
+
+/*
+ * Leaves some headroom on a 480 Mbps bulk endpoint.
+ */
+#ifndef MJPEG_BYTE_RATE
+#define MJPEG_BYTE_RATE			(24 * 1024 * 1024)
+#endif
+
+#define MJPEG_QUALITY_DEFAULT		80
+#define MJPEG_QUALITY_MIN		20
+#define MJPEG_QUALITY_MAX		90
+
+static struct mjpeg_worker {
+	SceUID out_uid;
+	unsigned char *out;
+	unsigned int out_size;
+	unsigned int first_row;
+	unsigned int num_rows;
+	int size;			/* Bytes encoded, < 0 on overflow */
+} mjpeg_workers[MJPEG_NUM_WORKERS] = {
+	[0 ... MJPEG_NUM_WORKERS - 1] = {.out_uid = -1}
+};
+
+static struct {
+	struct jpeg_encoder enc;
+	struct jpeg_rate_control rc;
+	unsigned int quality;
+	unsigned int restart_interval;
+	SceUID nv12_uid;
+	unsigned char *nv12;
+	unsigned int nv12_size;
+} mjpeg = {
+	.nv12_uid	= -1,
+};
+
+static void mjpeg_encode_job(unsigned int i, void *arg)
+{
+	struct mjpeg_worker *worker = &mjpeg_workers[i];
+	const unsigned char *y = mjpeg.nv12;
+	const unsigned char *uv = mjpeg.nv12 + mjpeg.enc.width * mjpeg.enc.height;
+
+	worker->size = jpeg_encode_mcu_rows(&mjpeg.enc, y, uv,
+					    worker->first_row,
+					    worker->num_rows,
+					    worker->out,
+					    worker->out_size);
+}
+
+static int mjpeg_alloc(const char *name, SceKernelMemBlockType type,
+		       unsigned int size, int phycont,
+		       SceUID *uid, unsigned char **addr)
+{
+	int ret;
+	SceKernelAllocMemBlockKernelOpt opt;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.size = sizeof(opt);
+	if (phycont) {
+		opt.attr = SCE_KERNEL_ALLOC_MEMBLOCK_ATTR_PHYCONT |
+			   SCE_KERNEL_ALLOC_MEMBLOCK_ATTR_HAS_ALIGNMENT;
+		opt.alignment = 4 * 1024;
+	}
+
+	*uid = ksceKernelAllocMemBlock(name, type, ALIGN(size, 4 * 1024), &opt);
+	if (*uid < 0)
+		return *uid;
+
+	ret = ksceKernelGetMemBlockBase(*uid, (void **)addr);
+	if (ret < 0) {
+		ksceKernelFreeMemBlock(*uid);
+		*uid = -1;
+		return ret;
+	}
+
+	return 0;
+}
+
+static void mjpeg_free(SceUID *uid)
+{
+	if (*uid >= 0) {
+		ksceKernelFreeMemBlock(*uid);
+		*uid = -1;
+	}
+}
+
+/*
+ * Sets up the encoder for a new mode. The buffers are only reallocated
+ * if they don't fit.
+ */
+int mjpeg_init(unsigned int width, unsigned int height)
+{
+	unsigned int i, rows_per_worker, nv12_size, out_size;
+	int ret;
+
+	ret = worker_pool_init();
+	if (ret < 0)
+		return ret;
+
+	jpeg_encoder_init(&mjpeg.enc, width, height, MJPEG_QUALITY_DEFAULT);
+	mjpeg.quality = MJPEG_QUALITY_DEFAULT;
+	mjpeg.rc.quality_min = MJPEG_QUALITY_MIN;
+	mjpeg.rc.quality_max = MJPEG_QUALITY_MAX;
+
+	rows_per_worker = (mjpeg.enc.mcu_rows + MJPEG_NUM_WORKERS - 1) / MJPEG_NUM_WORKERS;
+	mjpeg.restart_interval = (MJPEG_NUM_WORKERS > 1) ?
+		rows_per_worker * mjpeg.enc.mcu_cols : 0;
+
+	/* The IFTU needs a physically contiguous destination */
+	nv12_size = width * height * 3 / 2;
+	if (nv12_size > mjpeg.nv12_size) {
+		mjpeg_free(&mjpeg.nv12_uid);
+		mjpeg.nv12_size = 0;
+
+		ret = mjpeg_alloc("mjpeg_nv12", 0x1020D006, nv12_size, 1,
+				  &mjpeg.nv12_uid, &mjpeg.nv12);
+		if (ret < 0)
+			return ret;
+
+		mjpeg.nv12_size = nv12_size;
+	}
+
+	/* A band never takes more than its uncompressed NV12 size */
+	out_size = mjpeg.enc.mcu_cols * JPEG_MCU_SIZE * JPEG_MCU_SIZE * 3 / 2 * rows_per_worker;
+
+	for (i = 0; i < MJPEG_NUM_WORKERS; i++) {
+		struct mjpeg_worker *worker = &mjpeg_workers[i];
+
+		worker->first_row = i * rows_per_worker;
+		worker->num_rows = rows_per_worker;
+
+		if (out_size > worker->out_size) {
+			mjpeg_free(&worker->out_uid);
+			worker->out_size = 0;
+
+			ret = mjpeg_alloc("mjpeg_out", 0x1020D006, out_size, 0,
+					  &worker->out_uid, &worker->out);
+			if (ret < 0)
+				return ret;
+
+			worker->out_size = out_size;
+		}
+	}
+
+	return 0;
+}
+
+void mjpeg_term(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < MJPEG_NUM_WORKERS; i++) {
+		mjpeg_free(&mjpeg_workers[i].out_uid);
+		mjpeg_workers[i].out_size = 0;
+	}
+
+	mjpeg_free(&mjpeg.nv12_uid);
+	mjpeg.nv12_size = 0;
+}
+
+void mjpeg_get_nv12(unsigned char **y, unsigned char **uv)
+{
+	*y = mjpeg.nv12;
+	*uv = mjpeg.nv12 + mjpeg.enc.width * mjpeg.enc.height;
+}
+
+static int mjpeg_encode_frame(unsigned char *dst, unsigned int dst_size)
+{
+	unsigned int i, size;
+	int ret;
+
+	ret = worker_pool_run(mjpeg_encode_job, NULL);
+	if (ret < 0)
+		return ret;
+
+	ret = jpeg_write_headers(&mjpeg.enc, dst, dst_size, mjpeg.restart_interval);
+	if (ret < 0)
+		return ret;
+
+	size = ret;
+
+	for (i = 0; i < MJPEG_NUM_WORKERS; i++) {
+		const struct mjpeg_worker *worker = &mjpeg_workers[i];
+
+		if (worker->first_row >= mjpeg.enc.mcu_rows)
+			break;
+		if (worker->size < 0)
+			return -1;
+		if (size + worker->size + 2 > dst_size)
+			return -1;
+
+		if (i > 0) {
+			dst[size++] = 0xFF;
+			dst[size++] = JPEG_MARKER_RST0 + ((i - 1) & 7);
+		}
+
+		memcpy(dst + size, worker->out, worker->size);
+		size += worker->size;
+	}
+
+	if (size + 2 > dst_size)
+		return -1;
+
+	dst[size++] = 0xFF;
+	dst[size++] = JPEG_MARKER_EOI;
+
+	return size;
+}
+
+int mjpeg_encode(unsigned char *dst, unsigned int dst_size,
+		 unsigned int frame_interval)
+{
+	int size;
+
+	if (mjpeg.nv12_uid < 0)
+		return -1;
+
+	/* Drop stale lines, the IFTU writes behind the cache's back */
+	ksceKernelDcacheInvalidateRange(mjpeg.nv12, mjpeg.nv12_size);
+
+	mjpeg.rc.budget = ((uint64_t)MJPEG_BYTE_RATE * frame_interval) / 10000000;
+	if (mjpeg.rc.budget == 0 || mjpeg.rc.budget > dst_size)
+		mjpeg.rc.budget = dst_size;
+
+	size = mjpeg_encode_frame(dst, dst_size);
+	if (size < 0 && mjpeg.quality > MJPEG_QUALITY_MIN) {
+		/* Didn't fit at all: retry right away at the lowest quality */
+		mjpeg.quality = MJPEG_QUALITY_MIN;
+		jpeg_encoder_set_quality(&mjpeg.enc, mjpeg.quality);
+		size = mjpeg_encode_frame(dst, dst_size);
+	}
+	if (size < 0)
+		return size;
+
+	ksceKernelDcacheCleanRange(dst, size);
+
+	mjpeg.quality = jpeg_rate_control_update(&mjpeg.rc, mjpeg.quality, size);
+	if (mjpeg.quality != mjpeg.enc.quality)
+		jpeg_encoder_set_quality(&mjpeg.enc, mjpeg.quality);
+
+	return size;
+}
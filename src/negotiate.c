@@ -0,0 +1,136 @@
+#include "negotiate.h"
+
+#define ALIGN(x, a)			(((x) + ((a) - 1)) & ~((a) - 1))
+#define NV12_SIZE(w, h)			(((w) * (h) * 3) / 2)
+
+void uvc_frame_layout_nv12(struct uvc_frame_layout *layout,
+			   unsigned int width, unsigned int height,
+			   unsigned int num_slices)
+{
+	unsigned int i, offset, rows;
+
+	/*
+	 * Band heights are kept even so that each band owns whole NV12
+	 * chroma rows, which also keeps every band 16B aligned.
+	 */
+	layout->width = width;
+	layout->height = height;
+	layout->compressed = 0;
+	layout->slice_height = ALIGN((height + num_slices - 1) / num_slices, 2);
+	layout->num_slices = (height + layout->slice_height - 1) / layout->slice_height;
+
+	offset = 0;
+	for (i = 0; i < layout->num_slices; i++) {
+		rows = height - i * layout->slice_height;
+		if (rows > layout->slice_height)
+			rows = layout->slice_height;
+
+		offset = ALIGN(offset, UVC_PAYLOAD_HEADER_SLOT) + UVC_PAYLOAD_HEADER_SLOT;
+		layout->offset[i] = offset;
+		layout->payload_size[i] = UVC_PAYLOAD_SIZE(width * rows);
+		offset += width * rows;
+	}
+
+	layout->uv_offset = offset;
+	layout->payload_size[layout->num_slices - 1] += width * height / 2;
+	layout->size = offset + width * height / 2;
+}
+
+/*
+ * The JPEG is written after the header slot. Its size is bounded by the
+ * uncompressed NV12 size.
+ */
+void uvc_frame_layout_mjpeg(struct uvc_frame_layout *layout,
+			    unsigned int width, unsigned int height)
+{
+	layout->width = width;
+	layout->height = height;
+	layout->compressed = 1;
+	layout->num_slices = 1;
+	layout->slice_height = height;
+	layout->uv_offset = 0;
+	layout->offset[0] = UVC_PAYLOAD_HEADER_SLOT;
+	layout->payload_size[0] = UVC_PAYLOAD_SIZE(NV12_SIZE(width, height));
+	layout->size = UVC_PAYLOAD_HEADER_SLOT + NV12_SIZE(width, height);
+}
+
+/*
+ * Packed formats (YUY2 and RGB32) with bpp bytes per pixel.
+ */
+void uvc_frame_layout_packed(struct uvc_frame_layout *layout,
+			     unsigned int width, unsigned int height,
+			     unsigned int bpp, unsigned int num_slices)
+{
+	unsigned int i, offset, rows;
+
+	layout->width = width;
+	layout->height = height;
+	layout->compressed = 0;
+	layout->slice_height = ALIGN((height + num_slices - 1) / num_slices, 2);
+	layout->num_slices = (height + layout->slice_height - 1) / layout->slice_height;
+
+	offset = 0;
+	for (i = 0; i < layout->num_slices; i++) {
+		rows = height - i * layout->slice_height;
+		if (rows > layout->slice_height)
+			rows = layout->slice_height;
+
+		offset = ALIGN(offset, UVC_PAYLOAD_HEADER_SLOT) + UVC_PAYLOAD_HEADER_SLOT;
+		layout->offset[i] = offset;
+		layout->payload_size[i] = UVC_PAYLOAD_SIZE(width * rows * bpp);
+		offset += width * rows * bpp;
+	}
+
+	layout->uv_offset = 0;
+	layout->size = offset;
+}
+
+void uvc_negotiate(struct uvc_streaming_control *ctrl,
+		   const struct uvc_streaming_control *req,
+		   const struct uvc_streaming_control *def,
+		   const struct uvc_negotiate_ops *ops)
+{
+	struct uvc_frame_layout layout;
+	struct uvc_mode mode;
+	unsigned int i, diff, best_diff, frame_size, payload_size;
+	unsigned int interval = req->dwFrameInterval;
+
+	*ctrl = *def;
+	ctrl->bmHint = req->bmHint;
+
+	if (ops->default_frame(req->bFormatIndex) != 0) {
+		ctrl->bFormatIndex = req->bFormatIndex;
+		ctrl->bFrameIndex = req->bFrameIndex;
+	}
+
+	if (ops->mode_get(ctrl->bFormatIndex, ctrl->bFrameIndex, &mode) < 0) {
+		ctrl->bFrameIndex = ops->default_frame(ctrl->bFormatIndex);
+		ops->mode_get(ctrl->bFormatIndex, ctrl->bFrameIndex, &mode);
+	}
+
+	ctrl->dwFrameInterval = mode.default_interval;
+	if (interval != 0) {
+		best_diff = ~0u;
+		for (i = 0; i < mode.num_intervals; i++) {
+			diff = (interval > mode.interval[i]) ?
+				interval - mode.interval[i] : mode.interval[i] - interval;
+			if (diff < best_diff) {
+				best_diff = diff;
+				ctrl->dwFrameInterval = mode.interval[i];
+			}
+		}
+	}
+
+	ops->mode_layout(ctrl->bFormatIndex, &mode, &layout);
+
+	frame_size = 0;
+	payload_size = 0;
+	for (i = 0; i < layout.num_slices; i++) {
+		frame_size += layout.payload_size[i] - UVC_PAYLOAD_HEADER_SIZE;
+		if (layout.payload_size[i] > payload_size)
+			payload_size = layout.payload_size[i];
+	}
+
+	ctrl->dwMaxVideoFrameSize = frame_size;
+	ctrl->dwMaxPayloadTransferSize = payload_size;
+}
@@ -0,0 +1,46 @@
+#include <string.h>
+#include "pacer.h"
+
+void uvc_pacer_reset(struct uvc_pacer *pacer, unsigned int interval)
+{
+	memset(pacer, 0, sizeof(*pacer));
+	pacer->interval = interval;
+	pacer->jitter_min = ~0u;
+}
+
+int uvc_pacer_tick(struct uvc_pacer *pacer, uint64_t now)
+{
+	unsigned int period, jitter;
+
+	if (!pacer->running) {
+		pacer->running = 1;
+		pacer->deadline = now + pacer->interval;
+		pacer->last_frame = now;
+		return 0;
+	}
+
+	if (now + PACER_VBLANK_INTERVAL / 2 < pacer->deadline)
+		return 0;
+
+	/*
+	 * Fell more than a frame behind (missed vblanks): resync instead of
+	 * bursting frames to catch up.
+	 */
+	if (now >= pacer->deadline + pacer->interval)
+		pacer->deadline = now + pacer->interval;
+	else
+		pacer->deadline += pacer->interval;
+
+	period = now - pacer->last_frame;
+	jitter = (period > pacer->interval) ? period - pacer->interval :
+					      pacer->interval - period;
+	if (jitter < pacer->jitter_min)
+		pacer->jitter_min = jitter;
+	if (jitter > pacer->jitter_max)
+		pacer->jitter_max = jitter;
+	pacer->jitter_total += jitter;
+	pacer->frames++;
+	pacer->last_frame = now;
+
+	return 1;
+}
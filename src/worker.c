@@ -0,0 +1,117 @@
+#include <psp2kern/kernel/threadmgr.h>
+#include "worker.h"
+
+#define WORKER_EVENT_START(i)		(1 << (i))
+#define WORKER_EVENT_DONE(i)		(1 << (8 + (i)))
+#define WORKER_EVENT_START_ALL		((1 << WORKER_POOL_SIZE) - 1)
+#define WORKER_EVENT_DONE_ALL		(WORKER_EVENT_START_ALL << 8)
+
+static SceUID worker_thread_ids[WORKER_POOL_SIZE] = {
+	[0 ... WORKER_POOL_SIZE - 1] = -1
+};
+
+static struct {
+	SceUID event_flag_id;
+	int run;
+	worker_job_t job;
+	void *arg;
+} worker_pool = {
+	.event_flag_id	= -1,
+};
+
+static int worker_thread(SceSize args, void *argp)
+{
+	unsigned int i = *(unsigned int *)argp;
+
+	for (;;) {
+		ksceKernelWaitEventFlag(worker_pool.event_flag_id, WORKER_EVENT_START(i),
+					SCE_EVENT_WAITOR | SCE_EVENT_WAITCLEAR_PAT,
+					NULL, NULL);
+		if (!worker_pool.run)
+			break;
+
+		worker_pool.job(i, worker_pool.arg);
+
+		ksceKernelSetEventFlag(worker_pool.event_flag_id, WORKER_EVENT_DONE(i));
+	}
+
+	return 0;
+}
+
+int worker_pool_init(void)
+{
+	unsigned int i;
+	int ret;
+
+	if (worker_pool.event_flag_id >= 0)
+		return 0;
+
+	worker_pool.event_flag_id = ksceKernelCreateEventFlag("worker_event_flag",
+							      SCE_EVENT_WAITMULTIPLE, 0, NULL);
+	if (worker_pool.event_flag_id < 0)
+		return worker_pool.event_flag_id;
+
+	worker_pool.run = 1;
+
+	for (i = 0; i < WORKER_POOL_SIZE; i++) {
+		worker_thread_ids[i] = ksceKernelCreateThread("worker_thread",
+			worker_thread, 0x3C, 0x2000, 0, 0x10000 << i, 0);
+		if (worker_thread_ids[i] < 0) {
+			ret = worker_thread_ids[i];
+			goto err;
+		}
+
+		ret = ksceKernelStartThread(worker_thread_ids[i], sizeof(i), &i);
+		if (ret < 0) {
+			ksceKernelDeleteThread(worker_thread_ids[i]);
+			worker_thread_ids[i] = -1;
+			goto err;
+		}
+	}
+
+	return 0;
+
+err:
+	worker_pool_term();
+	return ret;
+}
+
+void worker_pool_term(void)
+{
+	unsigned int i;
+
+	if (worker_pool.event_flag_id < 0)
+		return;
+
+	worker_pool.run = 0;
+	ksceKernelSetEventFlag(worker_pool.event_flag_id, WORKER_EVENT_START_ALL);
+
+	for (i = 0; i < WORKER_POOL_SIZE; i++) {
+		if (worker_thread_ids[i] >= 0) {
+			ksceKernelWaitThreadEnd(worker_thread_ids[i], NULL, NULL);
+			ksceKernelDeleteThread(worker_thread_ids[i]);
+			worker_thread_ids[i] = -1;
+		}
+	}
+
+	ksceKernelDeleteEventFlag(worker_pool.event_flag_id);
+	worker_pool.event_flag_id = -1;
+}
+
+int worker_pool_run(worker_job_t job, void *arg)
+{
+	int ret;
+
+	ret = worker_pool_init();
+	if (ret < 0)
+		return ret;
+
+	worker_pool.job = job;
+	worker_pool.arg = arg;
+
+	ksceKernelSetEventFlag(worker_pool.event_flag_id, WORKER_EVENT_START_ALL);
+
+	return ksceKernelWaitEventFlag(worker_pool.event_flag_id, WORKER_EVENT_DONE_ALL,
+				       SCE_EVENT_WAITAND | SCE_EVENT_WAITCLEAR_PAT,
+				       NULL, NULL);
+}
@@ -0,0 +1,422 @@
+/*
+ * Host test of the software color converter (src/csc.c).
+ *
+ * Checks csc_to_nv12(), csc_to_yuy2() and csc_to_bgrx() against a per-pixel
+ * model of the IFTU transform over random frames, scaled and unscaled, for
+ * every matrix and source format, and reports their speed at 960x544. The
+ * NEON build (cross-compiled with -mfpu=neon) has to match the same model,
+ * so passing on both shows the NEON and the scalar paths are bit-exact.
+ * The matrices and the picture adjustments are also checked against the
+ * same math in floating point.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "csc.h"
+
+#define BENCH_FRAMES	20
+
+#if defined(__ARM_NEON)
+#define IMPL		"NEON"
+#else
+#define IMPL		"Scalar"
+#endif
+
+struct image {
+	enum csc_src_format format;
+	unsigned int width;
+	unsigned int height;
+	void *pixels;
+};
+
+static const struct {
+	unsigned int src_width;
+	unsigned int src_height;
+	unsigned int dst_width;
+	unsigned int dst_height;
+} sizes[] = {
+	{960, 544, 960, 544},
+	{960, 544, 896, 504},
+	{960, 544, 480, 272},
+	{960, 544, 1280, 720},
+	{640, 368, 854, 480},
+	{100, 50, 38, 20},	/* Partial chunks */
+};
+
+static const struct {
+	const char *name;
+	const struct csc_matrix *base;
+	struct csc_adjust adjust;
+} matrices[] = {
+	{"BT.601 full", &csc_matrix_bt601_full, {0, 100, 100, 0}},
+	{"BT.601 limited", &csc_matrix_bt601_limited, {0, 100, 100, 0}},
+	{"BT.709 full", &csc_matrix_bt709_full, {0, 100, 100, 0}},
+	{"BT.709 limited", &csc_matrix_bt709_limited, {0, 100, 100, 0}},
+	{"BT.601 adjusted", &csc_matrix_bt601_full, {-20, 130, 150, 30}},
+	{"BT.709 adjusted", &csc_matrix_bt709_limited, {40, 70, 0, -120}},
+};
+
+/* Luma weights of the matrices above, and whether they are limited range */
+static const struct {
+	const struct csc_matrix *base;
+	double kr;
+	double kb;
+	int limited;
+} references[] = {
+	{&csc_matrix_bt601_full, 0.299, 0.114, 0},
+	{&csc_matrix_bt601_limited, 0.299, 0.114, 1},
+	{&csc_matrix_bt709_full, 0.2126, 0.0722, 0},
+	{&csc_matrix_bt709_limited, 0.2126, 0.0722, 1},
+};
+
+static const struct csc_adjust adjustments[] = {
+	{0, 100, 100, 0},
+	{-16, 100, 100, 0},
+	{64, 100, 100, 0},
+	{0, 0, 100, 0},
+	{0, 200, 100, 0},
+	{0, 100, 0, 0},
+	{0, 100, 200, 0},
+	{0, 100, 100, 45},
+	{0, 100, 100, -90},
+	{0, 100, 100, 180},
+	{-10, 150, 50, -135},
+	{30, 80, 170, 10},
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const void *image_read_row(const struct csc_src *src, unsigned int y, void *buf)
+{
+	const struct image *img = src->user;
+	unsigned int bpp = (img->format == CSC_SRC_RGBA5551) ? 2 : 4;
+
+	/* The rows are read in place, buf isn't needed */
+	(void)buf;
+
+	return (const uint8_t *)img->pixels + y * img->width * bpp;
+}
+
+/*
+ * The model: nearest neighbour sampling, then the IFTU matrix on R, G, B
+ * with rounding and saturation. Chroma is taken from the sum of the pixels
+ * it covers.
+ */
+static uint32_t model_pixel(const struct image *img, unsigned int x, unsigned int y,
+			    unsigned int dst_width, unsigned int dst_height)
+{
+	uint32_t step_x = ((uint32_t)img->width << 16) / dst_width;
+	uint32_t step_y = ((uint32_t)img->height << 16) / dst_height;
+	unsigned int sx = (x * step_x + step_x / 2) >> 16;
+	unsigned int sy = (y * step_y + step_y / 2) >> 16;
+	uint32_t r, g, b;
+	uint16_t p;
+
+	if (sx >= img->width)
+		sx = img->width - 1;
+	if (sy >= img->height)
+		sy = img->height - 1;
+
+	if (img->format == CSC_SRC_RGBA8888)
+		return ((const uint32_t *)img->pixels)[sy * img->width + sx];
+
+	p = ((const uint16_t *)img->pixels)[sy * img->width + sx];
+	r = p & 0x1F;
+	g = (p >> 5) & 0x1F;
+	b = (p >> 10) & 0x1F;
+
+	return ((r << 3) | (r >> 2)) | (((g << 3) | (g >> 2)) << 8) |
+	       (((b << 3) | (b >> 2)) << 16) | 0xFF000000;
+}
+
+static uint8_t model_apply(const struct csc_matrix *m, unsigned int row,
+			   const uint32_t *p, unsigned int count)
+{
+	int64_t sum = 0;
+	unsigned int i, shift = CSC_COEF_BITS + (count == 4 ? 2 : count == 2 ? 1 : 0);
+	int32_t val;
+
+	for (i = 0; i < count; i++)
+		sum += (int64_t)m->coef[row][0] * (p[i] & 0xFF) +
+		       (int64_t)m->coef[row][1] * ((p[i] >> 8) & 0xFF) +
+		       (int64_t)m->coef[row][2] * ((p[i] >> 16) & 0xFF);
+
+	val = ((sum + (1 << (shift - 1))) >> shift) + m->offset[row];
+
+	return val < 0 ? 0 : val > 255 ? 255 : val;
+}
+
+/*
+ * Checks csc_matrix_adjust() and the integer transform against the same
+ * math in floating point, from the BT.601/BT.709 luma weights. Besides the
+ * final rounding, the results can only be off by the rounding of the base
+ * coefficients to CSC_COEF_BITS, scaled by the adjustments, and by that of
+ * the adjusted ones, so that is the tolerance. Returns the number of
+ * mismatches.
+ */
+static unsigned int check_matrix_math(void)
+{
+	unsigned int r, i, j, a, k, errors = 0;
+	double max_diff = 0;
+
+	for (r = 0; r < sizeof(references) / sizeof(*references); r++) {
+		double kr = references[r].kr, kb = references[r].kb, kg = 1.0 - kr - kb;
+		double scale_y = references[r].limited ? 219.0 / 255.0 : 1.0;
+		double scale_c = references[r].limited ? 224.0 / 255.0 : 1.0;
+		double y[3] = {kr, kg, kb};
+		double cb[3] = {-kr, -kg, 1.0 - kb};
+		double cr[3] = {1.0 - kr, -kg, -kb};
+		const struct csc_matrix *base = references[r].base;
+		double scale = 1.0 / (1 << CSC_COEF_BITS), base_error[3][3];
+
+		for (i = 0; i < 3; i++) {
+			y[i] *= scale_y;
+			cb[i] *= scale_c / (2.0 * (1.0 - kb));
+			cr[i] *= scale_c / (2.0 * (1.0 - kr));
+		}
+
+		for (i = 0; i < 3; i++) {
+			base_error[0][i] = fabs(base->coef[0][i] * scale - y[i]);
+			base_error[1][i] = fabs(base->coef[1][i] * scale - cb[i]);
+			base_error[2][i] = fabs(base->coef[2][i] * scale - cr[i]);
+		}
+
+		for (a = 0; a < sizeof(adjustments) / sizeof(*adjustments); a++) {
+			const struct csc_adjust *adj = &adjustments[a];
+			double h = adj->hue * M_PI / 180.0;
+			double ref[3][3], error[3][3], offset[3], tolerance[3];
+			struct csc_matrix m;
+
+			csc_matrix_adjust(&m, base, adj);
+
+			for (i = 0; i < 3; i++) {
+				error[0][i] = base_error[0][i] * adj->contrast / 100.0;
+				error[1][i] = (fabs(cos(h)) * base_error[1][i] +
+					       fabs(sin(h)) * base_error[2][i]) * adj->saturation / 100.0;
+				error[2][i] = (fabs(sin(h)) * base_error[1][i] +
+					       fabs(cos(h)) * base_error[2][i]) * adj->saturation / 100.0;
+
+				ref[0][i] = y[i] * adj->contrast / 100.0;
+				ref[1][i] = (cos(h) * cb[i] - sin(h) * cr[i]) * adj->saturation / 100.0;
+				ref[2][i] = (sin(h) * cb[i] + cos(h) * cr[i]) * adj->saturation / 100.0;
+			}
+			offset[0] = fmin(fmax(base->offset[0] + adj->brightness, 0), 255);
+			offset[1] = 128;
+			offset[2] = 128;
+
+			for (i = 0; i < 3; i++) {
+				tolerance[i] = 0.5 + 1e-9;
+				for (j = 0; j < 3; j++)
+					tolerance[i] += 255.0 * (error[i][j] + 0.5 / (1 << CSC_COEF_BITS));
+			}
+
+			for (k = 0; k < 4096; k++) {
+				uint32_t p = k < 8 ? (k & 1 ? 0xFF : 0) | (k & 2 ? 0xFF00 : 0) |
+						     (k & 4 ? 0xFF0000 : 0) :
+					     ((uint32_t)rand() << 16) ^ rand();
+				double rgb[3] = {p & 0xFF, (p >> 8) & 0xFF, (p >> 16) & 0xFF};
+
+				for (i = 0; i < 3; i++) {
+					double val = ref[i][0] * rgb[0] + ref[i][1] * rgb[1] +
+						     ref[i][2] * rgb[2] + offset[i];
+					double diff = fabs(model_apply(&m, i, &p, 1) -
+							   fmin(fmax(val, 0), 255));
+
+					if (diff > max_diff)
+						max_diff = diff;
+					if (diff > tolerance[i])
+						errors++;
+				}
+			}
+		}
+	}
+
+	printf("Matrix math: max difference with floating point %.2f\n", max_diff);
+
+	return errors;
+}
+
+static void image_init(struct image *img, enum csc_src_format format,
+		       unsigned int width, unsigned int height)
+{
+	unsigned int i, count = width * height;
+
+	img->format = format;
+	img->width = width;
+	img->height = height;
+	img->pixels = malloc(count * 4);
+
+	for (i = 0; i < count; i++) {
+		uint32_t val = ((uint32_t)rand() << 16) ^ rand();
+
+		/* Saturated pixels exercise the clamping */
+		if (i % 7 == 0)
+			val = (val & 1) ? 0xFFFFFFFF : 0;
+
+		if (format == CSC_SRC_RGBA5551)
+			((uint16_t *)img->pixels)[i] = val;
+		else
+			((uint32_t *)img->pixels)[i] = val;
+	}
+}
+
+/*
+ * Converts the whole frame in two bands, as the plugin's slices do, and
+ * returns the number of mismatches with the model.
+ */
+static unsigned int check(const struct csc_matrix *m, const struct image *img,
+			  unsigned int width, unsigned int height, uint8_t *dst,
+			  void *row_buf)
+{
+	struct csc_src src = {img->format, img->width, img->height, image_read_row, (void *)img};
+	unsigned int band = (height / 2) & ~1u;
+	unsigned int x, y, errors = 0;
+	uint32_t p[4];
+
+	/* NV12 */
+	csc_to_nv12(m, &src, dst, dst + width * height, width, height, 0, band, row_buf);
+	csc_to_nv12(m, &src, dst + band * width, dst + width * height + band / 2 * width,
+		    width, height, band, height - band, row_buf);
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++) {
+			p[0] = model_pixel(img, x, y, width, height);
+			errors += dst[y * width + x] != model_apply(m, 0, p, 1);
+		}
+
+	for (y = 0; y < height; y += 2)
+		for (x = 0; x < width; x += 2) {
+			const uint8_t *uv = dst + width * height + y / 2 * width + x;
+
+			p[0] = model_pixel(img, x, y, width, height);
+			p[1] = model_pixel(img, x + 1, y, width, height);
+			p[2] = model_pixel(img, x, y + 1, width, height);
+			p[3] = model_pixel(img, x + 1, y + 1, width, height);
+			errors += uv[0] != model_apply(m, 1, p, 4);
+			errors += uv[1] != model_apply(m, 2, p, 4);
+		}
+
+	/* YUY2 */
+	csc_to_yuy2(m, &src, dst, width, height, 0, band, row_buf);
+	csc_to_yuy2(m, &src, dst + band * width * 2, width, height, band,
+		    height - band, row_buf);
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x += 2) {
+			const uint8_t *yuyv = dst + (y * width + x) * 2;
+
+			p[0] = model_pixel(img, x, y, width, height);
+			p[1] = model_pixel(img, x + 1, y, width, height);
+			errors += yuyv[0] != model_apply(m, 0, &p[0], 1);
+			errors += yuyv[1] != model_apply(m, 1, p, 2);
+			errors += yuyv[2] != model_apply(m, 0, &p[1], 1);
+			errors += yuyv[3] != model_apply(m, 2, p, 2);
+		}
+
+	/* BGRX */
+	csc_to_bgrx(&src, dst, width, height, 0, height, row_buf);
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++) {
+			const uint8_t *bgrx = dst + (y * width + x) * 4;
+
+			p[0] = model_pixel(img, x, y, width, height);
+			errors += bgrx[0] != ((p[0] >> 16) & 0xFF);
+			errors += bgrx[1] != ((p[0] >> 8) & 0xFF);
+			errors += bgrx[2] != (p[0] & 0xFF);
+			errors += bgrx[3] != (p[0] >> 24);
+		}
+
+	return errors;
+}
+
+static void bench(const struct csc_matrix *m, const struct image *img,
+		  uint8_t *dst, void *row_buf)
+{
+	struct csc_src src = {img->format, img->width, img->height, image_read_row, (void *)img};
+	unsigned int width = img->width, height = img->height, i;
+	uint64_t start, nv12_ns, yuy2_ns;
+
+	start = now_ns();
+	for (i = 0; i < BENCH_FRAMES; i++)
+		csc_to_nv12(m, &src, dst, dst + width * height, width, height,
+			    0, height, row_buf);
+	nv12_ns = (now_ns() - start) / BENCH_FRAMES;
+
+	start = now_ns();
+	for (i = 0; i < BENCH_FRAMES; i++)
+		csc_to_yuy2(m, &src, dst, width, height, 0, height, row_buf);
+	yuy2_ns = (now_ns() - start) / BENCH_FRAMES;
+
+	printf("%s %ux%u: NV12 %.2f ms (%.0f Mpix/s), YUY2 %.2f ms (%.0f Mpix/s)\n",
+	       img->format == CSC_SRC_RGBA5551 ? "RGBA5551" : "RGBA8888",
+	       width, height, nv12_ns / 1e6, width * height * 1e3 / nv12_ns,
+	       yuy2_ns / 1e6, width * height * 1e3 / yuy2_ns);
+}
+
+int main(void)
+{
+	static uint8_t dst[1280 * 720 * 4];
+	static uint8_t row_buf[2 * 960 * 4];
+	struct csc_matrix m;
+	struct image img;
+	unsigned int s, f, i, errors;
+	int failures = 0;
+
+	printf("%s converter\n", IMPL);
+
+	srand(1);
+
+	errors = check_matrix_math();
+	if (errors) {
+		printf("FAIL: %u values off by more than the coefficient rounding\n", errors);
+		failures++;
+	}
+
+	for (f = 0; f < 2; f++) {
+		for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+			image_init(&img, f ? CSC_SRC_RGBA5551 : CSC_SRC_RGBA8888,
+				   sizes[s].src_width, sizes[s].src_height);
+
+			for (i = 0; i < sizeof(matrices) / sizeof(*matrices); i++) {
+				csc_matrix_adjust(&m, matrices[i].base, &matrices[i].adjust);
+
+				errors = check(&m, &img, sizes[s].dst_width,
+					       sizes[s].dst_height, dst, row_buf);
+				if (errors) {
+					printf("FAIL: %s %ux%u -> %ux%u, %s: %u mismatches\n",
+					       f ? "RGBA5551" : "RGBA8888",
+					       sizes[s].src_width, sizes[s].src_height,
+					       sizes[s].dst_width, sizes[s].dst_height,
+					       matrices[i].name, errors);
+					failures++;
+				}
+			}
+
+			free(img.pixels);
+		}
+	}
+
+	for (f = 0; f < 2; f++) {
+		image_init(&img, f ? CSC_SRC_RGBA5551 : CSC_SRC_RGBA8888, 960, 544);
+		bench(&csc_matrix_bt601_limited, &img, dst, row_buf);
+		free(img.pixels);
+	}
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,367 @@
+/*
+ * Host test of the isochronous bandwidth tiers and packetizer (src/isoc.c).
+ *
+ * Negotiates every format, frame and interval of usb_descriptors.h against
+ * the high and full speed tiers, and checks that the tier picked carries
+ * the frame and is the smallest one that does, or that the setting was
+ * moved to the closest one that fits only when none does. At full speed
+ * nothing fits, which has to be reported as such.
+ *
+ * Then packs frames the way send_payload() does, a request per chunk of
+ * UVC_ISOC_CHUNK_PACKETS packets, and splits every request into packet_size
+ * transactions like the controller does, one per (micro)frame. Each
+ * transaction has to start with a payload header, only the last one of the
+ * frame has EOF, and the data read back has to be the frame.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "isoc.h"
+
+#define FPS_TO_INTERVAL(fps)	(10000000 / (fps))
+
+/* usb_descriptors.h */
+#define FORMAT_NV12		1
+#define FORMAT_MJPEG		2
+#define FORMAT_YUY2		3
+#define FORMAT_RGB32		4
+
+struct format {
+	unsigned int index;
+	unsigned int bpp;		/* Bytes per pixel, 0 for NV12 and MJPEG */
+	unsigned int num_frames;
+	struct uvc_mode frames[5];
+};
+
+#define MODE(w, h, fps0, fps1) \
+	{ w, h, FPS_TO_INTERVAL(fps0), 2, { FPS_TO_INTERVAL(fps0), FPS_TO_INTERVAL(fps1) } }
+
+static const struct format formats[] = {
+	{ FORMAT_NV12, 0, 5, {
+		MODE(960, 544, 60, 30), MODE(896, 504, 60, 30), MODE(864, 488, 60, 30),
+		MODE(480, 272, 60, 30), MODE(1280, 720, 30, 20) } },
+	{ FORMAT_MJPEG, 0, 5, {
+		MODE(960, 544, 60, 30), MODE(896, 504, 60, 30), MODE(864, 488, 60, 30),
+		MODE(480, 272, 60, 30), MODE(1280, 720, 30, 20) } },
+	{ FORMAT_YUY2, 2, 5, {
+		MODE(960, 544, 30, 20), MODE(896, 504, 30, 20), MODE(864, 488, 30, 20),
+		MODE(480, 272, 60, 30), MODE(1280, 720, 20, 15) } },
+	{ FORMAT_RGB32, 4, 1, {
+		MODE(960, 544, 20, 15) } },
+};
+
+static const struct uvc_streaming_control control_default = {
+	.bFormatIndex		= FORMAT_NV12,
+	.bFrameIndex		= 1,
+	.dwFrameInterval	= FPS_TO_INTERVAL(60),
+	.dwClockFrequency	= 48000000,
+	.bPreferedVersion	= 1,
+};
+
+/* endpdesc_hi and endpdesc_full */
+static const struct uvc_isoc_tiers tiers_hi = { 4, { 512, 1024, 2048, 3072 }, 8000 };
+static const struct uvc_isoc_tiers tiers_full = { 1, { 1023 }, 1000 };
+
+static unsigned int num_slices = 1;
+
+static const struct format *format_find(unsigned int format_index)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(formats) / sizeof(*formats); i++) {
+		if (formats[i].index == format_index)
+			return &formats[i];
+	}
+
+	return NULL;
+}
+
+static unsigned int default_frame(unsigned int format_index)
+{
+	return format_find(format_index) ? 1 : 0;
+}
+
+static int mode_get(unsigned int format_index, unsigned int frame_index,
+		    struct uvc_mode *mode)
+{
+	const struct format *format = format_find(format_index);
+
+	if (!format || frame_index < 1 || frame_index > format->num_frames)
+		return -1;
+
+	*mode = format->frames[frame_index - 1];
+	return 0;
+}
+
+static void mode_layout(unsigned int format_index, const struct uvc_mode *mode,
+			struct uvc_frame_layout *layout)
+{
+	const struct format *format = format_find(format_index);
+
+	if (format_index == FORMAT_MJPEG)
+		uvc_frame_layout_mjpeg(layout, mode->width, mode->height);
+	else if (format->bpp == 0)
+		uvc_frame_layout_nv12(layout, mode->width, mode->height, num_slices);
+	else
+		uvc_frame_layout_packed(layout, mode->width, mode->height,
+					format->bpp, num_slices);
+}
+
+static const struct uvc_negotiate_ops ops = {
+	.default_frame	= default_frame,
+	.mode_get	= mode_get,
+	.mode_layout	= mode_layout,
+};
+
+static int fits(const struct uvc_streaming_control *ctrl,
+		const struct uvc_isoc_tiers *tiers, unsigned int packet_size)
+{
+	struct uvc_frame_layout layout;
+	struct uvc_mode mode;
+
+	mode_get(ctrl->bFormatIndex, ctrl->bFrameIndex, &mode);
+	mode_layout(ctrl->bFormatIndex, &mode, &layout);
+
+	return (uint64_t)uvc_isoc_frame_packets(&layout, packet_size) * 10000000 <=
+	       (uint64_t)tiers->packets_per_second * ctrl->dwFrameInterval;
+}
+
+static int format_fits(unsigned int format_index, const struct uvc_isoc_tiers *tiers)
+{
+	struct uvc_streaming_control ctrl = control_default;
+	const struct format *format = format_find(format_index);
+	unsigned int j, k;
+
+	ctrl.bFormatIndex = format_index;
+	for (j = 0; j < format->num_frames; j++) {
+		ctrl.bFrameIndex = j + 1;
+		for (k = 0; k < format->frames[j].num_intervals; k++) {
+			ctrl.dwFrameInterval = format->frames[j].interval[k];
+			if (fits(&ctrl, tiers, tiers->packet_size[tiers->num_tiers - 1]))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int check_tiers(const struct uvc_isoc_tiers *tiers, const char *speed)
+{
+	struct uvc_streaming_control req, ctrl, asked;
+	const struct format *format;
+	unsigned int i, j, k, tier;
+	int ret, failures = 0;
+
+	for (i = 0; i < sizeof(formats) / sizeof(*formats); i++) {
+		format = &formats[i];
+
+		for (j = 0; j < format->num_frames; j++) {
+			for (k = 0; k < format->frames[j].num_intervals; k++) {
+				req = control_default;
+				req.bFormatIndex = format->index;
+				req.bFrameIndex = j + 1;
+				req.dwFrameInterval = format->frames[j].interval[k];
+
+				uvc_negotiate(&ctrl, &req, &control_default, &ops);
+				asked = ctrl;
+				ret = uvc_isoc_negotiate(&ctrl, &control_default, &ops, tiers);
+
+				for (tier = 0; tier < tiers->num_tiers; tier++) {
+					if (tiers->packet_size[tier] == ctrl.dwMaxPayloadTransferSize)
+						break;
+				}
+
+				if (num_slices == 1) {
+					printf("%s format %u %4ux%-4u %2u fps: ", speed, format->index,
+					       format->frames[j].width, format->frames[j].height,
+					       10000000 / req.dwFrameInterval);
+					if (ret == 0)
+						printf("%u bytes\n", ctrl.dwMaxPayloadTransferSize);
+					else if (ret < 0)
+						printf("no tier carries it\n");
+					else
+						printf("moved to format %u frame %u at %u fps, %u bytes\n",
+						       ctrl.bFormatIndex, ctrl.bFrameIndex,
+						       10000000 / ctrl.dwFrameInterval,
+						       ctrl.dwMaxPayloadTransferSize);
+				}
+
+				/* Nothing at all fits, in this format or the default one */
+				if (ret < 0) {
+					if (format_fits(asked.bFormatIndex, tiers) ||
+					    format_fits(control_default.bFormatIndex, tiers)) {
+						printf("  FAIL: no tier, but a setting fits\n");
+						failures++;
+					}
+					continue;
+				}
+
+				if (tier == tiers->num_tiers ||
+				    !fits(&ctrl, tiers, tiers->packet_size[tier])) {
+					printf("  FAIL: the tier doesn't carry the setting\n");
+					failures++;
+					continue;
+				}
+
+				if (tier > 0 && fits(&ctrl, tiers, tiers->packet_size[tier - 1])) {
+					printf("  FAIL: a smaller tier carries it\n");
+					failures++;
+				}
+
+				/* Only moved when it had to be, and never to a faster rate */
+				if (ret == 0 && (ctrl.bFormatIndex != asked.bFormatIndex ||
+						 ctrl.bFrameIndex != asked.bFrameIndex ||
+						 ctrl.dwFrameInterval != asked.dwFrameInterval ||
+						 ctrl.dwMaxVideoFrameSize != asked.dwMaxVideoFrameSize)) {
+					printf("  FAIL: changed a setting that fits\n");
+					failures++;
+				}
+				if (ret > 0 && fits(&asked, tiers,
+						    tiers->packet_size[tiers->num_tiers - 1])) {
+					printf("  FAIL: moved a setting that fits\n");
+					failures++;
+				}
+				if (ret > 0 && ctrl.bFormatIndex == asked.bFormatIndex &&
+				    ctrl.bFrameIndex == asked.bFrameIndex &&
+				    ctrl.dwFrameInterval <= asked.dwFrameInterval) {
+					printf("  FAIL: moved to a faster rate\n");
+					failures++;
+				}
+			}
+		}
+	}
+
+	return failures;
+}
+
+static unsigned char frame[1280 * 720 * 4];
+static unsigned char packed[UVC_ISOC_CHUNK_SIZE];
+static unsigned char received[1280 * 720 * 4];
+
+/*
+ * Packs the payloads of a frame a chunk at a time like send_payload(), and
+ * reads them back a transaction at a time like the host. Returns the
+ * number of failures.
+ */
+static int check_pack_frame(const struct uvc_frame_layout *layout,
+			    unsigned int packet_size, int fid)
+{
+	unsigned char header[UVC_PAYLOAD_HEADER_SIZE];
+	unsigned int payload, offset, size, chunk, len, max, pos, tlen, received_len = 0;
+	unsigned int data_size = 0, eofs = 0;
+	int eof, last;
+
+	max = UVC_ISOC_CHUNK_PACKETS * (packet_size - UVC_PAYLOAD_HEADER_SIZE);
+
+	for (payload = 0; payload < layout->num_slices; payload++) {
+		size = layout->payload_size[payload] - UVC_PAYLOAD_HEADER_SIZE;
+		eof = payload == layout->num_slices - 1;
+
+		for (offset = 0; offset < size; offset += chunk) {
+			chunk = size - offset < max ? size - offset : max;
+			last = offset + chunk == size;
+
+			memset(header, 0, sizeof(header));
+			header[0] = UVC_PAYLOAD_HEADER_SIZE;
+			header[1] = UVC_STREAM_EOH | (fid ? UVC_STREAM_FID : 0) |
+				    (eof && last ? UVC_STREAM_EOF : 0);
+
+			len = uvc_isoc_pack(packed, frame + data_size + offset, chunk,
+					    header, eof && last, packet_size);
+			if (len > UVC_ISOC_CHUNK_SIZE) {
+				printf("  FAIL: %u byte request\n", len);
+				return 1;
+			}
+
+			/* The controller sends packet_size bytes per (micro)frame */
+			for (pos = 0; pos < len; pos += tlen) {
+				tlen = len - pos < packet_size ? len - pos : packet_size;
+
+				if (pos + tlen < len && tlen != packet_size) {
+					printf("  FAIL: short transaction in a request\n");
+					return 1;
+				}
+				if (tlen <= UVC_PAYLOAD_HEADER_SIZE ||
+				    packed[pos] != UVC_PAYLOAD_HEADER_SIZE ||
+				    !(packed[pos + 1] & UVC_STREAM_EOH) ||
+				    !!(packed[pos + 1] & UVC_STREAM_FID) != fid) {
+					printf("  FAIL: transaction at %u of a request has no header\n", pos);
+					return 1;
+				}
+				if (packed[pos + 1] & UVC_STREAM_EOF)
+					eofs++;
+
+				memcpy(received + received_len, packed + pos + UVC_PAYLOAD_HEADER_SIZE,
+				       tlen - UVC_PAYLOAD_HEADER_SIZE);
+				received_len += tlen - UVC_PAYLOAD_HEADER_SIZE;
+			}
+		}
+
+		data_size += size;
+	}
+
+	/* EOF on the very last transaction only */
+	if (eofs != 1 || !(packed[pos - tlen + 1] & UVC_STREAM_EOF)) {
+		printf("  FAIL: %u EOF transactions\n", eofs);
+		return 1;
+	}
+
+	if (received_len != data_size || memcmp(received, frame, data_size) != 0) {
+		printf("  FAIL: %u bytes received, %u sent\n", received_len, data_size);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int check_pack(void)
+{
+	static const unsigned int packet_sizes[] = { 512, 1023, 1024, 2048, 3072 };
+	struct uvc_frame_layout layout;
+	unsigned int i, j, p;
+	int failures = 0;
+
+	for (i = 0; i < sizeof(frame); i++)
+		frame[i] = i * 2654435761u >> 24;
+
+	for (i = 0; i < sizeof(formats) / sizeof(*formats); i++) {
+		for (j = 0; j < formats[i].num_frames; j++) {
+			mode_layout(formats[i].index, &formats[i].frames[j], &layout);
+
+			for (p = 0; p < sizeof(packet_sizes) / sizeof(*packet_sizes); p++) {
+				if (check_pack_frame(&layout, packet_sizes[p], (i + j + p) & 1)) {
+					printf("  FAIL: format %u %ux%u, %u slices, %u byte packets\n",
+					       formats[i].index, layout.width, layout.height,
+					       layout.num_slices, packet_sizes[p]);
+					failures++;
+				}
+			}
+		}
+	}
+
+	return failures;
+}
+
+int main(void)
+{
+	static const unsigned int slices[] = { 1, 4, UVC_MAX_FRAME_SLICES };
+	unsigned int s;
+	int failures = 0;
+
+	for (s = 0; s < sizeof(slices) / sizeof(*slices); s++) {
+		num_slices = slices[s];
+
+		failures += check_tiers(&tiers_hi, "high");
+		failures += check_tiers(&tiers_full, "full");
+		failures += check_pack();
+		printf("%u slice%s: tiers and packing checked\n", num_slices,
+		       num_slices > 1 ? "s" : "");
+	}
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * Host test of the JPEG encoder (src/jpeg.c).
+ *
+ * Encodes synthetic NV12 frames at the MJPEG frame sizes the way mjpeg.c
+ * does (one restart interval per worker, joined with RSTn markers), decodes
+ * them with libjpeg as the reference decoder and checks the PSNR of every
+ * plane. Also reports the single-core encoding speed. Cross-compile it with
+ * NEON enabled to test and benchmark the vectorized FDCT.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <jpeglib.h>
+#include "jpeg.h"
+
+#define WORKERS		3	/* WORKER_POOL_SIZE */
+#define BENCH_FRAMES	20
+
+#if defined(__ARM_NEON)
+#define IMPL		"NEON"
+#else
+#define IMPL		"Scalar"
+#endif
+
+static const struct {
+	unsigned int width;
+	unsigned int height;
+} sizes[] = {
+	{960, 544}, {896, 504}, {864, 488}, {480, 272}, {1280, 720},
+};
+
+/* Minimum PSNR (dB) of the Y and the chroma planes */
+static const struct {
+	unsigned int quality;
+	double y;
+	double uv;
+} qualities[] = {
+	{20, 28.0, 34.0},
+	{50, 31.0, 36.0},
+	{80, 34.0, 38.0},
+	{90, 37.0, 40.0},
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Something like a game screen: gradients, flat areas with hard edges,
+ * fine detail (text-like stripes) and some noise.
+ */
+static void frame_generate(uint8_t *y, uint8_t *uv, unsigned int width,
+			   unsigned int height)
+{
+	unsigned int i, j;
+	int val;
+
+	srand(width * height);
+
+	for (i = 0; i < height; i++) {
+		for (j = 0; j < width; j++) {
+			int dx = (int)j - (int)width / 3, dy = (int)i - (int)height / 2;
+
+			val = 16 + (j * 200) / width;
+			if (dx * dx + dy * dy < (int)(height * height / 16))
+				val = 220;
+			if (j > width * 2 / 3 && (i / 4) % 3 == 0 && (j / 3) % 4 != 0)
+				val = 30;
+			val += rand() % 9 - 4;
+			y[i * width + j] = val < 0 ? 0 : val > 255 ? 255 : val;
+		}
+	}
+
+	for (i = 0; i < (height + 1) / 2; i++) {
+		for (j = 0; j < (width + 1) / 2; j++) {
+			uv[i * width + 2 * j + 0] = 64 + (j * 128) / ((width + 1) / 2);
+			uv[i * width + 2 * j + 1] = 192 - (i * 128) / ((height + 1) / 2);
+		}
+	}
+}
+
+static int frame_encode(const struct jpeg_encoder *enc, const uint8_t *y,
+			const uint8_t *uv, uint8_t *out, unsigned int out_size)
+{
+	unsigned int rows = (enc->mcu_rows + WORKERS - 1) / WORKERS;
+	unsigned int i, size;
+	int ret;
+
+	ret = jpeg_write_headers(enc, out, out_size, rows * enc->mcu_cols);
+	if (ret < 0)
+		return ret;
+	size = ret;
+
+	for (i = 0; i < WORKERS && i * rows < enc->mcu_rows; i++) {
+		if (i > 0) {
+			out[size++] = 0xFF;
+			out[size++] = JPEG_MARKER_RST0 + ((i - 1) & 7);
+		}
+
+		ret = jpeg_encode_mcu_rows(enc, y, uv, i * rows, rows,
+					   out + size, out_size - size - 4);
+		if (ret < 0)
+			return ret;
+		size += ret;
+	}
+
+	out[size++] = 0xFF;
+	out[size++] = JPEG_MARKER_EOI;
+
+	return size;
+}
+
+static double psnr(uint64_t sse, unsigned int count)
+{
+	if (sse == 0)
+		return 99.0;
+
+	return 10.0 * log10(255.0 * 255.0 * count / sse);
+}
+
+/*
+ * Decodes the JPEG into its unscaled planes and returns the PSNR of Y and
+ * of the worse chroma plane against the NV12 source.
+ */
+static int frame_check(const uint8_t *jpeg, unsigned int size, const uint8_t *y,
+		       const uint8_t *uv, unsigned int width, unsigned int height,
+		       double *psnr_y, double *psnr_uv)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	unsigned int chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+	unsigned int stride[3], c, i, j, row;
+	uint64_t sse[3] = {0, 0, 0};
+	JSAMPROW rows[3][16];
+	JSAMPARRAY planes[3] = {rows[0], rows[1], rows[2]};
+	uint8_t *buf[3];
+	int ret = -1;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char *)jpeg, size);
+
+	if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK ||
+	    cinfo.image_width != width || cinfo.image_height != height ||
+	    cinfo.num_components != 3 || cinfo.comp_info[0].h_samp_factor != 2 ||
+	    cinfo.comp_info[0].v_samp_factor != 2) {
+		fprintf(stderr, "Unexpected JPEG header\n");
+		goto out;
+	}
+
+	cinfo.raw_data_out = TRUE;
+	cinfo.out_color_space = JCS_YCbCr;
+	jpeg_start_decompress(&cinfo);
+
+	for (c = 0; c < 3; c++) {
+		stride[c] = cinfo.comp_info[c].width_in_blocks * DCTSIZE;
+		buf[c] = malloc(stride[c] * 16);
+		for (i = 0; i < 16; i++)
+			rows[c][i] = buf[c] + i * stride[c];
+	}
+
+	for (row = 0; row < height; row += 16) {
+		if (jpeg_read_raw_data(&cinfo, planes, 16) != 16) {
+			fprintf(stderr, "Short read at row %u\n", row);
+			goto out_free;
+		}
+
+		for (i = 0; i < 16 && row + i < height; i++)
+			for (j = 0; j < width; j++) {
+				int d = rows[0][i][j] - y[(row + i) * width + j];
+				sse[0] += d * d;
+			}
+
+		for (i = 0; i < 8 && row / 2 + i < chroma_height; i++)
+			for (j = 0; j < chroma_width; j++)
+				for (c = 1; c < 3; c++) {
+					int d = rows[c][i][j] -
+						uv[(row / 2 + i) * width + 2 * j + c - 1];
+					sse[c] += d * d;
+				}
+	}
+
+	jpeg_finish_decompress(&cinfo);
+
+	if (jerr.num_warnings) {
+		fprintf(stderr, "%ld libjpeg warnings\n", jerr.num_warnings);
+		goto out_free;
+	}
+
+	*psnr_y = psnr(sse[0], width * height);
+	*psnr_uv = fmin(psnr(sse[1], chroma_width * chroma_height),
+			psnr(sse[2], chroma_width * chroma_height));
+	ret = 0;
+
+out_free:
+	for (c = 0; c < 3; c++)
+		free(buf[c]);
+out:
+	jpeg_destroy_decompress(&cinfo);
+
+	return ret;
+}
+
+int main(void)
+{
+	unsigned int s, q, i, width, height, out_size;
+	struct jpeg_encoder enc;
+	double psnr_y, psnr_uv;
+	uint64_t start, ns;
+	uint8_t *nv12, *out;
+	int size, failures = 0;
+
+	printf("%s FDCT\n", IMPL);
+
+	for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+		width = sizes[s].width;
+		height = sizes[s].height;
+		out_size = width * height * 2;
+
+		nv12 = malloc(width * height * 3 / 2);
+		out = malloc(out_size);
+		if (!nv12 || !out)
+			return 1;
+
+		frame_generate(nv12, nv12 + width * height, width, height);
+
+		for (q = 0; q < sizeof(qualities) / sizeof(*qualities); q++) {
+			jpeg_encoder_init(&enc, width, height, qualities[q].quality);
+
+			size = frame_encode(&enc, nv12, nv12 + width * height, out, out_size);
+			if (size < 0 || frame_check(out, size, nv12, nv12 + width * height,
+						    width, height, &psnr_y, &psnr_uv) < 0) {
+				printf("%ux%u q%u: FAIL: can't encode or decode\n",
+				       width, height, qualities[q].quality);
+				failures++;
+				continue;
+			}
+
+			start = now_ns();
+			for (i = 0; i < BENCH_FRAMES; i++)
+				frame_encode(&enc, nv12, nv12 + width * height, out, out_size);
+			ns = (now_ns() - start) / BENCH_FRAMES;
+
+			printf("%4ux%-4u q%-2u: %7d bytes, PSNR Y %5.2f dB, UV %5.2f dB, "
+			       "%6.2f ms (%5.1f fps)\n", width, height,
+			       qualities[q].quality, size, psnr_y, psnr_uv,
+			       ns / 1e6, 1e9 / ns);
+
+			if (psnr_y < qualities[q].y || psnr_uv < qualities[q].uv) {
+				printf("  FAIL: PSNR below %.1f/%.1f dB\n",
+				       qualities[q].y, qualities[q].uv);
+				failures++;
+			}
+		}
+
+		free(nv12);
+		free(out);
+	}
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,490 @@
+/*
+ * Host test of the probe/commit negotiation (src/negotiate.c).
+ *
+ * Replays the probe/commit sequences of the Linux (uvcvideo), Windows
+ * (usbvideo.sys) and macOS UVC drivers against the formats and frames of
+ * usb_descriptors.h, handling the requests like main.c does, and checks
+ * every reply and the committed setting: the format, frame and interval the
+ * host gets, and that the frame and payload sizes are the exact ones of the
+ * mode. The sequences are modelled on what each driver sends (request
+ * order, wLength, bmHint, fields carried over from the previous GET_CUR),
+ * with the intervals applications ask for. The frame layouts of every mode
+ * are checked too, each payload being sent with its header in one request.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "negotiate.h"
+
+#define FPS_TO_INTERVAL(fps)	(10000000 / (fps))
+
+/* usb_descriptors.h */
+#define FORMAT_NV12		1
+#define FORMAT_MJPEG		2
+#define FORMAT_YUY2		3
+#define FORMAT_RGB32		4
+
+#define CONTROL_SIZE		sizeof(struct uvc_streaming_control)
+#define CONTROL_SIZE_UVC10	26
+
+#define ALIGN_SLOT(x)		(((x) + UVC_PAYLOAD_HEADER_SLOT - 1) & \
+				 ~(UVC_PAYLOAD_HEADER_SLOT - 1))
+
+struct format {
+	unsigned int index;
+	unsigned int bpp;		/* Bytes per pixel, 0 for NV12 and MJPEG */
+	unsigned int num_frames;
+	struct uvc_mode frames[5];
+};
+
+#define MODE(w, h, fps0, fps1) \
+	{ w, h, FPS_TO_INTERVAL(fps0), 2, { FPS_TO_INTERVAL(fps0), FPS_TO_INTERVAL(fps1) } }
+
+/* The default frame of every format is the first one */
+static const struct format formats[] = {
+	{ FORMAT_NV12, 0, 5, {
+		MODE(960, 544, 60, 30), MODE(896, 504, 60, 30), MODE(864, 488, 60, 30),
+		MODE(480, 272, 60, 30), MODE(1280, 720, 30, 20) } },
+	{ FORMAT_MJPEG, 0, 5, {
+		MODE(960, 544, 60, 30), MODE(896, 504, 60, 30), MODE(864, 488, 60, 30),
+		MODE(480, 272, 60, 30), MODE(1280, 720, 30, 20) } },
+	{ FORMAT_YUY2, 2, 5, {
+		MODE(960, 544, 30, 20), MODE(896, 504, 30, 20), MODE(864, 488, 30, 20),
+		MODE(480, 272, 60, 30), MODE(1280, 720, 20, 15) } },
+	{ FORMAT_RGB32, 4, 1, {
+		MODE(960, 544, 20, 15) } },
+};
+
+static const struct uvc_streaming_control control_default = {
+	.bFormatIndex		= FORMAT_NV12,
+	.bFrameIndex		= 1,
+	.dwFrameInterval	= FPS_TO_INTERVAL(60),
+	.dwClockFrequency	= 48000000,
+	.bPreferedVersion	= 1,
+};
+
+static unsigned int num_slices = 1;
+
+static const struct format *format_find(unsigned int format_index)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(formats) / sizeof(*formats); i++) {
+		if (formats[i].index == format_index)
+			return &formats[i];
+	}
+
+	return NULL;
+}
+
+static unsigned int default_frame(unsigned int format_index)
+{
+	return format_find(format_index) ? 1 : 0;
+}
+
+static int mode_get(unsigned int format_index, unsigned int frame_index,
+		    struct uvc_mode *mode)
+{
+	const struct format *format = format_find(format_index);
+
+	if (!format || frame_index < 1 || frame_index > format->num_frames)
+		return -1;
+
+	*mode = format->frames[frame_index - 1];
+
+	return 0;
+}
+
+static void mode_layout(unsigned int format_index, const struct uvc_mode *mode,
+			struct uvc_frame_layout *layout)
+{
+	const struct format *format = format_find(format_index);
+
+	if (format_index == FORMAT_MJPEG)
+		uvc_frame_layout_mjpeg(layout, mode->width, mode->height);
+	else if (format->bpp == 0)
+		uvc_frame_layout_nv12(layout, mode->width, mode->height, num_slices);
+	else
+		uvc_frame_layout_packed(layout, mode->width, mode->height,
+					format->bpp, num_slices);
+}
+
+static const struct uvc_negotiate_ops ops = {
+	.default_frame	= default_frame,
+	.mode_get	= mode_get,
+	.mode_layout	= mode_layout,
+};
+
+enum step_type {
+	SET,		/* SET_CUR of a zeroed control with the given fields */
+	SET_REPLY,	/* SET_CUR of the last reply, unchanged */
+	SET_REPLY_WITH,	/* SET_CUR of the last reply with the given fields */
+	GET,
+};
+
+struct step {
+	enum step_type type;
+	uint8_t request;	/* GET only */
+	uint8_t control;	/* UVC_VS_PROBE_CONTROL or UVC_VS_COMMIT_CONTROL */
+	uint16_t length;	/* wLength */
+	uint16_t hint;
+	uint8_t format;
+	uint8_t frame;
+	uint32_t interval;
+	/* Expected reply of a GET, or setting after a SET_CUR */
+	uint8_t exp_format;
+	uint8_t exp_frame;
+	uint32_t exp_interval;
+};
+
+#define PROBE			UVC_VS_PROBE_CONTROL
+#define COMMIT			UVC_VS_COMMIT_CONTROL
+#define LEN			CONTROL_SIZE
+#define LEN10			CONTROL_SIZE_UVC10
+
+#define GET_(req, ctl, len, f, fr, fps) \
+	{ GET, req, ctl, len, 0, 0, 0, 0, f, fr, FPS_TO_INTERVAL(fps) }
+#define SET_(ctl, len, hint, f, fr, interval, ef, efr, efps) \
+	{ SET, 0, ctl, len, hint, f, fr, interval, ef, efr, FPS_TO_INTERVAL(efps) }
+#define SET_REPLY_(ctl, len, ef, efr, efps) \
+	{ SET_REPLY, 0, ctl, len, 0, 0, 0, 0, ef, efr, FPS_TO_INTERVAL(efps) }
+#define SET_REPLY_WITH_(ctl, len, f, fr, interval, ef, efr, efps) \
+	{ SET_REPLY_WITH, 0, ctl, len, 0, f, fr, interval, ef, efr, FPS_TO_INTERVAL(efps) }
+
+struct sequence {
+	const char *name;
+	const struct step *steps;
+	unsigned int num_steps;
+};
+
+/*
+ * uvcvideo: uvc_video_init() sets the probe to GET_DEF and reads it back,
+ * then every S_FMT/S_PARM and STREAMON probes a zeroed control with bmHint
+ * set to dwFrameInterval and commits the GET_CUR reply unchanged.
+ */
+static const struct step linux_steps[] = {
+	GET_(UVC_GET_DEF, PROBE, LEN, FORMAT_NV12, 1, 60),
+	SET_REPLY_(PROBE, LEN, FORMAT_NV12, 1, 60),
+	GET_(UVC_GET_CUR, PROBE, LEN, FORMAT_NV12, 1, 60),
+	/* YUY2 1280x720 at 30 fps, the nearest is 20 fps */
+	SET_(PROBE, LEN, 1, FORMAT_YUY2, 5, FPS_TO_INTERVAL(30), FORMAT_YUY2, 5, 20),
+	GET_(UVC_GET_CUR, PROBE, LEN, FORMAT_YUY2, 5, 20),
+	SET_(PROBE, LEN, 1, FORMAT_YUY2, 5, FPS_TO_INTERVAL(20), FORMAT_YUY2, 5, 20),
+	GET_(UVC_GET_CUR, PROBE, LEN, FORMAT_YUY2, 5, 20),
+	SET_REPLY_(COMMIT, LEN, FORMAT_YUY2, 5, 20),
+	GET_(UVC_GET_CUR, COMMIT, LEN, FORMAT_YUY2, 5, 20),
+	/* NV12 960x544 at 30 fps */
+	SET_(PROBE, LEN, 1, FORMAT_NV12, 1, FPS_TO_INTERVAL(30), FORMAT_NV12, 1, 30),
+	GET_(UVC_GET_CUR, PROBE, LEN, FORMAT_NV12, 1, 30),
+	SET_REPLY_(COMMIT, LEN, FORMAT_NV12, 1, 30),
+	/* MJPEG 480x272 at 60 fps */
+	SET_(PROBE, LEN, 1, FORMAT_MJPEG, 4, FPS_TO_INTERVAL(60), FORMAT_MJPEG, 4, 60),
+	GET_(UVC_GET_CUR, PROBE, LEN, FORMAT_MJPEG, 4, 60),
+	SET_REPLY_(COMMIT, LEN, FORMAT_MJPEG, 4, 60),
+};
+
+/*
+ * usbvideo.sys reads GET_CUR/MIN/MAX/DEF of the probe, then probes with
+ * the last GET_CUR reply where it only changes the format, frame and
+ * interval (so the sizes are those of the previous mode), and commits the
+ * GET_CUR reply. Media Foundation asks for rounded intervals.
+ */
+static const struct step windows_steps[] = {
+	GET_(UVC_GET_CUR, PROBE, LEN, FORMAT_NV12, 1, 60),
+	GET_(UVC_GET_MIN, PROBE, LEN, FORMAT_NV12, 1, 60),
+	GET_(UVC_GET_MAX, PROBE, LEN, FORMAT_NV12, 1, 30),
+	GET_(UVC_GET_DEF, PROBE, LEN, FORMAT_NV12, 1, 60),
+	GET_(UVC_GET_CUR, PROBE, LEN, FORMAT_NV12, 1, 60),
+	/* MJPEG 1280x720 at 30 fps */
+	SET_REPLY_WITH_(PROBE, LEN, FORMAT_MJPEG, 5, 333334, FORMAT_MJPEG, 5, 30),
+	GET_(UVC_GET_CUR, PROBE, LEN, FORMAT_MJPEG, 5, 30),
+	GET_(UVC_GET_MIN, PROBE, LEN, FORMAT_MJPEG, 5, 30),
+	GET_(UVC_GET_MAX, PROBE, LEN, FORMAT_MJPEG, 5, 20),
+	GET_(UVC_GET_CUR, PROBE, LEN, FORMAT_MJPEG, 5, 30),
+	SET_REPLY_(COMMIT, LEN, FORMAT_MJPEG, 5, 30),
+	/* RGB32 960x544 at 60 fps, the nearest is 20 fps */
+	SET_REPLY_WITH_(PROBE, LEN, FORMAT_RGB32, 1, 166667, FORMAT_RGB32, 1, 20),
+	GET_(UVC_GET_CUR, PROBE, LEN, FORMAT_RGB32, 1, 20),
+	SET_REPLY_(COMMIT, LEN, FORMAT_RGB32, 1, 20),
+	/* YUY2 480x272 at 60 fps */
+	SET_REPLY_WITH_(PROBE, LEN, FORMAT_YUY2, 4, 166667, FORMAT_YUY2, 4, 60),
+	GET_(UVC_GET_CUR, PROBE, LEN, FORMAT_YUY2, 4, 60),
+	SET_REPLY_(COMMIT, LEN, FORMAT_YUY2, 4, 60),
+};
+
+/*
+ * The macOS driver uses the 26 bytes UVC 1.0 control, probes without
+ * bmHint and sometimes with no interval, and commits the GET_CUR reply.
+ */
+static const struct step macos_steps[] = {
+	GET_(UVC_GET_CUR, PROBE, LEN10, FORMAT_NV12, 1, 60),
+	SET_(PROBE, LEN10, 0, FORMAT_NV12, 1, 0, FORMAT_NV12, 1, 60),
+	GET_(UVC_GET_CUR, PROBE, LEN10, FORMAT_NV12, 1, 60),
+	GET_(UVC_GET_MAX, PROBE, LEN10, FORMAT_NV12, 1, 30),
+	GET_(UVC_GET_CUR, PROBE, LEN10, FORMAT_NV12, 1, 60),
+	SET_REPLY_(COMMIT, LEN10, FORMAT_NV12, 1, 60),
+	/* YUY2 896x504 at its default rate */
+	SET_(PROBE, LEN10, 0, FORMAT_YUY2, 2, 0, FORMAT_YUY2, 2, 30),
+	GET_(UVC_GET_CUR, PROBE, LEN10, FORMAT_YUY2, 2, 30),
+	SET_REPLY_(COMMIT, LEN10, FORMAT_YUY2, 2, 30),
+	/* NV12 1280x720 at 30 fps */
+	SET_(PROBE, LEN10, 0, FORMAT_NV12, 5, FPS_TO_INTERVAL(30), FORMAT_NV12, 5, 30),
+	GET_(UVC_GET_CUR, PROBE, LEN10, FORMAT_NV12, 5, 30),
+	SET_REPLY_(COMMIT, LEN10, FORMAT_NV12, 5, 30),
+};
+
+/* Requests no host should send, that still have to negotiate something */
+static const struct step invalid_steps[] = {
+	/* Unknown format: the default one */
+	SET_(PROBE, LEN, 1, 0, 1, FPS_TO_INTERVAL(30), FORMAT_NV12, 1, 30),
+	SET_(PROBE, LEN, 1, 5, 2, FPS_TO_INTERVAL(30), FORMAT_NV12, 1, 30),
+	/* Unknown frame: the default frame of the format */
+	SET_(PROBE, LEN, 1, FORMAT_YUY2, 0, 0, FORMAT_YUY2, 1, 30),
+	SET_(PROBE, LEN, 1, FORMAT_YUY2, 6, FPS_TO_INTERVAL(60), FORMAT_YUY2, 1, 30),
+	SET_(PROBE, LEN, 1, FORMAT_RGB32, 2, FPS_TO_INTERVAL(15), FORMAT_RGB32, 1, 15),
+	/* Out of range intervals */
+	SET_(PROBE, LEN, 1, FORMAT_NV12, 1, 1, FORMAT_NV12, 1, 60),
+	SET_(PROBE, LEN, 1, FORMAT_NV12, 1, ~0u, FORMAT_NV12, 1, 30),
+	/* A short commit is zero-extended */
+	SET_(COMMIT, 4, 0, FORMAT_MJPEG, 3, 0, FORMAT_MJPEG, 3, 60),
+	GET_(UVC_GET_CUR, COMMIT, LEN, FORMAT_MJPEG, 3, 60),
+};
+
+#define SEQUENCE(name, steps) { name, steps, sizeof(steps) / sizeof(*steps) }
+
+static const struct sequence sequences[] = {
+	SEQUENCE("Linux", linux_steps),
+	SEQUENCE("Windows", windows_steps),
+	SEQUENCE("macOS", macos_steps),
+	SEQUENCE("invalid", invalid_steps),
+};
+
+struct device {
+	struct uvc_streaming_control probe;
+	struct uvc_streaming_control commit;
+};
+
+/* uvc_handle_video_streaming_req_recv() */
+static void device_set_cur(struct device *dev, uint8_t control,
+			   const struct uvc_streaming_control *data, uint16_t length)
+{
+	struct uvc_streaming_control req;
+
+	memset(&req, 0, sizeof(req));
+	memcpy(&req, data, length < sizeof(req) ? length : sizeof(req));
+
+	uvc_negotiate(control == PROBE ? &dev->probe : &dev->commit, &req,
+		      &control_default, &ops);
+}
+
+/* uvc_handle_video_streaming_req() */
+static void device_get(struct device *dev, uint8_t request, uint8_t control,
+		       struct uvc_streaming_control *reply, uint16_t length)
+{
+	struct uvc_streaming_control ctrl, req;
+
+	switch (request) {
+	case UVC_GET_MIN:
+	case UVC_GET_MAX:
+		req = dev->probe;
+		req.dwFrameInterval = (request == UVC_GET_MIN) ? 1 : ~0u;
+		uvc_negotiate(&ctrl, &req, &control_default, &ops);
+		break;
+	case UVC_GET_DEF:
+		uvc_negotiate(&ctrl, &control_default, &control_default, &ops);
+		break;
+	case UVC_GET_CUR:
+	default:
+		ctrl = control == PROBE ? dev->probe : dev->commit;
+		break;
+	}
+
+	memcpy(reply, &ctrl, length < sizeof(ctrl) ? length : sizeof(ctrl));
+}
+
+static int check_sizes(const struct uvc_streaming_control *ctrl)
+{
+	const struct format *format = format_find(ctrl->bFormatIndex);
+	const struct uvc_mode *mode;
+	unsigned int frame_size;
+
+	if (!format || ctrl->bFrameIndex < 1 || ctrl->bFrameIndex > format->num_frames)
+		return -1;
+
+	mode = &format->frames[ctrl->bFrameIndex - 1];
+	if (format->bpp == 0)
+		frame_size = mode->width * mode->height * 3 / 2;
+	else
+		frame_size = mode->width * mode->height * format->bpp;
+
+	if (ctrl->dwMaxVideoFrameSize != frame_size)
+		return -1;
+
+	/* One payload per frame, or one per band with the NV12 UV plane last */
+	if (num_slices == 1 || ctrl->bFormatIndex == FORMAT_MJPEG)
+		return ctrl->dwMaxPayloadTransferSize == UVC_PAYLOAD_SIZE(frame_size) ? 0 : -1;
+
+	if (ctrl->dwMaxPayloadTransferSize < UVC_PAYLOAD_SIZE(frame_size / num_slices) ||
+	    ctrl->dwMaxPayloadTransferSize >= UVC_PAYLOAD_SIZE(frame_size))
+		return -1;
+
+	return 0;
+}
+
+static int check(const struct step *step, const struct uvc_streaming_control *ctrl,
+		 uint16_t length)
+{
+	unsigned int i;
+
+	if (ctrl->bFormatIndex != step->exp_format ||
+	    ctrl->bFrameIndex != step->exp_frame ||
+	    ctrl->dwFrameInterval != step->exp_interval) {
+		printf("  got format %u frame %u interval %u, expected %u %u %u\n",
+		       ctrl->bFormatIndex, ctrl->bFrameIndex, ctrl->dwFrameInterval,
+		       step->exp_format, step->exp_frame, step->exp_interval);
+		return -1;
+	}
+
+	if (check_sizes(ctrl) < 0) {
+		printf("  format %u frame %u: dwMaxVideoFrameSize %u, "
+		       "dwMaxPayloadTransferSize %u\n", ctrl->bFormatIndex,
+		       ctrl->bFrameIndex, ctrl->dwMaxVideoFrameSize,
+		       ctrl->dwMaxPayloadTransferSize);
+		return -1;
+	}
+
+	/* Nothing past wLength, the rest is what the device negotiated */
+	if (length < CONTROL_SIZE) {
+		for (i = length; i < CONTROL_SIZE; i++) {
+			if (((const uint8_t *)ctrl)[i] != 0) {
+				printf("  reply longer than wLength %u\n", length);
+				return -1;
+			}
+		}
+	} else if (ctrl->dwClockFrequency != 48000000 || ctrl->bPreferedVersion != 1) {
+		printf("  unexpected dwClockFrequency or bPreferedVersion\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static unsigned int replay(const struct sequence *seq)
+{
+	struct uvc_streaming_control reply, req;
+	struct device dev;
+	unsigned int i, errors = 0;
+
+	/* module_start() */
+	uvc_negotiate(&dev.probe, &control_default, &control_default, &ops);
+	dev.commit = dev.probe;
+	memset(&reply, 0, sizeof(reply));
+
+	for (i = 0; i < seq->num_steps; i++) {
+		const struct step *step = &seq->steps[i];
+		const struct uvc_streaming_control *result;
+
+		switch (step->type) {
+		case GET:
+			memset(&reply, 0, sizeof(reply));
+			device_get(&dev, step->request, step->control, &reply, step->length);
+			result = &reply;
+			break;
+		default:
+			if (step->type == SET) {
+				memset(&req, 0, sizeof(req));
+			} else {
+				req = reply;
+			}
+			if (step->type != SET_REPLY) {
+				req.bmHint = step->hint;
+				req.bFormatIndex = step->format;
+				req.bFrameIndex = step->frame;
+				req.dwFrameInterval = step->interval;
+			}
+			device_set_cur(&dev, step->control, &req, step->length);
+			result = step->control == PROBE ? &dev.probe : &dev.commit;
+			break;
+		}
+
+		if (check(step, result, step->type == GET ? step->length : CONTROL_SIZE) < 0) {
+			printf("  FAIL: %s step %u\n", seq->name, i + 1);
+			errors++;
+		}
+	}
+
+	/* What the host committed is what it probed last */
+	if (memcmp(&dev.commit, &dev.probe, sizeof(dev.commit)) != 0 &&
+	    seq->steps != invalid_steps) {
+		printf("  FAIL: %s: the commit differs from the probe\n", seq->name);
+		errors++;
+	}
+
+	return errors;
+}
+
+/*
+ * Every payload goes out in one request from its header slot: the header
+ * ends right where the data starts, the data is slot aligned and the
+ * header's cache line doesn't share anything with the previous payload.
+ */
+static int check_layout(const struct format *format, const struct uvc_mode *mode)
+{
+	struct uvc_frame_layout layout;
+	unsigned int i, end = 0, data_size;
+
+	mode_layout(format->index, mode, &layout);
+
+	for (i = 0; i < layout.num_slices; i++) {
+		data_size = layout.payload_size[i] - UVC_PAYLOAD_HEADER_SIZE;
+
+		if (layout.offset[i] % UVC_PAYLOAD_HEADER_SLOT != 0 ||
+		    layout.offset[i] < end + UVC_PAYLOAD_HEADER_SLOT ||
+		    layout.offset[i] + data_size > layout.size) {
+			printf("  format %u %ux%u: payload %u at %u, size %u, buffer %u\n",
+			       format->index, mode->width, mode->height, i,
+			       layout.offset[i], layout.payload_size[i], layout.size);
+			return -1;
+		}
+
+		end = ALIGN_SLOT(layout.offset[i] + data_size);
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	static const unsigned int slices[] = { 1, 4, UVC_MAX_FRAME_SLICES };
+	unsigned int s, i, j, errors;
+	int failures = 0;
+
+	for (s = 0; s < sizeof(slices) / sizeof(*slices); s++) {
+		num_slices = slices[s];
+
+		for (i = 0; i < sizeof(formats) / sizeof(*formats); i++) {
+			for (j = 0; j < formats[i].num_frames; j++) {
+				if (check_layout(&formats[i], &formats[i].frames[j]) < 0) {
+					printf("  FAIL: layout, %u slices\n", num_slices);
+					failures++;
+				}
+			}
+		}
+
+		for (i = 0; i < sizeof(sequences) / sizeof(*sequences); i++) {
+			errors = replay(&sequences[i]);
+			printf("%-8s %u slice%s: %2u steps, %s\n", sequences[i].name,
+			       num_slices, num_slices > 1 ? "s" : " ",
+			       sequences[i].num_steps, errors ? "FAIL" : "ok");
+			if (errors)
+				failures++;
+		}
+	}
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Host test of the frame pacer (src/pacer.c).
+ *
+ * Feeds uvc_pacer_tick() synthetic vblank sequences, including dropped
+ * vblanks and late callbacks that cover several vblanks (notifyCount > 1),
+ * and checks the long-run frame rate and that the pacer never bursts frames
+ * to catch up.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include "pacer.h"
+
+#define FPS_TO_INTERVAL(fps)	(10000000 / (fps))
+#define SECONDS			(60ull * 10000000)
+#define BURST_FRAMES		4
+
+struct sequence {
+	const char *name;
+	unsigned int drop;		/* 1 in drop vblanks is lost */
+	unsigned int coalesce;		/* Up to coalesce vblanks per callback */
+	unsigned int latency;		/* Max callback latency */
+};
+
+static const struct sequence sequences[] = {
+	{ "steady",	0,  1, 0 },
+	{ "jitter",	0,  1, 20000 },
+	{ "dropped",	10, 1, 0 },
+	{ "coalesced",	0,  3, 30000 },
+	{ "both",	7,  3, 30000 },
+};
+
+static const unsigned int rates[] = { 60, 50, 30, 25, 24, 20, 15, 10, 5 };
+
+static uint32_t rand_state = 1;
+
+static unsigned int rand_next(unsigned int n)
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return (rand_state >> 16) % n;
+}
+
+/*
+ * Runs the pacer over SECONDS of vblanks. Returns the number of failures.
+ */
+static int run(const struct sequence *seq, unsigned int fps)
+{
+	struct uvc_pacer pacer;
+	unsigned int interval = FPS_TO_INTERVAL(fps);
+	unsigned int callbacks = 0, resyncs = 0, bursts = 0;
+	uint64_t vblank = 0, expected;
+	uint64_t history[BURST_FRAMES];	/* Times of the last frames */
+	int failures = 0;
+
+	uvc_pacer_reset(&pacer, interval);
+
+	if (uvc_pacer_tick(&pacer, 0)) {
+		printf("  %s %u fps: first tick captured a frame\n", seq->name, fps);
+		failures++;
+	}
+
+	while (vblank < SECONDS) {
+		unsigned int count = seq->coalesce > 1 ? 1 + rand_next(seq->coalesce) : 1;
+		uint64_t now;
+
+		vblank += (uint64_t)count * PACER_VBLANK_INTERVAL;
+		if (seq->drop && rand_next(seq->drop) == 0)
+			continue;
+
+		now = vblank + (seq->latency ? rand_next(seq->latency) : 0);
+		callbacks++;
+
+		if (now >= pacer.deadline + pacer.interval)
+			resyncs++;
+
+		if (!uvc_pacer_tick(&pacer, now))
+			continue;
+
+		/*
+		 * A frame is captured at most half a vblank early and less
+		 * than an interval late, so catching up can shorten a period
+		 * but frames BURST_FRAMES apart are still more than
+		 * BURST_FRAMES - 1 intervals (less half a vblank) apart.
+		 */
+		if (pacer.frames > BURST_FRAMES &&
+		    now - history[pacer.frames % BURST_FRAMES] <=
+		    (uint64_t)(BURST_FRAMES - 1) * interval - PACER_VBLANK_INTERVAL / 2)
+			bursts++;
+		history[pacer.frames % BURST_FRAMES] = now;
+	}
+
+	expected = SECONDS / interval;
+
+	printf("  %-10s %2u fps: %5u frames (expected %5llu), %5u callbacks, "
+	       "%3u resyncs, jitter avg %4llu max %6u\n", seq->name, fps,
+	       pacer.frames, (unsigned long long)expected, callbacks, resyncs,
+	       (unsigned long long)(pacer.frames ? pacer.jitter_total / pacer.frames : 0),
+	       pacer.jitter_max);
+
+	/* Never more frames than the committed rate */
+	if (pacer.frames > expected + 1) {
+		printf("  FAIL: too many frames\n");
+		failures++;
+	}
+
+	/*
+	 * Late vblanks are caught up and only a resync loses frames, unless
+	 * there are fewer callbacks than frames.
+	 */
+	if (pacer.frames + 2 * resyncs + 1 < expected &&
+	    pacer.frames + 1 < callbacks) {
+		printf("  FAIL: frames lost\n");
+		failures++;
+	}
+
+	if (bursts) {
+		printf("  FAIL: %u bursts of frames\n", bursts);
+		failures++;
+	}
+
+	return failures;
+}
+
+int main(void)
+{
+	unsigned int i, j;
+	int failures = 0;
+
+	for (i = 0; i < sizeof(sequences) / sizeof(*sequences); i++) {
+		printf("%s vblanks:\n", sequences[i].name);
+		for (j = 0; j < sizeof(rates) / sizeof(*rates); j++)
+			failures += run(&sequences[i], rates[j]);
+	}
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
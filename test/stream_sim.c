@@ -0,0 +1,535 @@
+/*
+ * Host timing model of the streaming pipeline (uvc_stream_process() in
+ * src/main.c).
+ *
+ * The IFTU conversion and the bulk transfers are modelled by their rates,
+ * with the frame layouts of src/negotiate.c and the scheduling of the
+ * plugin: frames are captured on the vblanks picked by the frame pacer
+ * (src/pacer.c) into a free ring buffer, replacing the queued frame when
+ * none is free, payloads are submitted as soon as they are converted, up to
+ * XFER_DEPTH of them, and the thread converts the next slice while the
+ * controller sends. Every vblank is assumed to bring a new frame.
+ *
+ * It checks that with two ring buffers the frame period is the longest of
+ * the conversion and the transfer of a frame, not their sum like with one.
+ * It also reports the conversion and transfer time of every slice and when
+ * it is done after the capture, and checks that more slices don't make the
+ * latency worse. With NV12 the last payload carries the whole UV plane,
+ * which bounds what slicing can gain.
+ *
+ * Last, it compares the frame buffers in main RAM and in CDRAM for every
+ * mode, each placement with its own rates. How much the game slows down
+ * either of them (the CPU on main RAM, the GPU on CDRAM) depends on the
+ * game and isn't modelled: that's what the rates measured on the device
+ * while it runs account for.
+ *
+ * The rates are assumptions, not measurements. Calibrate them with the
+ * averages logged by a UVC_BENCH build (make BENCH=1), which alternates
+ * between both placements: the IFTU rate is the pixels of a slice over its
+ * CSC time, the USB rate the bytes of a payload over its xfer time. Then run
+ *   ./stream_sim [IFTU Mpixel/s] [USB MB/s] [CDRAM IFTU Mpixel/s] [CDRAM USB MB/s]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "negotiate.h"
+#include "pacer.h"
+
+#define FPS_TO_INTERVAL(fps)	(10000000 / (fps))
+#define SIM_TIME		(10 * 1000000.0)	/* us */
+#define VBLANK_US		(PACER_VBLANK_INTERVAL / 10.0)
+
+/* main.c defaults */
+#define RING_SIZE_MAX		2	/* UVC_FRAME_RING_SIZE */
+#define XFER_DEPTH		3	/* UVC_XFER_DEPTH */
+
+/* Assumed, see above: 896x504 NV12 at almost 60 fps like the README says */
+#define DEFAULT_IFTU_MPIX	150.0
+#define DEFAULT_USB_MBS		42.0
+/* Assumed too: faster IFTU writes to the video memory, slower DMA reads */
+#define DEFAULT_CDRAM_IFTU_MPIX	165.0
+#define DEFAULT_CDRAM_USB_MBS	40.0
+#define USB_REQ_US		20.0	/* Per request */
+
+struct model {
+	double iftu_mpix;	/* Output pixels per us */
+	double usb_mbs;		/* Bytes per us */
+};
+
+struct config {
+	const char *name;
+	unsigned int width;
+	unsigned int height;
+	unsigned int bpp;	/* 0 for NV12 */
+	unsigned int fps;
+	unsigned int ring_size;
+	unsigned int num_slices;
+};
+
+struct result {
+	unsigned int frames;
+	unsigned int skipped;
+	unsigned int replaced;
+	double fps;
+	double latency;		/* Capture to the end of the last payload, us */
+	double csc_frame;	/* Conversion time of a frame, us */
+	double xfer_frame;	/* Transfer time of a frame, us */
+	double slice_done[UVC_MAX_FRAME_SLICES];	/* Capture to the end of each payload, us */
+};
+
+struct sim {
+	const struct model *model;
+	const struct config *config;
+	struct uvc_frame_layout layout;
+	struct {
+		double capture_time;
+		unsigned int converted;
+		unsigned int sent;
+		unsigned int done;
+	} ring[RING_SIZE_MAX];
+	unsigned int ring_index;
+	int cur;
+	int next;
+	struct {
+		int index;
+		unsigned int payload;
+		double end;
+	} xfers[XFER_DEPTH];
+	unsigned int submitted;
+	unsigned int retired;
+	double bus_free;	/* When the controller is done with what it has */
+	struct result result;
+	double latency_total;
+	unsigned int slice_count[UVC_MAX_FRAME_SLICES];
+};
+
+static unsigned int slice_rows(const struct uvc_frame_layout *layout, unsigned int slice)
+{
+	unsigned int rows = layout->height - slice * layout->slice_height;
+
+	return rows < layout->slice_height ? rows : layout->slice_height;
+}
+
+static double csc_time(const struct sim *sim, unsigned int slice)
+{
+	return sim->layout.width * slice_rows(&sim->layout, slice) / sim->model->iftu_mpix;
+}
+
+static double xfer_time(const struct sim *sim, unsigned int payload)
+{
+	return USB_REQ_US + sim->layout.payload_size[payload] / sim->model->usb_mbs;
+}
+
+/* uvc_stream_xfer_done() */
+static void sim_xfer_done(struct sim *sim, double now)
+{
+	unsigned int payload;
+	int index;
+
+	while (sim->retired != sim->submitted &&
+	       sim->xfers[sim->retired % XFER_DEPTH].end <= now) {
+		index = sim->xfers[sim->retired % XFER_DEPTH].index;
+		payload = sim->xfers[sim->retired % XFER_DEPTH].payload;
+		sim->retired++;
+
+		sim->result.slice_done[payload] += now - sim->ring[index].capture_time;
+		sim->slice_count[payload]++;
+
+		if (++sim->ring[index].done == sim->layout.num_slices && index == sim->cur) {
+			sim->result.frames++;
+			sim->latency_total += now - sim->ring[index].capture_time;
+			sim->cur = sim->next;
+			sim->next = -1;
+		}
+	}
+}
+
+/* capture_frame() with uvc_frame_ring_get_free() and FRAME_POLICY_DROP_OLDEST */
+static void sim_capture(struct sim *sim, double now)
+{
+	unsigned int i;
+	int index = -1;
+
+	for (i = 0; i < sim->config->ring_size; i++) {
+		int j = (sim->ring_index + i) % sim->config->ring_size;
+
+		if (j != sim->cur && j != sim->next) {
+			index = j;
+			break;
+		}
+	}
+
+	if (index < 0) {
+		if (sim->next < 0 || sim->ring[sim->next].sent > 0) {
+			sim->result.skipped++;
+			return;
+		}
+		index = sim->next;
+		sim->next = -1;
+		sim->result.replaced++;
+	}
+
+	sim->ring[index].capture_time = now;
+	sim->ring[index].converted = 0;
+	sim->ring[index].sent = 0;
+	sim->ring[index].done = 0;
+
+	if (sim->cur < 0)
+		sim->cur = index;
+	else
+		sim->next = index;
+
+	sim->ring_index = (index + 1) % sim->config->ring_size;
+}
+
+/* uvc_stream_get_unsent() */
+static int sim_get_unsent(const struct sim *sim)
+{
+	int index = sim->cur;
+
+	if (index < 0)
+		return -1;
+	if (sim->ring[index].sent < sim->ring[index].converted)
+		return index;
+	if (sim->ring[index].sent < sim->layout.num_slices)
+		return -1;
+
+	index = sim->next;
+	if (index >= 0 && sim->ring[index].sent < sim->ring[index].converted)
+		return index;
+
+	return -1;
+}
+
+/* uvc_stream_get_unconverted() */
+static int sim_get_unconverted(const struct sim *sim)
+{
+	if (sim->cur >= 0 && sim->ring[sim->cur].converted < sim->layout.num_slices)
+		return sim->cur;
+	if (sim->next >= 0 && sim->ring[sim->next].converted < sim->layout.num_slices)
+		return sim->next;
+
+	return -1;
+}
+
+/* send_payload(): the controller sends the requests one after the other */
+static void sim_send(struct sim *sim, int index, double now)
+{
+	unsigned int payload = sim->ring[index].sent++;
+	double start = now > sim->bus_free ? now : sim->bus_free;
+
+	sim->bus_free = start + xfer_time(sim, payload);
+	sim->xfers[sim->submitted % XFER_DEPTH].index = index;
+	sim->xfers[sim->submitted % XFER_DEPTH].payload = payload;
+	sim->xfers[sim->submitted % XFER_DEPTH].end = sim->bus_free;
+	sim->submitted++;
+}
+
+static void sim_run(const struct model *model, const struct config *config,
+		    struct result *result)
+{
+	static struct sim sim;
+	struct uvc_pacer pacer;
+	double now = 0, vblank = 0, wake;
+	unsigned int i;
+	int index;
+
+	sim = (struct sim){ .model = model, .config = config, .cur = -1, .next = -1 };
+
+	if (config->bpp)
+		uvc_frame_layout_packed(&sim.layout, config->width, config->height,
+					config->bpp, config->num_slices);
+	else
+		uvc_frame_layout_nv12(&sim.layout, config->width, config->height,
+				      config->num_slices);
+
+	for (i = 0; i < sim.layout.num_slices; i++) {
+		sim.result.csc_frame += csc_time(&sim, i);
+		sim.result.xfer_frame += xfer_time(&sim, i);
+	}
+
+	/* The commit captures the first frame */
+	uvc_pacer_reset(&pacer, FPS_TO_INTERVAL(config->fps));
+	uvc_pacer_tick(&pacer, 0);
+	sim_capture(&sim, 0);
+	vblank = VBLANK_US;
+
+	while (now < SIM_TIME) {
+		sim_xfer_done(&sim, now);
+
+		/* Vblanks that went by while converting are only seen now */
+		if (vblank <= now) {
+			while (vblank + VBLANK_US <= now)
+				vblank += VBLANK_US;
+			if (uvc_pacer_tick(&pacer, (uint64_t)(vblank * 10)))
+				sim_capture(&sim, now);
+			vblank += VBLANK_US;
+		}
+
+		index = sim_get_unsent(&sim);
+		if (index >= 0 && sim.submitted - sim.retired < XFER_DEPTH) {
+			sim_send(&sim, index, now);
+			continue;
+		}
+
+		index = sim_get_unconverted(&sim);
+		if (index >= 0) {
+			now += csc_time(&sim, sim.ring[index].converted);
+			sim.ring[index].converted++;
+			continue;
+		}
+
+		/* Blocks until the next vblank or completion */
+		wake = vblank;
+		if (sim.retired != sim.submitted &&
+		    sim.xfers[sim.retired % XFER_DEPTH].end < wake)
+			wake = sim.xfers[sim.retired % XFER_DEPTH].end;
+		now = wake;
+	}
+
+	*result = sim.result;
+	result->fps = result->frames / (now / 1000000.0);
+	result->latency = result->frames ? sim.latency_total / result->frames : 0;
+	for (i = 0; i < sim.layout.num_slices; i++) {
+		if (sim.slice_count[i])
+			result->slice_done[i] /= sim.slice_count[i];
+	}
+}
+
+static void print_result(const struct config *config, const struct result *result)
+{
+	printf("%-8s %4ux%-4u %2u fps, ring %u, %u slice%s: csc %5.2f ms, xfer %5.2f ms"
+	       " -> %5.2f fps, latency %5.2f ms, %u skipped, %u replaced\n",
+	       config->name, config->width, config->height, config->fps,
+	       config->ring_size, config->num_slices, config->num_slices > 1 ? "s" : " ",
+	       result->csc_frame / 1000, result->xfer_frame / 1000,
+	       result->fps, result->latency / 1000, result->skipped, result->replaced);
+}
+
+static const struct config overlap_configs[] = {
+	{ "NV12",  960, 544, 0, 60, 1, 1 },
+	{ "NV12",  896, 504, 0, 60, 1, 1 },
+	{ "NV12",  480, 272, 0, 60, 1, 1 },
+	{ "NV12", 1280, 720, 0, 30, 1, 1 },
+	{ "YUY2",  960, 544, 2, 30, 1, 1 },
+	{ "RGB32", 960, 544, 4, 20, 1, 1 },
+};
+
+/*
+ * A frame rate bound by the vblanks: the best the pipeline can do is the
+ * rate of its slowest stage, rounded down to a whole number of vblanks per
+ * frame when it has to wait for one to start the next frame.
+ */
+static double fps_bound(double period, unsigned int fps)
+{
+	double rate = 1000000.0 / period;
+
+	return rate < fps ? rate : fps;
+}
+
+/*
+ * Ring overlap: with one buffer a frame is converted then sent, with two
+ * the next one is converted while the current one is sent.
+ */
+static int check_overlap(const struct model *model)
+{
+	struct config config;
+	struct result serial, overlap;
+	double slowest;
+	unsigned int i;
+	int failures = 0;
+
+	for (i = 0; i < sizeof(overlap_configs) / sizeof(*overlap_configs); i++) {
+		config = overlap_configs[i];
+
+		config.ring_size = 1;
+		sim_run(model, &config, &serial);
+		print_result(&config, &serial);
+
+		config.ring_size = 2;
+		sim_run(model, &config, &overlap);
+		print_result(&config, &overlap);
+
+		slowest = serial.csc_frame > serial.xfer_frame ?
+			  serial.csc_frame : serial.xfer_frame;
+
+		/* Not faster than the stages added up, give or take a frame */
+		if (serial.fps > fps_bound(serial.csc_frame + serial.xfer_frame,
+					   config.fps) * 1.01 + 0.1) {
+			printf("  FAIL: ring 1 faster than conversion + transfer\n");
+			failures++;
+		}
+
+		/* The slowest stage alone, minus the vblank granularity */
+		if (overlap.fps < fps_bound(slowest, config.fps) * 0.95) {
+			printf("  FAIL: ring 2 isn't bound by the slowest stage\n");
+			failures++;
+		}
+
+		if (overlap.fps < serial.fps * 0.99) {
+			printf("  FAIL: ring 2 slower than ring 1\n");
+			failures++;
+		}
+	}
+
+	return failures;
+}
+
+static const struct config slice_configs[] = {
+	{ "NV12",  960, 544, 0, 30, 2, 1 },
+	{ "NV12",  480, 272, 0, 60, 2, 1 },
+	{ "NV12", 1280, 720, 0, 30, 2, 1 },
+	{ "YUY2",  960, 544, 2, 30, 2, 1 },
+};
+
+/*
+ * Per-slice timing with 1, 2, 4 and 8 slices, at frame rates the pipeline
+ * keeps up with so that the latency isn't the time spent queued.
+ */
+static int check_slices(const struct model *model)
+{
+	static const unsigned int slices[] = { 1, 2, 4, UVC_MAX_FRAME_SLICES };
+	struct uvc_frame_layout layout;
+	struct config config;
+	struct result result;
+	double prev_latency;
+	unsigned int i, s, j;
+	int failures = 0;
+
+	for (i = 0; i < sizeof(slice_configs) / sizeof(*slice_configs); i++) {
+		config = slice_configs[i];
+		prev_latency = 0;
+
+		for (s = 0; s < sizeof(slices) / sizeof(*slices); s++) {
+			config.num_slices = slices[s];
+			sim_run(model, &config, &result);
+			print_result(&config, &result);
+
+			if (config.bpp)
+				uvc_frame_layout_packed(&layout, config.width, config.height,
+							config.bpp, config.num_slices);
+			else
+				uvc_frame_layout_nv12(&layout, config.width, config.height,
+						      config.num_slices);
+
+			for (j = 0; j < layout.num_slices; j++) {
+				unsigned int rows = slice_rows(&layout, j);
+
+				printf("  slice %u: %3u rows%s csc %5.2f ms, xfer %5.2f ms,"
+				       " done %5.2f ms after the capture\n", j, rows,
+				       !config.bpp && j == layout.num_slices - 1 ? " + UV," : ",     ",
+				       config.width * rows / model->iftu_mpix / 1000,
+				       (USB_REQ_US + layout.payload_size[j] / model->usb_mbs) / 1000,
+				       result.slice_done[j] / 1000);
+			}
+
+			/* A few more requests, so give or take their overhead */
+			if (prev_latency > 0 &&
+			    result.latency > prev_latency + config.num_slices * USB_REQ_US) {
+				printf("  FAIL: %u slices have more latency than %u\n",
+				       slices[s], slices[s - 1]);
+				failures++;
+			}
+			prev_latency = result.latency;
+		}
+	}
+
+	return failures;
+}
+
+static const struct config placement_configs[] = {
+	{ "NV12",  960, 544, 0, 60, 2, 1 },
+	{ "NV12",  896, 504, 0, 60, 2, 1 },
+	{ "NV12",  864, 488, 0, 60, 2, 1 },
+	{ "NV12",  480, 272, 0, 60, 2, 1 },
+	{ "NV12", 1280, 720, 0, 30, 2, 1 },
+	{ "YUY2",  960, 544, 2, 30, 2, 1 },
+	{ "YUY2", 1280, 720, 2, 20, 2, 1 },
+	{ "RGB32", 960, 544, 4, 20, 2, 1 },
+};
+
+/*
+ * Frame buffers in main RAM (PHYCONT) against CDRAM: the conversion and
+ * transfer time of a frame, and what the stream gets out of them, the better
+ * one starred. Whatever the rates, each placement has to be bound by its
+ * slowest stage.
+ */
+static int check_placement(const struct model *main_ram, const struct model *cdram)
+{
+	const struct model *models[] = { main_ram, cdram };
+	static const char *const names[] = { "main RAM", "CDRAM" };
+	struct result result[2];
+	const struct config *config;
+	unsigned int i, p, best;
+	double slowest;
+	int failures = 0;
+
+	for (i = 0; i < sizeof(placement_configs) / sizeof(*placement_configs); i++) {
+		config = &placement_configs[i];
+
+		for (p = 0; p < 2; p++)
+			sim_run(models[p], config, &result[p]);
+
+		/* The higher frame rate, then the lower latency */
+		if (result[0].fps != result[1].fps)
+			best = result[1].fps > result[0].fps;
+		else
+			best = result[1].latency < result[0].latency;
+
+		printf("%-8s %4ux%-4u %2u fps\n", config->name, config->width,
+		       config->height, config->fps);
+		for (p = 0; p < 2; p++)
+			printf("  %-8s csc %5.2f ms, xfer %5.2f ms -> %5.2f fps, latency %5.2f ms%s\n",
+			       names[p], result[p].csc_frame / 1000, result[p].xfer_frame / 1000,
+			       result[p].fps, result[p].latency / 1000, p == best ? " *" : "");
+
+		for (p = 0; p < 2; p++) {
+			slowest = result[p].csc_frame > result[p].xfer_frame ?
+				  result[p].csc_frame : result[p].xfer_frame;
+			if (result[p].fps < fps_bound(slowest, config->fps) * 0.95) {
+				printf("  FAIL: %s isn't bound by the slowest stage\n", names[p]);
+				failures++;
+			}
+		}
+	}
+
+	return failures;
+}
+
+int main(int argc, char **argv)
+{
+	struct model model = { DEFAULT_IFTU_MPIX, DEFAULT_USB_MBS };
+	struct model cdram = { DEFAULT_CDRAM_IFTU_MPIX, DEFAULT_CDRAM_USB_MBS };
+	int failures = 0;
+
+	if (argc > 1)
+		model.iftu_mpix = atof(argv[1]);
+	if (argc > 2)
+		model.usb_mbs = atof(argv[2]);
+	if (argc > 3)
+		cdram.iftu_mpix = atof(argv[3]);
+	if (argc > 4)
+		cdram.usb_mbs = atof(argv[4]);
+	if (model.iftu_mpix <= 0 || model.usb_mbs <= 0 ||
+	    cdram.iftu_mpix <= 0 || cdram.usb_mbs <= 0) {
+		fprintf(stderr, "usage: %s [IFTU Mpixel/s] [USB MB/s] "
+			"[CDRAM IFTU Mpixel/s] [CDRAM USB MB/s]\n", argv[0]);
+		return 2;
+	}
+
+	printf("IFTU %.0f Mpixel/s, USB %.0f MB/s\n", model.iftu_mpix, model.usb_mbs);
+
+	failures += check_overlap(&model);
+	failures += check_slices(&model);
+
+	printf("Main RAM: IFTU %.0f Mpixel/s, USB %.0f MB/s; CDRAM: IFTU %.0f Mpixel/s, USB %.0f MB/s\n",
+	       model.iftu_mpix, model.usb_mbs, cdram.iftu_mpix, cdram.usb_mbs);
+	failures += check_placement(&model, &cdram);
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,410 @@
+/*
+ * Host parser of captured UVC payloads.
+ *
+ * Reads a Linux usbmon capture (tcpdump -i usbmonN -w file.pcap, or saved
+ * from Wireshark) of the video streaming IN endpoint, decodes the payload
+ * headers and reports, per frame and overall, the device-side latency from
+ * framebuffer capture (PTS) to payload submission (SCR), along with header
+ * errors. Bulk transfers are one payload per URB; isochronous URBs are split
+ * into their packets.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uvc.h"
+
+#define UVC_CLOCK_FREQUENCY	48000000
+
+#define PCAP_MAGIC		0xA1B2C3D4
+#define PCAP_MAGIC_NS		0xA1B23C4D
+#define LINKTYPE_USB_LINUX	189
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+
+#define USBMON_HEADER_SIZE	48
+#define USBMON_MMAPPED_HEADER_SIZE	64
+#define USBMON_ISO_DESC_SIZE	16
+
+#define XFER_TYPE_ISO		0
+#define XFER_TYPE_BULK		3
+
+struct frame {
+	unsigned int index;
+	unsigned int payloads;
+	unsigned int bytes;
+	int fid;
+	int has_pts;
+	uint32_t pts;
+	uint32_t first_scr;
+	uint32_t last_scr;
+	double first_arrival;
+	double last_arrival;
+	unsigned int errors;
+};
+
+struct latency {
+	unsigned int count;
+	double min;
+	double max;
+	double total;
+};
+
+static struct {
+	unsigned int clock;
+	int endpoint;
+	int device;
+	int verbose;
+
+	struct frame frame;
+	int in_frame;
+	int swapped;
+
+	unsigned int payloads;
+	unsigned int frames;
+	unsigned int bad_headers;
+	unsigned int err_payloads;
+	unsigned int pts_mismatch;
+	unsigned int missing_eof;
+	struct latency first_send;	/* PTS to the first payload's SCR */
+	struct latency last_send;	/* PTS to the last payload's SCR */
+	struct latency period;		/* PTS of consecutive frames */
+	uint32_t last_pts;
+	int has_last_pts;
+} parser;
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+	uint32_t val = get_le32(p);
+
+	if (parser.swapped)
+		val = (val >> 24) | ((val >> 8) & 0xFF00) |
+		      ((val << 8) & 0xFF0000) | (val << 24);
+
+	return val;
+}
+
+/*
+ * The PTS and SCR are 32-bit counters of the device clock, so differences
+ * are taken modulo 2^32 and are positive.
+ */
+static double clock_delta_us(uint32_t from, uint32_t to)
+{
+	return (uint32_t)(to - from) * 1000000.0 / parser.clock;
+}
+
+static void latency_add(struct latency *lat, double us)
+{
+	if (lat->count == 0 || us < lat->min)
+		lat->min = us;
+	if (lat->count == 0 || us > lat->max)
+		lat->max = us;
+	lat->total += us;
+	lat->count++;
+}
+
+static void latency_print(const char *name, const struct latency *lat)
+{
+	if (lat->count == 0) {
+		printf("%-24s n/a\n", name);
+		return;
+	}
+
+	printf("%-24s avg %9.1f us, min %9.1f us, max %9.1f us\n", name,
+	       lat->total / lat->count, lat->min, lat->max);
+}
+
+static void frame_end(int eof)
+{
+	struct frame *frame = &parser.frame;
+
+	if (!parser.in_frame)
+		return;
+
+	if (!eof)
+		parser.missing_eof++;
+
+	if (frame->has_pts) {
+		latency_add(&parser.first_send, clock_delta_us(frame->pts, frame->first_scr));
+		latency_add(&parser.last_send, clock_delta_us(frame->pts, frame->last_scr));
+
+		if (parser.has_last_pts)
+			latency_add(&parser.period, clock_delta_us(parser.last_pts, frame->pts));
+		parser.last_pts = frame->pts;
+		parser.has_last_pts = 1;
+	}
+
+	if (parser.verbose) {
+		printf("frame %5u: fid %d, %4u payloads, %8u bytes", frame->index,
+		       frame->fid, frame->payloads, frame->bytes);
+		if (frame->has_pts)
+			printf(", capture to send %8.1f-%8.1f us",
+			       clock_delta_us(frame->pts, frame->first_scr),
+			       clock_delta_us(frame->pts, frame->last_scr));
+		printf(", transfer %8.1f us%s%s\n",
+		       (frame->last_arrival - frame->first_arrival) * 1000000.0,
+		       eof ? "" : ", no EOF", frame->errors ? ", errors" : "");
+	}
+
+	parser.frames++;
+	parser.in_frame = 0;
+}
+
+static void payload_parse(const unsigned char *data, unsigned int size, double arrival)
+{
+	struct frame *frame = &parser.frame;
+	unsigned int header_size;
+	uint32_t pts = 0, scr = 0;
+	unsigned char flags;
+	int fid;
+
+	/* Zero-length packets are sent by isochronous endpoints with no data */
+	if (size == 0)
+		return;
+
+	if (size < 2) {
+		parser.bad_headers++;
+		return;
+	}
+
+	header_size = data[0];
+	flags = data[1];
+
+	if (header_size < 2 || header_size > size ||
+	    !(flags & UVC_STREAM_EOH) ||
+	    header_size < 2u + ((flags & UVC_STREAM_PTS) ? 4 : 0) +
+			  ((flags & UVC_STREAM_SCR) ? 6 : 0)) {
+		parser.bad_headers++;
+		return;
+	}
+
+	if (flags & UVC_STREAM_PTS)
+		pts = get_le32(&data[2]);
+	if (flags & UVC_STREAM_SCR)
+		scr = get_le32(&data[(flags & UVC_STREAM_PTS) ? 6 : 2]);
+
+	fid = flags & UVC_STREAM_FID;
+
+	/* A toggled FID starts a new frame even if the EOF was lost */
+	if (parser.in_frame && fid != frame->fid)
+		frame_end(0);
+
+	if (!parser.in_frame) {
+		memset(frame, 0, sizeof(*frame));
+		frame->index = parser.frames;
+		frame->fid = fid;
+		frame->has_pts = !!(flags & UVC_STREAM_PTS);
+		frame->pts = pts;
+		frame->first_scr = scr;
+		frame->first_arrival = arrival;
+		parser.in_frame = 1;
+	} else if ((flags & UVC_STREAM_PTS) && (!frame->has_pts || pts != frame->pts)) {
+		parser.pts_mismatch++;
+	}
+
+	if (flags & UVC_STREAM_ERR) {
+		parser.err_payloads++;
+		frame->errors++;
+	}
+
+	frame->payloads++;
+	frame->bytes += size - header_size;
+	frame->last_scr = scr;
+	frame->last_arrival = arrival;
+	parser.payloads++;
+
+	if (flags & UVC_STREAM_EOF)
+		frame_end(1);
+}
+
+/*
+ * Parses one usbmon record. Only completions of IN transfers carry the
+ * payloads.
+ */
+static void usbmon_parse(const unsigned char *rec, unsigned int size,
+			 unsigned int header_size, double arrival)
+{
+	unsigned int xfer_type, epnum, devnum, len_cap, ndesc = 0, i;
+	const unsigned char *data;
+
+	if (size < header_size)
+		return;
+
+	xfer_type = rec[9];
+	epnum = rec[10];
+	devnum = rec[11];
+	len_cap = get_u32(&rec[36]);
+
+	if (rec[8] != 'C' || !(epnum & 0x80) ||
+	    (xfer_type != XFER_TYPE_BULK && xfer_type != XFER_TYPE_ISO))
+		return;
+	if (parser.endpoint >= 0 && (int)(epnum & 0x7F) != parser.endpoint)
+		return;
+	if (parser.device >= 0 && (int)devnum != parser.device)
+		return;
+
+	if (header_size == USBMON_MMAPPED_HEADER_SIZE)
+		ndesc = get_u32(&rec[60]);
+
+	if (size - header_size < ndesc * USBMON_ISO_DESC_SIZE)
+		return;
+
+	data = rec + header_size + ndesc * USBMON_ISO_DESC_SIZE;
+	if (len_cap > size - header_size - ndesc * USBMON_ISO_DESC_SIZE)
+		len_cap = size - header_size - ndesc * USBMON_ISO_DESC_SIZE;
+
+	if (xfer_type == XFER_TYPE_BULK) {
+		payload_parse(data, len_cap, arrival);
+		return;
+	}
+
+	/* Without the descriptors the packet boundaries are unknown */
+	if (ndesc == 0) {
+		fprintf(stderr, "Isochronous transfers need a LINKTYPE_USB_LINUX_MMAPPED capture\n");
+		exit(1);
+	}
+
+	for (i = 0; i < ndesc; i++) {
+		const unsigned char *desc = rec + header_size + i * USBMON_ISO_DESC_SIZE;
+		int status = get_u32(&desc[0]);
+		uint32_t offset = get_u32(&desc[4]);
+		uint32_t len = get_u32(&desc[8]);
+
+		if (status != 0 || offset > len_cap || len > len_cap - offset)
+			continue;
+
+		payload_parse(data + offset, len, arrival);
+	}
+}
+
+static int pcap_parse(FILE *fp)
+{
+	unsigned char header[24], rec_header[16];
+	unsigned char *rec = NULL;
+	unsigned int linktype, header_size, caplen, snaplen;
+	double frac;
+	uint32_t magic;
+
+	if (fread(header, sizeof(header), 1, fp) != 1) {
+		fprintf(stderr, "Not a pcap file\n");
+		return -1;
+	}
+
+	magic = get_le32(header);
+	if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS) {
+		parser.swapped = 0;
+	} else {
+		parser.swapped = 1;
+		magic = get_u32(header);
+		if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS) {
+			fprintf(stderr, "Not a pcap file (pcapng is not supported)\n");
+			return -1;
+		}
+	}
+	frac = (magic == PCAP_MAGIC_NS) ? 1e-9 : 1e-6;
+
+	snaplen = get_u32(&header[16]);
+	linktype = get_u32(&header[20]);
+	if (linktype == LINKTYPE_USB_LINUX) {
+		header_size = USBMON_HEADER_SIZE;
+	} else if (linktype == LINKTYPE_USB_LINUX_MMAPPED) {
+		header_size = USBMON_MMAPPED_HEADER_SIZE;
+	} else {
+		fprintf(stderr, "Unsupported link type %u, expected a usbmon capture\n", linktype);
+		return -1;
+	}
+
+	if (snaplen == 0 || snaplen > 64 * 1024 * 1024)
+		snaplen = 64 * 1024 * 1024;
+	rec = malloc(snaplen);
+	if (!rec)
+		return -1;
+
+	while (fread(rec_header, sizeof(rec_header), 1, fp) == 1) {
+		caplen = get_u32(&rec_header[8]);
+		if (caplen > snaplen || fread(rec, 1, caplen, fp) != caplen) {
+			fprintf(stderr, "Truncated capture\n");
+			break;
+		}
+
+		usbmon_parse(rec, caplen, header_size,
+			     get_u32(&rec_header[0]) + get_u32(&rec_header[4]) * frac);
+	}
+
+	free(rec);
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-v] [-d device] [-e endpoint] [-c clock_hz] capture.pcap\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *fp;
+	int opt;
+
+	parser.clock = UVC_CLOCK_FREQUENCY;
+	parser.endpoint = -1;
+	parser.device = -1;
+
+	while ((opt = getopt(argc, argv, "vd:e:c:")) != -1) {
+		switch (opt) {
+		case 'v':
+			parser.verbose = 1;
+			break;
+		case 'd':
+			parser.device = strtol(optarg, NULL, 0);
+			break;
+		case 'e':
+			parser.endpoint = strtol(optarg, NULL, 0) & 0x7F;
+			break;
+		case 'c':
+			parser.clock = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1 || parser.clock == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fp = fopen(argv[optind], "rb");
+	if (!fp) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (pcap_parse(fp) < 0) {
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	/* The capture most likely stopped in the middle of the last frame */
+	parser.in_frame = 0;
+
+	printf("%u payloads, %u frames\n", parser.payloads, parser.frames);
+	printf("bad headers %u, ERR payloads %u, PTS changes within a frame %u, "
+	       "frames without EOF %u\n", parser.bad_headers, parser.err_payloads,
+	       parser.pts_mismatch, parser.missing_eof);
+	latency_print("capture to first send", &parser.first_send);
+	latency_print("capture to last send", &parser.last_send);
+	latency_print("frame period (PTS)", &parser.period);
+	if (parser.period.count)
+		printf("%-24s %.2f\n", "frame rate (PTS)",
+		       1000000.0 * parser.period.count / parser.period.total);
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * Polls the plugin's statistics Extension Unit control on Linux.
+ *
+ * Reads UVC_XU_STATS_CONTROL with UVCIOC_CTRL_QUERY, which needs no control
+ * mapping, and prints the counters along with the rates since the previous
+ * poll. Streaming can run in another program (e.g. a video player) at the
+ * same time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/uvcvideo.h>
+#include "uvc.h"
+
+/* EXTENSION_UNIT_ID and UVC_XU_STATS_CONTROL in usb_descriptors.h */
+#define XU_UNIT_ID		3
+#define XU_STATS_CONTROL	0x01
+
+/*
+ * Layout of struct uvc_xu_stats in src/main.c, little endian. Newer
+ * plugins may append counters: only the known ones are shown.
+ */
+struct xu_stats {
+	uint32_t frames_sent;
+	uint32_t frames_skipped;
+	uint32_t vblanks;
+	uint32_t csc_min_us;
+	uint32_t csc_avg_us;
+	uint32_t csc_max_us;
+	uint32_t xfer_min_us;
+	uint32_t xfer_avg_us;
+	uint32_t xfer_max_us;
+	uint32_t xfer_errors;
+	uint32_t reallocations;
+	uint32_t stalls;
+	uint32_t frames_replaced;
+	uint32_t frames_dropped;
+	uint32_t isoc_clamps;
+};
+
+#define XU_STATS_MAX_SIZE	256
+
+static int xu_query(int fd, uint8_t query, void *data, uint16_t size)
+{
+	struct uvc_xu_control_query xq = {
+		.unit = XU_UNIT_ID,
+		.selector = XU_STATS_CONTROL,
+		.query = query,
+		.size = size,
+		.data = data,
+	};
+
+	return ioctl(fd, UVCIOC_CTRL_QUERY, &xq);
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-i interval_ms] [-n count] /dev/videoN\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t buf[XU_STATS_MAX_SIZE];
+	struct xu_stats cur, prev;
+	unsigned int interval = 1000, count = 0, i;
+	uint16_t len;
+	double t, prev_t = 0;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1 || interval == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDWR);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (xu_query(fd, UVC_GET_LEN, &len, sizeof(len)) < 0) {
+		perror("UVC_GET_LEN");
+		close(fd);
+		return 1;
+	}
+
+	len = le16toh(len);
+	if (len == 0 || len > sizeof(buf) || len % 4) {
+		fprintf(stderr, "Unexpected statistics size %u\n", len);
+		close(fd);
+		return 1;
+	}
+	if (len < sizeof(cur))
+		fprintf(stderr, "Old plugin: %u of %zu bytes of statistics\n",
+			len, sizeof(cur));
+
+	printf("%8s %8s %8s %8s  %-17s %-17s %6s %6s %6s %8s %7s %6s\n",
+	       "fps", "skip/s", "vblank/s", "sent", "csc us min/avg/max",
+	       "xfer us min/avg/max", "errors", "reallc", "stalls", "replaced",
+	       "dropped", "clamps");
+
+	memset(&prev, 0, sizeof(prev));
+
+	for (i = 0; count == 0 || i < count; i++) {
+		double dt;
+
+		memset(buf, 0, sizeof(buf));
+		if (xu_query(fd, UVC_GET_CUR, buf, len) < 0) {
+			perror("UVC_GET_CUR");
+			break;
+		}
+		t = now_s();
+
+		memcpy(&cur, buf, sizeof(cur));
+		cur.frames_sent = le32toh(cur.frames_sent);
+		cur.frames_skipped = le32toh(cur.frames_skipped);
+		cur.vblanks = le32toh(cur.vblanks);
+		cur.csc_min_us = le32toh(cur.csc_min_us);
+		cur.csc_avg_us = le32toh(cur.csc_avg_us);
+		cur.csc_max_us = le32toh(cur.csc_max_us);
+		cur.xfer_min_us = le32toh(cur.xfer_min_us);
+		cur.xfer_avg_us = le32toh(cur.xfer_avg_us);
+		cur.xfer_max_us = le32toh(cur.xfer_max_us);
+		cur.xfer_errors = le32toh(cur.xfer_errors);
+		cur.reallocations = le32toh(cur.reallocations);
+		cur.stalls = le32toh(cur.stalls);
+		cur.frames_replaced = le32toh(cur.frames_replaced);
+		cur.frames_dropped = le32toh(cur.frames_dropped);
+		cur.isoc_clamps = le32toh(cur.isoc_clamps);
+
+		/* The counters start over when the plugin is reloaded */
+		if (i > 0 && cur.vblanks >= prev.vblanks &&
+		    cur.frames_sent >= prev.frames_sent &&
+		    cur.frames_skipped >= prev.frames_skipped) {
+			dt = t - prev_t;
+			printf("%8.2f %8.2f %8.2f", (cur.frames_sent - prev.frames_sent) / dt,
+			       (cur.frames_skipped - prev.frames_skipped) / dt,
+			       (cur.vblanks - prev.vblanks) / dt);
+		} else {
+			printf("%8s %8s %8s", "-", "-", "-");
+		}
+
+		printf(" %8u  %5u/%5u/%5u %5u/%5u/%5u %6u %6u %6u %8u %7u %6u\n",
+		       cur.frames_sent, cur.csc_min_us, cur.csc_avg_us,
+		       cur.csc_max_us, cur.xfer_min_us, cur.xfer_avg_us,
+		       cur.xfer_max_us, cur.xfer_errors, cur.reallocations,
+		       cur.stalls, cur.frames_replaced, cur.frames_dropped,
+		       cur.isoc_clamps);
+		fflush(stdout);
+
+		prev = cur;
+		prev_t = t;
+
+		if (count == 0 || i + 1 < count)
+			usleep(interval * 1000);
+	}
+
+	close(fd);
+
+	return 0;
+}